@@ -0,0 +1,713 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include "functions.h"
+#include "lattice.h"
+#include "bs_batch.h"
+#include "thread_pool.h"
+#include "pricing_cache.h"
+#include "distributed.h"
+#include "metrics.h"
+
+/*
+Headless pricer: streams option specs in, prices them on the thread pool and
+streams the results out, a block of rows at a time, in input order.
+
+Usage: batch_pricer [options] [input [output]]   ("-" or nothing: stdin / stdout)
+  --threads N     threads used (default, and at most: all cores)
+  --binary-in     input is PricingRecord structs instead of CSV, a partial record at the
+                  end is an error (exit status 1) after the whole ones are priced
+  --binary-out    output is PricingOutput structs instead of CSV
+  --paths N       Monte Carlo paths when a row doesn't say (default 100000)
+  --steps N       tree steps when a row doesn't say (default 1000)
+  --seed S        Monte Carlo row i uses seed S + i (default 42)
+  --same-seed     every Monte Carlo row uses seed S, so identical rows give identical prices
+  --cache N       remember the last N tree prices, repeated rows aren't repriced (default 0: off)
+  --mc-cache N    same for Monte Carlo rows, keyed on the seed too: mostly useful with --same-seed
+  --workers LIST  Monte Carlo rows spread over worker processes, LIST is host:port[*connections],...
+  --spawn N       fork a local worker server taking N connections and add it to the workers
+  --sliced        Monte Carlo rows cut in slices like --workers, but all priced here: same prices
+  --timeout S     a worker silent for S seconds is dropped and its slices reassigned (default 60)
+  --serve ADDR:PORT
+                  be a worker: serve slices to coordinators on the local address ADDR
+                  until killed; 127.0.0.1 for this host only, 0.0.0.0 for every interface
+  --metrics FILE  write the stage timers at the end, JSON if FILE ends in .json, Prometheus
+                  text otherwise (needs a METRICS=1 build to be more than zeros)
+
+CSV input, one option per line, '#' comments and a header starting with "engine" skipped:
+  engine,type,exercise,spot,strike,rate,time,vol[,steps]
+  engine is bs, binomial, trinomial or mc; type call or put; exercise european or american;
+  steps is the tree size or the number of Monte Carlo paths, a whole number, 0 or missing
+  for the default.
+CSV output: row,price,std_error,status (std_error is 0 except for mc)
+With a cluster (--workers, --spawn or --sliced) Monte Carlo rows are priced one at a time,
+each spread over every worker, and the prices don't depend on the workers that took part.
+*/
+
+enum Engine
+{
+    ENGINE_BS,
+    ENGINE_BINOMIAL,
+    ENGINE_TRINOMIAL,
+    ENGINE_MC
+};
+
+// Binary input record, host byte order
+struct PricingRecord
+{
+    uint8_t engine; // Engine
+    uint8_t call;
+    uint8_t american;
+    uint8_t reserved;
+    int32_t steps;
+    double spot;
+    double strike;
+    double rate;
+    double time;
+    double vol;
+};
+
+// Binary output record, host byte order
+struct PricingOutput
+{
+    double price;
+    double std_error;
+    int32_t status; // 0 ok, 1 row rejected (price and std_error are NaN)
+    int32_t reserved;
+};
+
+static const size_t BLOCK_ROWS = 8192; // rows read, priced and written together
+
+struct Settings
+{
+    int n_threads;
+    bool binary_in;
+    bool binary_out;
+    int default_paths;
+    int default_steps;
+    uint64_t seed;
+    bool same_seed;
+    PricingCache *cache; // NULL when both caches are off
+    bool cache_trees;
+    bool cache_mc;
+    PricingCluster *cluster; // NULL unless Monte Carlo rows are sliced
+};
+
+struct Row
+{
+    PricingRecord spec;
+    std::string error; // set when the line couldn't be parsed
+    PricingOutput out;
+    std::string message;
+};
+
+static std::vector<std::string> splitCsv(const std::string &line)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true)
+    {
+        size_t comma = line.find(',', start);
+        std::string field = line.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        // Trim blanks and a trailing '\r'
+        size_t first = field.find_first_not_of(" \t\r");
+        size_t last = field.find_last_not_of(" \t\r");
+        fields.push_back(first == std::string::npos ? std::string() : field.substr(first, last - first + 1));
+        if (comma == std::string::npos)
+        {
+            return fields;
+        }
+        start = comma + 1;
+    }
+}
+
+static double parseNumber(const std::string &field, const char *name)
+{
+    char *end = NULL;
+    double x = strtod(field.c_str(), &end);
+    if (field.empty() || *end != '\0')
+    {
+        throw std::invalid_argument(std::string("bad ") + name + " '" + field + "'");
+    }
+    return x;
+}
+
+// A whole number that fits the int32_t record field, negatives are left to checkSpec
+static int32_t parseCount(const std::string &field, const char *name)
+{
+    double x = parseNumber(field, name);
+    if (!(x == std::floor(x) && x >= INT32_MIN && x <= INT32_MAX))
+    {
+        throw std::invalid_argument(std::string("bad ") + name + " '" + field + "', expected a whole number up to 2147483647");
+    }
+    return (int32_t)x;
+}
+
+static PricingRecord parseCsvRow(const std::vector<std::string> &fields)
+{
+    if (fields.size() < 8 || fields.size() > 9)
+    {
+        throw std::invalid_argument("expected 8 or 9 fields");
+    }
+    PricingRecord spec;
+    memset(&spec, 0, sizeof(spec));
+    const std::string &engine = fields[0];
+    if (engine == "bs")
+    {
+        spec.engine = ENGINE_BS;
+    }
+    else if (engine == "binomial")
+    {
+        spec.engine = ENGINE_BINOMIAL;
+    }
+    else if (engine == "trinomial")
+    {
+        spec.engine = ENGINE_TRINOMIAL;
+    }
+    else if (engine == "mc")
+    {
+        spec.engine = ENGINE_MC;
+    }
+    else
+    {
+        throw std::invalid_argument("unknown engine '" + engine + "'");
+    }
+
+    if (fields[1] != "call" && fields[1] != "put")
+    {
+        throw std::invalid_argument("type must be call or put");
+    }
+    spec.call = fields[1] == "call";
+    if (fields[2] != "european" && fields[2] != "american")
+    {
+        throw std::invalid_argument("exercise must be european or american");
+    }
+    spec.american = fields[2] == "american";
+
+    spec.spot = parseNumber(fields[3], "spot");
+    spec.strike = parseNumber(fields[4], "strike");
+    spec.rate = parseNumber(fields[5], "rate");
+    spec.time = parseNumber(fields[6], "time");
+    spec.vol = parseNumber(fields[7], "vol");
+    spec.steps = (fields.size() > 8) ? parseCount(fields[8], "steps") : 0;
+    return spec;
+}
+
+// Everything but Black-Scholes, which is priced in batches
+static void priceRow(const Settings &settings, uint64_t row_number, Row &row)
+{
+    const PricingRecord &spec = row.spec;
+    bool american = spec.american != 0;
+    if (spec.engine == ENGINE_BINOMIAL || spec.engine == ENGINE_TRINOMIAL)
+    {
+        int steps = spec.steps > 0 ? spec.steps : settings.default_steps;
+        LatticeType type = (spec.engine == ENGINE_TRINOMIAL) ? LATTICE_TRINOMIAL : LATTICE_BINOMIAL;
+        if (settings.cache_trees)
+        {
+            row.out.price = settings.cache->latticePrice(spec.call != 0, american, spec.spot, spec.strike, spec.rate, spec.time, spec.vol, steps, type);
+        }
+        else
+        {
+            row.out.price = latticeOptionPrice(spec.call != 0, american, spec.spot, spec.strike, spec.rate, spec.time, spec.vol, steps, type);
+        }
+        row.out.std_error = 0.0;
+    }
+    else
+    {
+        if (american)
+        {
+            throw std::invalid_argument("american exercise needs a tree engine");
+        }
+        // Risk neutral paths, S_T drawn directly
+        int paths = spec.steps > 0 ? spec.steps : settings.default_paths;
+        Asset stock = {"", spec.spot, spec.rate, spec.vol, spec.rate};
+        MonteCarloSimulation mcs(paths, 1, spec.time, stock, false, settings.same_seed ? settings.seed : settings.seed + row_number);
+        Option option;
+        option.stock = stock;
+        option.call = spec.call != 0;
+        option.premium = 0.0;
+        option.strike = spec.strike;
+        option.t = spec.time;
+        MonteCarloResult result;
+        if (settings.cluster != NULL)
+        {
+            result = settings.cluster->estimate(mcs, option);
+        }
+        else
+        {
+            result = settings.cache_mc ? settings.cache->monteCarlo(mcs, option, 1) : mcs.estimateOptionResult(option);
+        }
+        double disc = exp(-spec.rate * spec.time);
+        row.out.price = disc * result.price;
+        row.out.std_error = disc * result.std_error;
+    }
+}
+
+static void rejectRow(Row &row, const std::string &message)
+{
+    row.out.price = NAN;
+    row.out.std_error = NAN;
+    row.out.status = 1;
+    row.message = message;
+}
+
+static void checkSpec(const PricingRecord &spec)
+{
+    if (spec.engine > ENGINE_MC)
+    {
+        throw std::invalid_argument("unknown engine");
+    }
+    if (!(spec.spot > 0.0 && spec.strike > 0.0 && spec.time > 0.0 && spec.vol > 0.0 && std::isfinite(spec.rate)))
+    {
+        throw std::invalid_argument("spot, strike, time and vol must be positive");
+    }
+    if (spec.steps < 0)
+    {
+        throw std::invalid_argument("steps must not be negative");
+    }
+}
+
+static void priceBlock(const Settings &settings, ThreadPool &pool, uint64_t first_row, std::vector<Row> &rows)
+{
+    std::vector<size_t> bs_rows;
+    std::vector<size_t> other_rows;
+    std::vector<size_t> cluster_rows;
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        Row &row = rows[i];
+        row.out.status = 0;
+        row.out.reserved = 0;
+        try
+        {
+            if (!row.error.empty())
+            {
+                throw std::invalid_argument(row.error);
+            }
+            checkSpec(row.spec);
+            if (row.spec.engine == ENGINE_BS && row.spec.american)
+            {
+                throw std::invalid_argument("american exercise needs a tree engine");
+            }
+            if (row.spec.engine == ENGINE_BS)
+            {
+                bs_rows.push_back(i);
+            }
+            else if (row.spec.engine == ENGINE_MC && settings.cluster != NULL)
+            {
+                cluster_rows.push_back(i);
+            }
+            else
+            {
+                other_rows.push_back(i);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            rejectRow(row, e.what());
+        }
+    }
+
+    // Black-Scholes rows gathered into columns for the vector kernels
+    OptionBatch batch;
+    batch.reserve(bs_rows.size());
+    for (size_t i : bs_rows)
+    {
+        const PricingRecord &spec = rows[i].spec;
+        batch.add(spec.call != 0, spec.spot, spec.strike, spec.rate, spec.time, spec.vol);
+    }
+    std::vector<double> bs_price(bs_rows.size());
+    SimdLevel level = detectSimdLevel();
+    pool.parallelFor((long long)bs_rows.size(), 1024, [&](int, long long begin, long long end) {
+        bsPriceBatch(level, (size_t)(end - begin), &batch.spot[begin], &batch.strike[begin], &batch.rate[begin], &batch.time[begin], &batch.vol[begin], &batch.call[begin], &bs_price[begin]);
+    }, settings.n_threads);
+    for (size_t j = 0; j < bs_rows.size(); ++j)
+    {
+        rows[bs_rows[j]].out.price = bs_price[j];
+        rows[bs_rows[j]].out.std_error = 0.0;
+    }
+
+    // Trees and simulations are heavy enough to be handed out one by one
+    pool.parallelFor((long long)other_rows.size(), 1, [&](int, long long begin, long long end) {
+        for (long long j = begin; j < end; ++j)
+        {
+            size_t i = other_rows[j];
+            try
+            {
+                priceRow(settings, first_row + i, rows[i]);
+            }
+            catch (const std::exception &e)
+            {
+                rejectRow(rows[i], e.what());
+            }
+        }
+    }, settings.n_threads);
+
+    // The cluster takes one simulation at a time, each already spread over all of it
+    for (size_t i : cluster_rows)
+    {
+        try
+        {
+            priceRow(settings, first_row + i, rows[i]);
+        }
+        catch (const std::exception &e)
+        {
+            rejectRow(rows[i], e.what());
+        }
+    }
+}
+
+// Fills rows with up to BLOCK_ROWS specs, false at the end of the input. A binary
+// input that ends inside a record leaves the size of that piece in trailing_bytes.
+static bool readBlock(FILE *in, const Settings &settings, std::vector<Row> &rows, bool &header_checked, size_t &trailing_bytes)
+{
+    rows.clear();
+    if (settings.binary_in)
+    {
+        std::vector<PricingRecord> records(BLOCK_ROWS);
+        // Byte counts, fread drops a partial element without saying so
+        size_t bytes = fread(records.data(), 1, BLOCK_ROWS * sizeof(PricingRecord), in);
+        size_t n = bytes / sizeof(PricingRecord);
+        trailing_bytes = bytes % sizeof(PricingRecord);
+        rows.resize(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            rows[i].spec = records[i];
+        }
+        return n > 0;
+    }
+
+    char buffer[4096];
+    std::string line;
+    while (rows.size() < BLOCK_ROWS && fgets(buffer, sizeof(buffer), in) != NULL)
+    {
+        line = buffer;
+        while (!line.empty() && line[line.size() - 1] != '\n' && fgets(buffer, sizeof(buffer), in) != NULL)
+        {
+            line += buffer; // longer than the buffer
+        }
+        if (!line.empty() && line[line.size() - 1] == '\n')
+        {
+            line.erase(line.size() - 1);
+        }
+        std::vector<std::string> fields = splitCsv(line);
+        if ((fields.size() == 1 && fields[0].empty()) || fields[0].compare(0, 1, "#") == 0)
+        {
+            continue;
+        }
+        if (!header_checked)
+        {
+            header_checked = true;
+            if (fields[0] == "engine")
+            {
+                continue;
+            }
+        }
+        Row row;
+        memset(&row.spec, 0, sizeof(row.spec));
+        try
+        {
+            row.spec = parseCsvRow(fields);
+        }
+        catch (const std::exception &e)
+        {
+            row.error = e.what();
+        }
+        rows.push_back(row);
+    }
+    return !rows.empty();
+}
+
+static void writeBlock(FILE *out, const Settings &settings, uint64_t first_row, const std::vector<Row> &rows)
+{
+    if (settings.binary_out)
+    {
+        for (const Row &row : rows)
+        {
+            fwrite(&row.out, sizeof(PricingOutput), 1, out);
+        }
+        return;
+    }
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        const Row &row = rows[i];
+        if (row.out.status == 0)
+        {
+            fprintf(out, "%llu,%.10g,%.6g,ok\n", (unsigned long long)(first_row + i), row.out.price, row.out.std_error);
+        }
+        else
+        {
+            fprintf(out, "%llu,,,error: %s\n", (unsigned long long)(first_row + i), row.message.c_str());
+        }
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: batch_pricer [--threads N] [--binary-in] [--binary-out] [--paths N] [--steps N] [--seed S] [--same-seed] [--cache N] [--mc-cache N] [--workers LIST] [--spawn N] [--sliced] [--timeout S] [--serve ADDR:PORT] [--metrics FILE] [input [output]]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    Settings settings;
+    settings.n_threads = (int)std::thread::hardware_concurrency();
+    settings.binary_in = false;
+    settings.binary_out = false;
+    settings.default_paths = 100000;
+    settings.default_steps = 1000;
+    settings.seed = 42;
+    settings.same_seed = false;
+    settings.cache = NULL;
+    settings.cache_trees = false;
+    settings.cache_mc = false;
+    settings.cluster = NULL;
+    long long cache_entries = 0;
+    long long mc_cache_entries = 0;
+    std::string worker_list;
+    int spawn_connections = 0;
+    bool sliced = false;
+    double timeout = 60.0;
+    std::string serve_host;
+    int serve_port = 0;
+    std::string metrics_path;
+    std::vector<const char *> files;
+
+    for (int a = 1; a < argc; ++a)
+    {
+        std::string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (arg == "--threads" && has_value)
+        {
+            settings.n_threads = atoi(argv[++a]);
+        }
+        else if (arg == "--paths" && has_value)
+        {
+            settings.default_paths = atoi(argv[++a]);
+        }
+        else if (arg == "--steps" && has_value)
+        {
+            settings.default_steps = atoi(argv[++a]);
+        }
+        else if (arg == "--seed" && has_value)
+        {
+            settings.seed = strtoull(argv[++a], NULL, 10);
+        }
+        else if (arg == "--same-seed")
+        {
+            settings.same_seed = true;
+        }
+        else if (arg == "--cache" && has_value)
+        {
+            cache_entries = atoll(argv[++a]);
+        }
+        else if (arg == "--mc-cache" && has_value)
+        {
+            mc_cache_entries = atoll(argv[++a]);
+        }
+        else if (arg == "--workers" && has_value)
+        {
+            worker_list = argv[++a];
+        }
+        else if (arg == "--spawn" && has_value)
+        {
+            spawn_connections = atoi(argv[++a]);
+        }
+        else if (arg == "--sliced")
+        {
+            sliced = true;
+        }
+        else if (arg == "--timeout" && has_value)
+        {
+            timeout = atof(argv[++a]);
+        }
+        else if (arg == "--serve" && has_value)
+        {
+            std::string where = argv[++a];
+            size_t colon = where.rfind(':');
+            if (colon == std::string::npos || colon == 0)
+            {
+                usage();
+            }
+            serve_host = where.substr(0, colon);
+            if (serve_host.size() > 2 && serve_host[0] == '[' && serve_host[serve_host.size() - 1] == ']')
+            {
+                serve_host = serve_host.substr(1, serve_host.size() - 2); // [::1]:port
+            }
+            serve_port = atoi(where.c_str() + colon + 1);
+            if (serve_port < 1)
+            {
+                usage();
+            }
+        }
+        else if (arg == "--metrics" && has_value)
+        {
+            metrics_path = argv[++a];
+        }
+        else if (arg == "--binary-in")
+        {
+            settings.binary_in = true;
+        }
+        else if (arg == "--binary-out")
+        {
+            settings.binary_out = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            usage();
+        }
+        else
+        {
+            files.push_back(argv[a]);
+        }
+    }
+    if (files.size() > 2 || settings.n_threads < 1 || settings.default_paths < 1 || settings.default_steps < 1 || cache_entries < 0 || mc_cache_entries < 0 || spawn_connections < 0 || !(timeout > 0.0) || serve_port < 0 || serve_port > 65535)
+    {
+        usage();
+    }
+    if (!serve_host.empty())
+    {
+        try
+        {
+            int fd = listenForCoordinators(serve_host, serve_port);
+            fprintf(stderr, "serving slices on %s:%d\n", serve_host.c_str(), serve_port);
+            servePricingWorker(fd);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+        }
+        return 1;
+    }
+
+    // Workers are forked before the pool starts any thread
+    bool use_cluster = !worker_list.empty() || spawn_connections > 0 || sliced;
+    if (use_cluster && mc_cache_entries > 0)
+    {
+        fprintf(stderr, "--mc-cache can't be combined with a cluster\n");
+        return 2;
+    }
+    std::unique_ptr<PricingCluster> cluster;
+    pid_t spawned = 0;
+    if (use_cluster)
+    {
+        try
+        {
+            std::vector<WorkerAddress> workers = parseWorkerAddresses(worker_list);
+            if (spawn_connections > 0)
+            {
+                WorkerAddress local;
+                spawned = spawnLocalWorker(spawn_connections, local);
+                workers.push_back(local);
+            }
+            cluster.reset(new PricingCluster(workers, timeout, settings.n_threads));
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            stopLocalWorker(spawned);
+            return 2;
+        }
+        settings.cluster = cluster.get();
+    }
+    std::unique_ptr<PricingCache> cache;
+    if (cache_entries > 0 || mc_cache_entries > 0)
+    {
+        cache.reset(new PricingCache(std::max(cache_entries, 1LL), std::max(mc_cache_entries, 1LL)));
+        settings.cache = cache.get();
+        settings.cache_trees = cache_entries > 0;
+        settings.cache_mc = mc_cache_entries > 0;
+    }
+
+    FILE *in = stdin;
+    FILE *out = stdout;
+    if (files.size() > 0 && strcmp(files[0], "-") != 0)
+    {
+        in = fopen(files[0], settings.binary_in ? "rb" : "r");
+        if (in == NULL)
+        {
+            perror(files[0]);
+            return 1;
+        }
+    }
+    if (files.size() > 1 && strcmp(files[1], "-") != 0)
+    {
+        out = fopen(files[1], settings.binary_out ? "wb" : "w");
+        if (out == NULL)
+        {
+            perror(files[1]);
+            return 1;
+        }
+    }
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    if (!settings.binary_out)
+    {
+        fprintf(out, "row,price,std_error,status\n");
+    }
+    std::vector<Row> rows;
+    bool header_checked = false;
+    uint64_t first_row = 0;
+    long long rejected = 0;
+    size_t trailing_bytes = 0;
+    while (readBlock(in, settings, rows, header_checked, trailing_bytes))
+    {
+        priceBlock(settings, *pool, first_row, rows);
+        writeBlock(out, settings, first_row, rows);
+        for (const Row &row : rows)
+        {
+            rejected += row.out.status != 0;
+        }
+        first_row += rows.size();
+        if (trailing_bytes != 0)
+        {
+            break;
+        }
+    }
+    bool input_failed = ferror(in) != 0;
+
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+    if (out != stdout && fclose(out) != 0)
+    {
+        perror("output");
+        return 1;
+    }
+    fprintf(stderr, "%llu rows priced, %lld rejected\n", (unsigned long long)first_row, rejected);
+    if (cache)
+    {
+        CacheStats trees = cache->deterministicStats();
+        CacheStats simulations = cache->monteCarloStats();
+        fprintf(stderr, "cache: trees %lld hits %lld misses, monte carlo %lld hits %lld misses\n", trees.hits, trees.misses, simulations.hits, simulations.misses);
+    }
+    if (cluster)
+    {
+        ClusterStats stats = cluster->stats();
+        fprintf(stderr, "cluster: %d connections, %d lost, slices %lld remote %lld local %lld reassigned\n", stats.connections, stats.lost, stats.slices_remote, stats.slices_local, stats.slices_reassigned);
+        cluster.reset();
+        stopLocalWorker(spawned);
+    }
+    if (!metrics_path.empty() && !writeMetrics(metrics_path, snapshotMetrics()))
+    {
+        perror(metrics_path.c_str());
+        return 1;
+    }
+    if (input_failed)
+    {
+        fprintf(stderr, "input: read error\n");
+        return 1;
+    }
+    if (trailing_bytes != 0)
+    {
+        fprintf(stderr, "input: %llu trailing bytes after row %llu, not a whole %llu byte record\n", (unsigned long long)trailing_bytes, (unsigned long long)first_row, (unsigned long long)sizeof(PricingRecord));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "functions.h"
+#include "bs_batch.h"
+
+/*
+Throughput of bsPriceBatch against one bsOptionPrice call per option.
+The chain is 20 expiries x 1000 strikes x call/put, repriced `reps` times.
+Usage: bench_bs [threads] [reps]
+*/
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    int n_threads = (argc > 1) ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+    int reps = (argc > 2) ? atoi(argv[2]) : 50;
+
+    OptionBatch chain;
+    for (int e = 1; e <= 20; ++e)
+    {
+        double t = e / 12.0;
+        for (int k = 0; k < 1000; ++k)
+        {
+            double strike = 50.0 + 0.1 * k;
+            double vol = 0.2 + 0.1 * (strike / 100.0 - 1.0) * (strike / 100.0 - 1.0);
+            chain.add(true, 100.0, strike, 0.03, t, vol);
+            chain.add(false, 100.0, strike, 0.03, t, vol);
+        }
+    }
+    size_t n = chain.size();
+    std::vector<double> reference(n);
+    std::vector<double> price(n);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < reps; ++rep)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            reference[i] = bsOptionPrice(chain.call[i] != 0, chain.spot[i], chain.strike[i], chain.rate[i], chain.time[i], chain.vol[i]);
+        }
+    }
+    double scalar_seconds = secondsSince(start);
+    printf("%-22s %8.2f Mopt/s\n", "bsOptionPrice", reps * n / scalar_seconds / 1e6);
+
+    SimdLevel levels[3] = {SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+    for (int l = 0; l < 3 && levels[l] <= detectSimdLevel(); ++l)
+    {
+        start = std::chrono::steady_clock::now();
+        for (int rep = 0; rep < reps; ++rep)
+        {
+            bsPriceBatch(levels[l], n, chain.spot.data(), chain.strike.data(), chain.rate.data(), chain.time.data(), chain.vol.data(), chain.call.data(), price.data());
+        }
+        double seconds = secondsSince(start);
+        printf("batch %-16s %8.2f Mopt/s  x%.1f\n", simdLevelName(levels[l]), reps * n / seconds / 1e6, scalar_seconds / seconds);
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < reps; ++rep)
+    {
+        bsPriceBatch(chain, price, n_threads);
+    }
+    double seconds = secondsSince(start);
+    printf("batch %2d threads       %8.2f Mopt/s  x%.1f\n", n_threads, reps * n / seconds / 1e6, scalar_seconds / seconds);
+
+    double max_error = 0.0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        max_error = std::max(max_error, std::fabs(price[i] - reference[i]));
+    }
+    printf("max |batch - bsOptionPrice| = %.3g\n", max_error);
+    return 0;
+}
@@ -0,0 +1,349 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "functions.h"
+#include "models.h"
+#include "exotics.h"
+#include "live_book.h"
+#include "pricing_cache.h"
+#include "thread_pool.h"
+
+/*
+Microbenchmarks of every pricing engine, written as JSON so two builds can be diffed.
+Each benchmark is run once to warm up, then `reps` times; the spread across the
+repetitions is reported with the mean so noisy numbers can be told apart from regressions.
+Usage: bench_suite [--reps R] [--threads N] [--quick] [--json file]
+  --threads N  largest thread count of the scaling runs (default and cap: the shared pool's)
+  --quick      10x less work per repetition, for a smoke test
+  --json file  write the JSON there instead of stdout (the table always goes to stderr)
+*/
+
+struct Measurement
+{
+    std::string name;
+    std::string unit; // what one op is: "call", "path", "step"...
+    long long ops;    // per repetition
+    int threads;
+    std::vector<double> seconds; // one per repetition
+    double efficiency;           // scaling runs: t(1 thread) / (threads * t), else 0
+};
+
+static volatile double sink; // keeps the benchmarked calls from being optimized away
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Fn>
+static Measurement measure(const std::string &name, const char *unit, long long ops, int threads, int reps, Fn fn)
+{
+    Measurement m;
+    m.name = name;
+    m.unit = unit;
+    m.ops = ops;
+    m.threads = threads;
+    m.efficiency = 0.0;
+    sink = fn();
+    for (int rep = 0; rep < reps; ++rep)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        sink = fn();
+        m.seconds.push_back(secondsSince(start));
+    }
+    return m;
+}
+
+static double meanOf(const std::vector<double> &x)
+{
+    double sum = 0.0;
+    for (double v : x)
+    {
+        sum += v;
+    }
+    return sum / x.size();
+}
+
+static double stddevOf(const std::vector<double> &x)
+{
+    if (x.size() < 2)
+    {
+        return 0.0;
+    }
+    double mean = meanOf(x);
+    double sum = 0.0;
+    for (double v : x)
+    {
+        sum += (v - mean) * (v - mean);
+    }
+    return sqrt(sum / (x.size() - 1));
+}
+
+static void printTable(const Measurement &m)
+{
+    double mean = meanOf(m.seconds);
+    double ns = 1e9 * mean / m.ops;
+    fprintf(stderr, "%-40s %3d thr %12.2f ns/%-5s %12.4g %s/s  cv %5.1f%%", m.name.c_str(), m.threads, ns, m.unit.c_str(), m.ops / mean, m.unit.c_str(), 100.0 * stddevOf(m.seconds) / mean);
+    if (m.efficiency > 0.0)
+    {
+        fprintf(stderr, "  eff %5.1f%%", 100.0 * m.efficiency);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void writeJson(FILE *out, const std::vector<Measurement> &results, int reps, int pool_threads)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"compiler\": \"%s\",\n", __VERSION__);
+    fprintf(out, "  \"simd\": \"%s\",\n", simdLevelName(detectSimdLevel()));
+    fprintf(out, "  \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(out, "  \"pool_threads\": %d,\n", pool_threads);
+    fprintf(out, "  \"repetitions\": %d,\n", reps);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Measurement &m = results[i];
+        std::vector<double> ns(m.seconds.size());
+        for (size_t r = 0; r < ns.size(); ++r)
+        {
+            ns[r] = 1e9 * m.seconds[r] / m.ops;
+        }
+        double mean = meanOf(m.seconds);
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"threads\": %d, \"ops\": %lld, ", m.name.c_str(), m.unit.c_str(), m.threads, m.ops);
+        fprintf(out, "\"ns_per_op\": %.4g, \"ns_per_op_stddev\": %.4g, \"ns_per_op_min\": %.4g, \"ns_per_op_max\": %.4g, ", meanOf(ns), stddevOf(ns), *std::min_element(ns.begin(), ns.end()), *std::max_element(ns.begin(), ns.end()));
+        fprintf(out, "\"per_second\": %.6g", m.ops / mean);
+        if (m.efficiency > 0.0)
+        {
+            fprintf(out, ", \"parallel_efficiency\": %.4f", m.efficiency);
+        }
+        fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int reps = 5;
+    int max_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    long long scale = 10;
+    const char *json_file = NULL;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strcmp(argv[a], "--reps") == 0 && a + 1 < argc)
+        {
+            reps = std::max(1, atoi(argv[++a]));
+        }
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+        {
+            max_threads = std::max(1, atoi(argv[++a]));
+        }
+        else if (strcmp(argv[a], "--quick") == 0)
+        {
+            scale = 1;
+        }
+        else if (strcmp(argv[a], "--json") == 0 && a + 1 < argc)
+        {
+            json_file = argv[++a];
+        }
+        else
+        {
+            fprintf(stderr, "usage: bench_suite [--reps R] [--threads N] [--quick] [--json file]\n");
+            return 2;
+        }
+    }
+    // Every parallel engine runs on the shared pool, more threads than it has can't be measured
+    int pool_threads = sharedThreadPool()->size();
+    if (max_threads > pool_threads)
+    {
+        fprintf(stderr, "--threads %d capped at the %d threads of the pool\n", max_threads, pool_threads);
+        max_threads = pool_threads;
+    }
+
+    std::vector<Measurement> results;
+
+    // Closed forms, over a spread of inputs so branches and table lookups are exercised
+    long long n_calls = 100000 * scale;
+    results.push_back(measure("normalCDF", "call", n_calls, 1, reps, [&]() {
+        double sum = 0.0;
+        for (long long i = 0; i < n_calls; ++i)
+        {
+            sum += normalCDF(-5.0 + 10.0 * i / n_calls);
+        }
+        return sum;
+    }));
+    results.push_back(measure("bsOptionPrice", "call", n_calls, 1, reps, [&]() {
+        double sum = 0.0;
+        for (long long i = 0; i < n_calls; ++i)
+        {
+            sum += bsOptionPrice(i & 1, 100.0, 60.0 + 80.0 * i / n_calls, 0.03, 1.0, 0.25);
+        }
+        return sum;
+    }));
+    long long n_quotes = 10000 * scale;
+    std::vector<double> quotes(n_quotes);
+    for (long long i = 0; i < n_quotes; ++i)
+    {
+        quotes[i] = bsOptionPrice(i & 1, 100.0, 60.0 + 80.0 * i / n_quotes, 0.03, 1.0, 0.1 + 0.4 * (i % 7) / 7.0);
+    }
+    results.push_back(measure("impliedVolatility", "call", n_quotes, 1, reps, [&]() {
+        double sum = 0.0;
+        for (long long i = 0; i < n_quotes; ++i)
+        {
+            sum += impliedVolatility(i & 1, 100.0, 60.0 + 80.0 * i / n_quotes, 0.03, 1.0, quotes[i]);
+        }
+        return sum;
+    }));
+
+    // Trees: ns per tree, and per node so sizes can be compared
+    int tree_sizes[3] = {100, 1000, 10000};
+    for (int size : tree_sizes)
+    {
+        long long trees = std::max(1LL, 20 * scale * 1000 / size);
+        results.push_back(measure("binomialOptionPrice n=" + std::to_string(size), "tree", trees, 1, reps, [&]() {
+            double sum = 0.0;
+            for (long long i = 0; i < trees; ++i)
+            {
+                sum += binomialOptionPrice(false, 100.0, 100.0 + (i % 5), 0.03, 1.0, 0.25, size, false);
+            }
+            return sum;
+        }));
+    }
+
+    // Path simulation
+    long long n_steps = 100000 * scale;
+    results.push_back(measure("WeinerProcessSimulator::simulateStep", "step", n_steps, 1, reps, [&]() {
+        WeinerProcessSimulator wps(100.0, 0.05, 0.25, 1.0 / 252.0, false, 42);
+        for (long long i = 0; i < n_steps; ++i)
+        {
+            wps.simulateStep(false);
+        }
+        return wps.getPrice();
+    }));
+
+    Asset stock = {"ABC", 100.0, 0.03, 0.25, 0.03};
+    Option option;
+    option.stock = stock;
+    option.call = true;
+    option.premium = 0.0;
+    option.strike = 105.0;
+    option.t = 1.0;
+    int n_paths = (int)(20000 * scale);
+    results.push_back(measure("estimateOption exact terminal", "path", n_paths, 1, reps, [&]() {
+        MonteCarloSimulation mcs(n_paths, 50, 1.0 / 50.0, stock, false, 42);
+        return mcs.estimateOption(option);
+    }));
+    results.push_back(measure("estimateOption 50 steps", "path", n_paths, 1, reps, [&]() {
+        MonteCarloSimulation mcs(n_paths, 50, 1.0 / 50.0, stock, false, 42);
+        mcs.mode = PRICING_STEPPED;
+        return mcs.estimateOption(option);
+    }));
+    // Same paths through the model policy engine, then a model with two normals a step
+    results.push_back(measure("estimateOptionWithModel GBM 50 steps", "path", n_paths, 1, reps, [&]() {
+        MonteCarloSimulation mcs(n_paths, 50, 1.0 / 50.0, stock, false, 42);
+        GbmModel gbm = {stock.drift, stock.volatility};
+        return estimateOptionWithModel(mcs, gbm, option, 1).price;
+    }));
+    results.push_back(measure("estimateOptionWithModel Heston 50 steps", "path", n_paths, 1, reps, [&]() {
+        MonteCarloSimulation mcs(n_paths, 50, 1.0 / 50.0, stock, false, 42);
+        HestonModel heston = {stock.drift, stock.volatility * stock.volatility, 1.5, stock.volatility * stock.volatility, 0.5, -0.7};
+        return estimateOptionWithModel(mcs, heston, option, 1).price;
+    }));
+
+    // Path dependent payoffs on the same 50 step paths, state updated as the paths are walked
+    results.push_back(measure("estimateExoticOption Asian 50 steps", "path", n_paths, 1, reps, [&]() {
+        MonteCarloSimulation mcs(n_paths, 50, 1.0 / 50.0, stock, false, 42);
+        mcs.variance_reduction.control = CV_TERMINAL_STOCK; // any control means the geometric Asian one here
+        ArithmeticAsianPayoff asian = {true, 105.0};
+        return estimateExoticOption(mcs, asian, 1).price;
+    }));
+    results.push_back(measure("estimateExoticOption up-and-out 50 steps", "path", n_paths, 1, reps, [&]() {
+        MonteCarloSimulation mcs(n_paths, 50, 1.0 / 50.0, stock, false, 42);
+        UpAndOutPayoff barrier = {true, 105.0, 130.0};
+        return estimateExoticOption(mcs, barrier, 1).price;
+    }));
+
+    // Cache: the same 1000 trees asked over and over, every call after the warm up is a hit
+    PricingCache cache;
+    results.push_back(measure("PricingCache hit binomial n=1000", "call", n_calls, 1, reps, [&]() {
+        double sum = 0.0;
+        for (long long i = 0; i < n_calls; ++i)
+        {
+            sum += cache.latticePrice(false, true, 100.0, 60.0 + 0.08 * (i % 1000), 0.03, 1.0, 0.25, 1000, LATTICE_BINOMIAL);
+        }
+        return sum;
+    }));
+
+    // Live book: push one tick and drain it, so every tick pays a full revaluation of 100 positions
+    LiveBook book;
+    for (int i = 0; i < 100; ++i)
+    {
+        Option position = option;
+        position.call = (i & 1) != 0;
+        position.strike = 80.0 + 0.4 * i;
+        position.t = 0.25 + 0.01 * i;
+        book.addPosition(position, 1.0 + i % 3);
+    }
+    long long n_ticks = 10000 * scale;
+    results.push_back(measure("LiveBook tick 100 positions", "tick", n_ticks, 1, reps, [&]() {
+        WeinerProcessSimulator wps(100.0, 0.0, 0.25, 1e-5, false, 42);
+        for (long long i = 0; i < n_ticks; ++i)
+        {
+            wps.simulateStep(false);
+            book.pushTick(wps.getPrice());
+            book.drain();
+        }
+        return book.snapshot().total.price;
+    }));
+
+    // Scaling over 1, 2, 4... threads and the largest count
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2)
+    {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+    int n_parallel_paths = 10 * n_paths;
+    double single_thread_seconds = 0.0;
+    for (int threads : thread_counts)
+    {
+        // The workers that actually took part, in case the pool would give fewer
+        int workers = sharedThreadPool()->workerCount(threads);
+        Measurement m = measure("runMonteCarloMultiThreading 50 steps", "path", n_parallel_paths, workers, reps, [&]() {
+            MonteCarloSimulation mcs(n_parallel_paths, 50, 1.0 / 50.0, stock, false, 42);
+            mcs.mode = PRICING_STEPPED;
+            return runMonteCarloMultiThreading(threads, mcs, option);
+        });
+        if (threads == 1)
+        {
+            single_thread_seconds = meanOf(m.seconds);
+        }
+        m.efficiency = single_thread_seconds / (workers * meanOf(m.seconds));
+        results.push_back(m);
+    }
+
+    for (const Measurement &m : results)
+    {
+        printTable(m);
+    }
+    FILE *out = stdout;
+    if (json_file != NULL)
+    {
+        out = fopen(json_file, "w");
+        if (out == NULL)
+        {
+            perror(json_file);
+            return 1;
+        }
+    }
+    writeJson(out, results, reps, pool_threads);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,445 @@
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "bs_batch.h"
+#include "thread_pool.h"
+#if MC_X86
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized" // same AVX-512 header false positive as rng.cpp
+#endif
+#include <immintrin.h>
+#endif
+
+static const int TILE = 256;                  // options per prepass of the expiry terms
+static const long long PARALLEL_CHUNK = 16384; // options per pool task
+
+void OptionBatch::add(bool is_call, double s, double k, double r, double t, double sigma)
+{
+    spot.push_back(s);
+    strike.push_back(k);
+    rate.push_back(r);
+    time.push_back(t);
+    vol.push_back(sigma);
+    call.push_back(is_call ? 1 : 0);
+}
+
+void OptionBatch::reserve(size_t n)
+{
+    spot.reserve(n);
+    strike.reserve(n);
+    rate.reserve(n);
+    time.reserve(n);
+    vol.reserve(n);
+    call.reserve(n);
+}
+
+void OptionBatch::clear()
+{
+    spot.clear();
+    strike.clear();
+    rate.clear();
+    time.clear();
+    vol.clear();
+    call.clear();
+}
+
+/*
+The math below is written once as scalar code and repeated op for op in the
+vector kernels (no fma, -ffp-contract=off), like the Box-Muller in rng.cpp.
+*/
+static const double LN2_HI = 6.93147180369123816490e-01;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double LOG2E = 1.44269504088896338700;
+static const double SQRT2 = 1.41421356237309514547;
+static const double ROUND_MAGIC = 6755399441055744.0; // 2^52 + 2^51
+static const double EXP_LIMIT = 708.0;
+static const double CDF_LIMIT = 40.0;                  // N(-40) is far below the smallest double
+static const double CDF_SPLIT = 7.07106781186547;      // rational / continued fraction switch
+static const double SQRT_2PI = 2.50662827463100050242;
+static const double INV_SQRT_2PI = 0.39894228040143267794;
+
+// 1/i!, exp(r) for |r| <= ln2 / 2
+static const double EXP_COEFFS[14] = {1.0, 1.0, 1.0 / 2.0, 1.0 / 6.0, 1.0 / 24.0, 1.0 / 120.0, 1.0 / 720.0, 1.0 / 5040.0, 1.0 / 40320.0, 1.0 / 362880.0, 1.0 / 3628800.0, 1.0 / 39916800.0, 1.0 / 479001600.0, 1.0 / 6227020800.0};
+// log(m) = 2 atanh(f) = 2 f sum f^(2k) / (2k+1)
+static const double LOG_COEFFS[11] = {1.0, 1.0 / 3.0, 1.0 / 5.0, 1.0 / 7.0, 1.0 / 9.0, 1.0 / 11.0, 1.0 / 13.0, 1.0 / 15.0, 1.0 / 17.0, 1.0 / 19.0, 1.0 / 21.0};
+// Hart's double precision normal CDF (as given by West, "Better approximations to cumulative normal functions")
+static const double CDF_NUM[7] = {2.20206867912376e+02, 2.21213596169931e+02, 1.12079291497871e+02, 3.3912866078383e+01, 6.37396220353165e+00, 7.00383064443688e-01, 3.52624965998911e-02};
+static const double CDF_DEN[8] = {4.40413735824752e+02, 7.93826512519948e+02, 6.37333633378831e+02, 2.96564248779674e+02, 8.67807322029461e+01, 1.6064177579207e+01, 1.75566716318264e+00, 8.83883476483184e-02};
+
+static inline double batchExp(double x)
+{
+    x = std::min(std::max(x, -EXP_LIMIT), EXP_LIMIT);
+    double shifted = x * LOG2E + ROUND_MAGIC;
+    double k = shifted - ROUND_MAGIC;
+    double r = (x - k * LN2_HI) - k * LN2_LO;
+    double p = EXP_COEFFS[13];
+    for (int i = 12; i >= 0; --i)
+    {
+        p = p * r + EXP_COEFFS[i];
+    }
+    // shifted holds k in its low mantissa bits, move it into the exponent of 2^k
+    uint64_t shifted_bits, magic_bits;
+    memcpy(&shifted_bits, &shifted, sizeof(shifted_bits));
+    memcpy(&magic_bits, &ROUND_MAGIC, sizeof(magic_bits));
+    uint64_t scale_bits = (shifted_bits - magic_bits + 1023) << 52;
+    double scale;
+    memcpy(&scale, &scale_bits, sizeof(scale));
+    return p * scale;
+}
+
+// log(x) for a normal positive x
+static inline double batchLog(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    double e = (double)(bits >> 52) - 1023.0;
+    uint64_t mant_bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &mant_bits, sizeof(m));
+    if (m > SQRT2)
+    {
+        m = m * 0.5;
+        e = e + 1.0;
+    }
+    double f = (m - 1.0) / (m + 1.0);
+    double s = f * f;
+    double p = LOG_COEFFS[10];
+    for (int i = 9; i >= 0; --i)
+    {
+        p = p * s + LOG_COEFFS[i];
+    }
+    double log_m = (2.0 * f) * p;
+    return e * LN2_HI + (e * LN2_LO + log_m);
+}
+
+// N(x), also hands back exp(-x^2 / 2) for the vega
+static inline double normalCdfGauss(double x, double &gauss)
+{
+    double a = std::min(std::fabs(x), CDF_LIMIT);
+    gauss = batchExp(-0.5 * (a * a));
+
+    double num = CDF_NUM[6];
+    for (int i = 5; i >= 0; --i)
+    {
+        num = num * a + CDF_NUM[i];
+    }
+    double den = CDF_DEN[7];
+    for (int i = 6; i >= 0; --i)
+    {
+        den = den * a + CDF_DEN[i];
+    }
+    double lower = (gauss * num) / den;
+    if (a >= CDF_SPLIT)
+    {
+        double tail = a + 0.65;
+        tail = a + 4.0 / tail;
+        tail = a + 3.0 / tail;
+        tail = a + 2.0 / tail;
+        tail = a + 1.0 / tail;
+        lower = gauss / (tail * SQRT_2PI);
+    }
+    return (x > 0.0) ? 1.0 - lower : lower;
+}
+
+double fastNormalCDF(double x)
+{
+    double gauss;
+    return normalCdfGauss(x, gauss);
+}
+
+void bsExpiryTerms(size_t n, const double *r, const double *t, double *sqrt_t, double *disc)
+{
+    double last_r = NAN;
+    double last_t = NAN;
+    double last_sqrt = 0.0;
+    double last_disc = 0.0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (r[i] != last_r || t[i] != last_t)
+        {
+            last_r = r[i];
+            last_t = t[i];
+            last_sqrt = sqrt(t[i]);
+            last_disc = batchExp(-(r[i] * t[i]));
+        }
+        sqrt_t[i] = last_sqrt;
+        disc[i] = last_disc;
+    }
+}
+
+static void bsTileScalar(size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, const double *sqrt_t, const double *disc, double *price, double *vega)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        double vol_sqrt_t = sigma[i] * sqrt_t[i];
+        double d1 = (batchLog(s[i] / k[i]) + (r[i] + 0.5 * (sigma[i] * sigma[i])) * t[i]) / vol_sqrt_t;
+        double d2 = d1 - vol_sqrt_t;
+        // put = -(s N(-d1) - k e^-rt N(-d2))
+        double sign = call[i] ? 1.0 : -1.0;
+        double gauss1, gauss2;
+        double n1 = normalCdfGauss(sign * d1, gauss1);
+        double n2 = normalCdfGauss(sign * d2, gauss2);
+        price[i] = sign * (s[i] * n1 - (k[i] * disc[i]) * n2);
+        if (vega != NULL)
+        {
+            vega[i] = ((s[i] * gauss1) * sqrt_t[i]) * INV_SQRT_2PI;
+        }
+    }
+}
+
+#if MC_X86
+__attribute__((target("avx2"))) static inline __m256d expAvx2(__m256d x)
+{
+    x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-EXP_LIMIT)), _mm256_set1_pd(EXP_LIMIT));
+    __m256d magic = _mm256_set1_pd(ROUND_MAGIC);
+    __m256d shifted = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)), magic);
+    __m256d k = _mm256_sub_pd(shifted, magic);
+    __m256d r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(k, _mm256_set1_pd(LN2_HI))), _mm256_mul_pd(k, _mm256_set1_pd(LN2_LO)));
+    __m256d p = _mm256_set1_pd(EXP_COEFFS[13]);
+    for (int i = 12; i >= 0; --i)
+    {
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(EXP_COEFFS[i]));
+    }
+    __m256i scale = _mm256_sub_epi64(_mm256_castpd_si256(shifted), _mm256_castpd_si256(magic));
+    scale = _mm256_slli_epi64(_mm256_add_epi64(scale, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(scale));
+}
+
+__attribute__((target("avx2"))) static inline __m256d logAvx2(__m256d x)
+{
+    const __m256i two52_bits = _mm256_set1_epi64x(0x4330000000000000LL);
+    const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256i bits = _mm256_castpd_si256(x);
+    __m256d e = _mm256_sub_pd(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), two52_bits)), two52), _mm256_set1_pd(1023.0));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)), _mm256_set1_epi64x(0x3FF0000000000000LL)));
+    __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(SQRT2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_blendv_pd(e, _mm256_add_pd(e, one), big);
+    __m256d f = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+    __m256d s = _mm256_mul_pd(f, f);
+    __m256d p = _mm256_set1_pd(LOG_COEFFS[10]);
+    for (int i = 9; i >= 0; --i)
+    {
+        p = _mm256_add_pd(_mm256_mul_pd(p, s), _mm256_set1_pd(LOG_COEFFS[i]));
+    }
+    __m256d log_m = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), f), p);
+    return _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(LN2_HI)), _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(LN2_LO)), log_m));
+}
+
+__attribute__((target("avx2"))) static inline __m256d normalCdfAvx2(__m256d x, __m256d &gauss)
+{
+    __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+    __m256d a = _mm256_min_pd(_mm256_and_pd(x, abs_mask), _mm256_set1_pd(CDF_LIMIT));
+    gauss = expAvx2(_mm256_mul_pd(_mm256_set1_pd(-0.5), _mm256_mul_pd(a, a)));
+
+    __m256d num = _mm256_set1_pd(CDF_NUM[6]);
+    for (int i = 5; i >= 0; --i)
+    {
+        num = _mm256_add_pd(_mm256_mul_pd(num, a), _mm256_set1_pd(CDF_NUM[i]));
+    }
+    __m256d den = _mm256_set1_pd(CDF_DEN[7]);
+    for (int i = 6; i >= 0; --i)
+    {
+        den = _mm256_add_pd(_mm256_mul_pd(den, a), _mm256_set1_pd(CDF_DEN[i]));
+    }
+    __m256d lower = _mm256_div_pd(_mm256_mul_pd(gauss, num), den);
+
+    // The continued fraction costs four divisions, only pay for it when a lane needs it
+    __m256d is_far = _mm256_cmp_pd(a, _mm256_set1_pd(CDF_SPLIT), _CMP_GE_OQ);
+    if (_mm256_movemask_pd(is_far) != 0)
+    {
+        __m256d tail = _mm256_add_pd(a, _mm256_set1_pd(0.65));
+        tail = _mm256_add_pd(a, _mm256_div_pd(_mm256_set1_pd(4.0), tail));
+        tail = _mm256_add_pd(a, _mm256_div_pd(_mm256_set1_pd(3.0), tail));
+        tail = _mm256_add_pd(a, _mm256_div_pd(_mm256_set1_pd(2.0), tail));
+        tail = _mm256_add_pd(a, _mm256_div_pd(_mm256_set1_pd(1.0), tail));
+        lower = _mm256_blendv_pd(lower, _mm256_div_pd(gauss, _mm256_mul_pd(tail, _mm256_set1_pd(SQRT_2PI))), is_far);
+    }
+    __m256d upper = _mm256_sub_pd(_mm256_set1_pd(1.0), lower);
+    return _mm256_blendv_pd(lower, upper, _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_GT_OQ));
+}
+
+__attribute__((target("avx2"))) static void bsTileAvx2(size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, const double *sqrt_t, const double *disc, double *price, double *vega)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d vs = _mm256_loadu_pd(s + i);
+        __m256d vk = _mm256_loadu_pd(k + i);
+        __m256d vsigma = _mm256_loadu_pd(sigma + i);
+        __m256d vol_sqrt_t = _mm256_mul_pd(vsigma, _mm256_loadu_pd(sqrt_t + i));
+        __m256d carry = _mm256_add_pd(_mm256_loadu_pd(r + i), _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_mul_pd(vsigma, vsigma)));
+        __m256d d1 = _mm256_div_pd(_mm256_add_pd(logAvx2(_mm256_div_pd(vs, vk)), _mm256_mul_pd(carry, _mm256_loadu_pd(t + i))), vol_sqrt_t);
+        __m256d d2 = _mm256_sub_pd(d1, vol_sqrt_t);
+
+        int32_t flags;
+        memcpy(&flags, call + i, sizeof(flags));
+        __m256i is_put = _mm256_cmpeq_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(flags)), _mm256_setzero_si256());
+        __m256d sign = _mm256_blendv_pd(_mm256_set1_pd(1.0), _mm256_set1_pd(-1.0), _mm256_castsi256_pd(is_put));
+
+        __m256d gauss1, gauss2;
+        __m256d n1 = normalCdfAvx2(_mm256_mul_pd(sign, d1), gauss1);
+        __m256d n2 = normalCdfAvx2(_mm256_mul_pd(sign, d2), gauss2);
+        __m256d value = _mm256_sub_pd(_mm256_mul_pd(vs, n1), _mm256_mul_pd(_mm256_mul_pd(vk, _mm256_loadu_pd(disc + i)), n2));
+        _mm256_storeu_pd(price + i, _mm256_mul_pd(sign, value));
+        if (vega != NULL)
+        {
+            __m256d v = _mm256_mul_pd(_mm256_mul_pd(vs, gauss1), _mm256_loadu_pd(sqrt_t + i));
+            _mm256_storeu_pd(vega + i, _mm256_mul_pd(v, _mm256_set1_pd(INV_SQRT_2PI)));
+        }
+    }
+    bsTileScalar(n - i, s + i, k + i, r + i, t + i, sigma + i, call + i, sqrt_t + i, disc + i, price + i, vega == NULL ? NULL : vega + i);
+}
+
+__attribute__((target("avx512f"))) static inline __m512d expAvx512(__m512d x)
+{
+    x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(-EXP_LIMIT)), _mm512_set1_pd(EXP_LIMIT));
+    __m512d magic = _mm512_set1_pd(ROUND_MAGIC);
+    __m512d shifted = _mm512_add_pd(_mm512_mul_pd(x, _mm512_set1_pd(LOG2E)), magic);
+    __m512d k = _mm512_sub_pd(shifted, magic);
+    __m512d r = _mm512_sub_pd(_mm512_sub_pd(x, _mm512_mul_pd(k, _mm512_set1_pd(LN2_HI))), _mm512_mul_pd(k, _mm512_set1_pd(LN2_LO)));
+    __m512d p = _mm512_set1_pd(EXP_COEFFS[13]);
+    for (int i = 12; i >= 0; --i)
+    {
+        p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(EXP_COEFFS[i]));
+    }
+    __m512i scale = _mm512_sub_epi64(_mm512_castpd_si512(shifted), _mm512_castpd_si512(magic));
+    scale = _mm512_slli_epi64(_mm512_add_epi64(scale, _mm512_set1_epi64(1023)), 52);
+    return _mm512_mul_pd(p, _mm512_castsi512_pd(scale));
+}
+
+__attribute__((target("avx512f"))) static inline __m512d logAvx512(__m512d x)
+{
+    const __m512i two52_bits = _mm512_set1_epi64(0x4330000000000000LL);
+    const __m512d two52 = _mm512_set1_pd(4503599627370496.0);
+    const __m512d one = _mm512_set1_pd(1.0);
+    __m512i bits = _mm512_castpd_si512(x);
+    __m512d e = _mm512_sub_pd(_mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(bits, 52), two52_bits)), two52), _mm512_set1_pd(1023.0));
+    __m512d m = _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi64(0x000FFFFFFFFFFFFFLL)), _mm512_set1_epi64(0x3FF0000000000000LL)));
+    __mmask8 big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(SQRT2), _CMP_GT_OQ);
+    m = _mm512_mask_mul_pd(m, big, m, _mm512_set1_pd(0.5));
+    e = _mm512_mask_add_pd(e, big, e, one);
+    __m512d f = _mm512_div_pd(_mm512_sub_pd(m, one), _mm512_add_pd(m, one));
+    __m512d s = _mm512_mul_pd(f, f);
+    __m512d p = _mm512_set1_pd(LOG_COEFFS[10]);
+    for (int i = 9; i >= 0; --i)
+    {
+        p = _mm512_add_pd(_mm512_mul_pd(p, s), _mm512_set1_pd(LOG_COEFFS[i]));
+    }
+    __m512d log_m = _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(2.0), f), p);
+    return _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(LN2_HI)), _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(LN2_LO)), log_m));
+}
+
+__attribute__((target("avx512f"))) static inline __m512d normalCdfAvx512(__m512d x, __m512d &gauss)
+{
+    __m512d a = _mm512_min_pd(_mm512_abs_pd(x), _mm512_set1_pd(CDF_LIMIT));
+    gauss = expAvx512(_mm512_mul_pd(_mm512_set1_pd(-0.5), _mm512_mul_pd(a, a)));
+
+    __m512d num = _mm512_set1_pd(CDF_NUM[6]);
+    for (int i = 5; i >= 0; --i)
+    {
+        num = _mm512_add_pd(_mm512_mul_pd(num, a), _mm512_set1_pd(CDF_NUM[i]));
+    }
+    __m512d den = _mm512_set1_pd(CDF_DEN[7]);
+    for (int i = 6; i >= 0; --i)
+    {
+        den = _mm512_add_pd(_mm512_mul_pd(den, a), _mm512_set1_pd(CDF_DEN[i]));
+    }
+    __m512d lower = _mm512_div_pd(_mm512_mul_pd(gauss, num), den);
+
+    __mmask8 is_far = _mm512_cmp_pd_mask(a, _mm512_set1_pd(CDF_SPLIT), _CMP_GE_OQ);
+    if (is_far != 0)
+    {
+        __m512d tail = _mm512_add_pd(a, _mm512_set1_pd(0.65));
+        tail = _mm512_add_pd(a, _mm512_div_pd(_mm512_set1_pd(4.0), tail));
+        tail = _mm512_add_pd(a, _mm512_div_pd(_mm512_set1_pd(3.0), tail));
+        tail = _mm512_add_pd(a, _mm512_div_pd(_mm512_set1_pd(2.0), tail));
+        tail = _mm512_add_pd(a, _mm512_div_pd(_mm512_set1_pd(1.0), tail));
+        lower = _mm512_mask_blend_pd(is_far, lower, _mm512_div_pd(gauss, _mm512_mul_pd(tail, _mm512_set1_pd(SQRT_2PI))));
+    }
+    __m512d upper = _mm512_sub_pd(_mm512_set1_pd(1.0), lower);
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_GT_OQ), lower, upper);
+}
+
+__attribute__((target("avx512f"))) static void bsTileAvx512(size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, const double *sqrt_t, const double *disc, double *price, double *vega)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512d vs = _mm512_loadu_pd(s + i);
+        __m512d vk = _mm512_loadu_pd(k + i);
+        __m512d vsigma = _mm512_loadu_pd(sigma + i);
+        __m512d vol_sqrt_t = _mm512_mul_pd(vsigma, _mm512_loadu_pd(sqrt_t + i));
+        __m512d carry = _mm512_add_pd(_mm512_loadu_pd(r + i), _mm512_mul_pd(_mm512_set1_pd(0.5), _mm512_mul_pd(vsigma, vsigma)));
+        __m512d d1 = _mm512_div_pd(_mm512_add_pd(logAvx512(_mm512_div_pd(vs, vk)), _mm512_mul_pd(carry, _mm512_loadu_pd(t + i))), vol_sqrt_t);
+        __m512d d2 = _mm512_sub_pd(d1, vol_sqrt_t);
+
+        long long flags;
+        memcpy(&flags, call + i, sizeof(flags));
+        __mmask8 is_put = _mm512_cmpeq_epi64_mask(_mm512_cvtepu8_epi64(_mm_cvtsi64_si128(flags)), _mm512_setzero_si512());
+        __m512d sign = _mm512_mask_blend_pd(is_put, _mm512_set1_pd(1.0), _mm512_set1_pd(-1.0));
+
+        __m512d gauss1, gauss2;
+        __m512d n1 = normalCdfAvx512(_mm512_mul_pd(sign, d1), gauss1);
+        __m512d n2 = normalCdfAvx512(_mm512_mul_pd(sign, d2), gauss2);
+        __m512d value = _mm512_sub_pd(_mm512_mul_pd(vs, n1), _mm512_mul_pd(_mm512_mul_pd(vk, _mm512_loadu_pd(disc + i)), n2));
+        _mm512_storeu_pd(price + i, _mm512_mul_pd(sign, value));
+        if (vega != NULL)
+        {
+            __m512d v = _mm512_mul_pd(_mm512_mul_pd(vs, gauss1), _mm512_loadu_pd(sqrt_t + i));
+            _mm512_storeu_pd(vega + i, _mm512_mul_pd(v, _mm512_set1_pd(INV_SQRT_2PI)));
+        }
+    }
+    bsTileScalar(n - i, s + i, k + i, r + i, t + i, sigma + i, call + i, sqrt_t + i, disc + i, price + i, vega == NULL ? NULL : vega + i);
+}
+#endif
+
+void bsPriceBatchTerms(SimdLevel level, size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, const double *sqrt_t, const double *disc, double *price, double *vega)
+{
+#if MC_X86
+    if (level == SIMD_AVX512)
+    {
+        bsTileAvx512(n, s, k, r, t, sigma, call, sqrt_t, disc, price, vega);
+        return;
+    }
+    if (level == SIMD_AVX2)
+    {
+        bsTileAvx2(n, s, k, r, t, sigma, call, sqrt_t, disc, price, vega);
+        return;
+    }
+#endif
+    (void)level;
+    bsTileScalar(n, s, k, r, t, sigma, call, sqrt_t, disc, price, vega);
+}
+
+void bsPriceBatch(SimdLevel level, size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, double *price, double *vega)
+{
+    double sqrt_t[TILE];
+    double disc[TILE];
+    for (size_t first = 0; first < n; first += TILE)
+    {
+        size_t m = std::min((size_t)TILE, n - first);
+        bsExpiryTerms(m, r + first, t + first, sqrt_t, disc);
+        bsPriceBatchTerms(level, m, s + first, k + first, r + first, t + first, sigma + first, call + first, sqrt_t, disc, price + first, vega == NULL ? NULL : vega + first);
+    }
+}
+
+void bsPriceBatch(const OptionBatch &batch, std::vector<double> &price, int n_threads)
+{
+    size_t n = batch.size();
+    price.resize(n);
+    SimdLevel level = detectSimdLevel();
+    if (n_threads <= 1 || (long long)n < 2 * PARALLEL_CHUNK)
+    {
+        bsPriceBatch(level, n, batch.spot.data(), batch.strike.data(), batch.rate.data(), batch.time.data(), batch.vol.data(), batch.call.data(), price.data());
+        return;
+    }
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    double *out = price.data();
+    pool->parallelFor((long long)n, PARALLEL_CHUNK, [&](int, long long begin, long long end) {
+        bsPriceBatch(level, (size_t)(end - begin), &batch.spot[begin], &batch.strike[begin], &batch.rate[begin], &batch.time[begin], &batch.vol[begin], &batch.call[begin], out + begin);
+    }, n_threads);
+}
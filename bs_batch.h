@@ -0,0 +1,49 @@
+#include <cstddef>
+#include <vector>
+#include "simd.h"
+#ifndef BS_BATCH_H
+#define BS_BATCH_H
+
+/*
+Black-Scholes over whole option chains.
+Inputs are structure of arrays so the kernel streams them with vector loads.
+exp, log and the normal CDF are our own (same operations at every SIMD level,
+so scalar, AVX2 and AVX-512 give the same bits). fastNormalCDF is within 3e-16
+absolute of 0.5 erfc(-x / sqrt 2) on the whole real line (relative error of the
+lower tail: 1e-14 down to -2, 1e-8 worst around -8). Prices agree with
+bsOptionPrice to 1e-13 absolute.
+Times and volatilities must be positive.
+*/
+
+struct OptionBatch
+{
+    std::vector<double> spot;
+    std::vector<double> strike;
+    std::vector<double> rate;
+    std::vector<double> time;
+    std::vector<double> vol;
+    std::vector<unsigned char> call; // 1 call, 0 put
+
+    void add(bool is_call, double s, double k, double r, double t, double sigma);
+    void reserve(size_t n);
+    void clear();
+    size_t size() const { return spot.size(); }
+};
+
+// Scalar version of the normal CDF used by the batch kernels
+double fastNormalCDF(double x);
+
+// price[i] for i in [0, n). Consecutive options with the same rate and time
+// (a chain sorted by expiry) share sqrt(t) and the discount factor.
+// vega, if given, gets dprice/dsigma for little extra work.
+void bsPriceBatch(SimdLevel level, size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, double *price, double *vega = NULL);
+
+// sqrt(t) and exp(-r t) for every option, recomputed only when the expiry changes
+void bsExpiryTerms(size_t n, const double *r, const double *t, double *sqrt_t, double *disc);
+// bsPriceBatch with the expiry terms already at hand, for solvers pricing the same options many times
+void bsPriceBatchTerms(SimdLevel level, size_t n, const double *s, const double *k, const double *r, const double *t, const double *sigma, const unsigned char *call, const double *sqrt_t, const double *disc, double *price, double *vega = NULL);
+
+// Whole batch, split over the shared thread pool when it is large enough
+void bsPriceBatch(const OptionBatch &batch, std::vector<double> &price, int n_threads = 1);
+
+#endif //
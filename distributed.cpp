@@ -0,0 +1,594 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include "distributed.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+static const uint32_t CLUSTER_MAGIC = 0x4c53434d; // "MCSL"
+static const uint32_t CLUSTER_VERSION = 1;
+static const size_t IN_FLIGHT = 2; // slices queued per connection, so workers don't wait on the round trip
+static const int POLL_MS = 100;
+
+// Everything a worker needs to price one slice
+struct SliceRequest
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t job;
+    int64_t slice;
+    int64_t first_sample;
+    int64_t count;
+    uint64_t seed;
+    double spot;
+    double drift;
+    double volatility;
+    double interest_rate;
+    double increment;
+    double strike;
+    double t;
+    int32_t iterations;
+    int32_t duration;
+    int32_t mode; // resolved by the coordinator, never PRICING_AUTO
+    int32_t control;
+    uint8_t call;
+    uint8_t antithetic;
+    uint8_t moment_matching;
+    uint8_t reserved[5];
+};
+
+struct SliceReply
+{
+    uint32_t magic;
+    int32_t status; // 0 ok, 1 the slice threw
+    uint64_t job;
+    int64_t slice;
+    EstimatorAccumulator::State state;
+};
+
+static double steadySeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool sendAll(int fd, const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// False on end of stream, error or receive timeout
+static bool recvAll(int fd, void *data, size_t size)
+{
+    char *p = (char *)data;
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Samples of slice, all slices but the last are CLUSTER_SLICE long
+static EstimatorAccumulator accumulateSlice(const MonteCarloSimulation &mcs, const Option &option, PricingMode used, long long first_sample, long long count)
+{
+    EstimatorAccumulator acc = mcs.makeAccumulator(option);
+    mcs.accumulatePaths(option, used, (uint64_t)first_sample, count, acc);
+    return acc;
+}
+
+static long long sliceCount(const MonteCarloSimulation &mcs)
+{
+    return (mcs.sampleCount() + CLUSTER_SLICE - 1) / CLUSTER_SLICE;
+}
+
+static long long sliceLength(const MonteCarloSimulation &mcs, long long slice)
+{
+    return std::min(CLUSTER_SLICE, mcs.sampleCount() - slice * CLUSTER_SLICE);
+}
+
+static void runSlicesLocally(const MonteCarloSimulation &mcs, const Option &option, PricingMode used, const std::vector<long long> &slices, std::vector<EstimatorAccumulator> &per_slice, int n_threads)
+{
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    pool->parallelFor((long long)slices.size(), 1, [&](int, long long begin, long long end) {
+        for (long long i = begin; i < end; ++i)
+        {
+            long long slice = slices[i];
+            per_slice[slice] = accumulateSlice(mcs, option, used, slice * CLUSTER_SLICE, sliceLength(mcs, slice));
+        }
+    }, n_threads);
+}
+
+static MonteCarloResult mergeSlices(const MonteCarloSimulation &mcs, const Option &option, PricingMode used, const std::vector<EstimatorAccumulator> &per_slice)
+{
+    EstimatorAccumulator acc = mcs.makeAccumulator(option);
+    {
+        MC_METRIC_SCOPE(STAGE_REDUCE);
+        for (const EstimatorAccumulator &slice : per_slice)
+        {
+            acc.merge(slice);
+        }
+    }
+    if (acc.paths() == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate option");
+    }
+    return makeResult(acc, used);
+}
+
+MonteCarloResult estimateOptionSliced(const MonteCarloSimulation &mcs, const Option &option, int n_threads)
+{
+    PricingMode used = mcs.resolveMode(option);
+    long long n_slices = sliceCount(mcs);
+    std::vector<EstimatorAccumulator> per_slice((size_t)n_slices, mcs.makeAccumulator(option));
+    std::vector<long long> slices;
+    for (long long s = 0; s < n_slices; ++s)
+    {
+        slices.push_back(s);
+    }
+    runSlicesLocally(mcs, option, used, slices, per_slice, n_threads);
+    return mergeSlices(mcs, option, used, per_slice);
+}
+
+std::vector<WorkerAddress> parseWorkerAddresses(const std::string &list)
+{
+    std::vector<WorkerAddress> workers;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t comma = list.find(',', start);
+        std::string item = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        start = (comma == std::string::npos) ? list.size() + 1 : comma + 1;
+        if (item.empty())
+        {
+            continue;
+        }
+        WorkerAddress worker;
+        worker.connections = 1;
+        size_t star = item.find('*');
+        if (star != std::string::npos)
+        {
+            worker.connections = atoi(item.c_str() + star + 1);
+            item.erase(star);
+        }
+        size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+        {
+            throw std::invalid_argument("worker address '" + item + "' isn't host:port");
+        }
+        worker.host = item.substr(0, colon);
+        worker.port = atoi(item.c_str() + colon + 1);
+        if (worker.port <= 0 || worker.port > 65535 || worker.connections < 1)
+        {
+            throw std::invalid_argument("worker address '" + item + "' needs a port and a positive connection count");
+        }
+        workers.push_back(worker);
+    }
+    return workers;
+}
+
+// Blocking socket to host:port with receive timeout, -1 if nothing answers within timeout
+static int connectTo(const std::string &host, int port, double timeout)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found = NULL;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0)
+    {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *a = found; a != NULL && fd < 0; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        // Non blocking connect, so an unreachable host costs timeout and not the system's minutes
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int error = 0;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) < 0)
+        {
+            error = errno;
+            if (error == EINPROGRESS)
+            {
+                // Writable once connected or refused, SO_ERROR tells which
+                pollfd p = {fd, POLLOUT, 0};
+                socklen_t len = sizeof(error);
+                if (poll(&p, 1, (int)(timeout * 1000.0)) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+                {
+                    error = ETIMEDOUT;
+                }
+            }
+        }
+        if (error != 0)
+        {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        fcntl(fd, F_SETFL, flags);
+    }
+    freeaddrinfo(found);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval tv;
+    tv.tv_sec = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - (double)tv.tv_sec) * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+PricingCluster::PricingCluster(const std::vector<WorkerAddress> &workers, double timeout_seconds, int local_threads) : timeout(timeout_seconds), local_threads(local_threads), next_job(1)
+{
+    if (!(timeout_seconds > 0.0) || local_threads < 1)
+    {
+        throw std::invalid_argument("Cluster needs a positive timeout and at least one local thread");
+    }
+    memset(&totals, 0, sizeof(totals));
+    for (const WorkerAddress &worker : workers)
+    {
+        for (int i = 0; i < worker.connections; ++i)
+        {
+            Connection connection;
+            connection.fd = connectTo(worker.host, worker.port, timeout);
+            connection.name = worker.host + ":" + std::to_string(worker.port);
+            connection.last_heard = 0.0;
+            if (connection.fd < 0)
+            {
+                ++totals.lost;
+                continue;
+            }
+            ++totals.connections;
+            connections.push_back(connection);
+        }
+    }
+}
+
+PricingCluster::~PricingCluster()
+{
+    for (Connection &connection : connections)
+    {
+        if (connection.fd >= 0)
+        {
+            close(connection.fd);
+        }
+    }
+}
+
+int PricingCluster::liveConnections() const
+{
+    int live = 0;
+    for (const Connection &connection : connections)
+    {
+        live += connection.fd >= 0;
+    }
+    return live;
+}
+
+// Closes the connection, whatever it had in flight goes back to the front of pending
+void PricingCluster::drop(Connection &connection, std::vector<long long> &pending)
+{
+    close(connection.fd);
+    connection.fd = -1;
+    ++totals.lost;
+    totals.slices_reassigned += (long long)connection.in_flight.size();
+    for (size_t i = connection.in_flight.size(); i-- > 0;)
+    {
+        pending.push_back(connection.in_flight[i]);
+    }
+    connection.in_flight.clear();
+}
+
+MonteCarloResult PricingCluster::estimate(const MonteCarloSimulation &mcs, const Option &option)
+{
+    PricingMode used = mcs.resolveMode(option);
+    long long n_slices = sliceCount(mcs);
+    std::vector<EstimatorAccumulator> per_slice((size_t)n_slices, mcs.makeAccumulator(option));
+    // Handed out from the back: lowest slice first
+    std::vector<long long> pending;
+    for (long long s = n_slices; s-- > 0;)
+    {
+        pending.push_back(s);
+    }
+
+    SliceRequest request;
+    memset(&request, 0, sizeof(request));
+    request.magic = CLUSTER_MAGIC;
+    request.version = CLUSTER_VERSION;
+    request.job = next_job++;
+    request.seed = mcs.seed;
+    request.spot = mcs.stock.price;
+    request.drift = mcs.stock.drift;
+    request.volatility = mcs.stock.volatility;
+    request.interest_rate = mcs.stock.interest_rate;
+    request.increment = mcs.increment;
+    request.strike = option.strike;
+    request.t = option.t;
+    request.iterations = mcs.iterations;
+    request.duration = mcs.duration;
+    request.mode = used;
+    request.control = mcs.variance_reduction.control;
+    request.call = option.call;
+    request.antithetic = mcs.variance_reduction.antithetic;
+    request.moment_matching = mcs.variance_reduction.moment_matching;
+
+    long long remaining = n_slices;
+    while (remaining > 0)
+    {
+        // Keep IN_FLIGHT slices queued on every live connection
+        std::vector<pollfd> fds;
+        std::vector<Connection *> owners;
+        for (Connection &connection : connections)
+        {
+            while (connection.fd >= 0 && connection.in_flight.size() < IN_FLIGHT && !pending.empty())
+            {
+                long long slice = pending.back();
+                request.slice = slice;
+                request.first_sample = slice * CLUSTER_SLICE;
+                request.count = sliceLength(mcs, slice);
+                if (!sendAll(connection.fd, &request, sizeof(request)))
+                {
+                    drop(connection, pending);
+                    break;
+                }
+                if (connection.in_flight.empty())
+                {
+                    connection.last_heard = steadySeconds();
+                }
+                connection.in_flight.push_back(slice);
+                pending.pop_back();
+            }
+            if (connection.fd >= 0 && !connection.in_flight.empty())
+            {
+                pollfd p = {connection.fd, POLLIN, 0};
+                fds.push_back(p);
+                owners.push_back(&connection);
+            }
+        }
+
+        if (fds.empty())
+        {
+            // Nobody left to send to, the rest runs here
+            totals.slices_local += (long long)pending.size();
+            runSlicesLocally(mcs, option, used, pending, per_slice, local_threads);
+            remaining -= (long long)pending.size();
+            pending.clear();
+            continue;
+        }
+
+        if (poll(fds.data(), fds.size(), POLL_MS) < 0 && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+        }
+        double now = steadySeconds();
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            Connection &connection = *owners[i];
+            if (fds[i].revents == 0)
+            {
+                if (now - connection.last_heard > timeout)
+                {
+                    drop(connection, pending);
+                }
+                continue;
+            }
+            // Replies come back in the order the slices were sent
+            SliceReply reply;
+            if (!recvAll(connection.fd, &reply, sizeof(reply)) || reply.magic != CLUSTER_MAGIC || reply.job != request.job || reply.slice != connection.in_flight.front() || reply.status != 0)
+            {
+                drop(connection, pending);
+                continue;
+            }
+            per_slice[reply.slice].restore(reply.state);
+            connection.in_flight.erase(connection.in_flight.begin());
+            connection.last_heard = now;
+            ++totals.slices_remote;
+            --remaining;
+        }
+    }
+    return mergeSlices(mcs, option, used, per_slice);
+}
+
+// Prices the slices one coordinator sends until it hangs up
+static void serveConnection(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    SliceRequest request;
+    while (recvAll(fd, &request, sizeof(request)))
+    {
+        if (request.magic != CLUSTER_MAGIC || request.version != CLUSTER_VERSION)
+        {
+            break;
+        }
+        SliceReply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.magic = CLUSTER_MAGIC;
+        reply.job = request.job;
+        reply.slice = request.slice;
+        try
+        {
+            Asset stock = {"", request.spot, request.drift, request.volatility, request.interest_rate};
+            MonteCarloSimulation mcs(request.iterations, request.duration, request.increment, stock, false, request.seed);
+            mcs.variance_reduction.antithetic = request.antithetic != 0;
+            mcs.variance_reduction.control = (ControlVariate)request.control;
+            mcs.variance_reduction.moment_matching = request.moment_matching != 0;
+            Option option;
+            option.stock = stock;
+            option.call = request.call != 0;
+            option.premium = 0.0;
+            option.strike = request.strike;
+            option.t = request.t;
+            reply.state = accumulateSlice(mcs, option, (PricingMode)request.mode, request.first_sample, request.count).state();
+            reply.status = 0;
+        }
+        catch (const std::exception &)
+        {
+            reply.status = 1;
+        }
+        if (!sendAll(fd, &reply, sizeof(reply)))
+        {
+            break;
+        }
+    }
+    close(fd);
+}
+
+int listenForCoordinators(const std::string &host, int &port)
+{
+    std::string where = host + ":" + std::to_string(port);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *found = NULL;
+    int status = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found);
+    if (status != 0)
+    {
+        throw std::runtime_error("can't listen on " + where + ": " + gai_strerror(status));
+    }
+    int fd = -1;
+    int error = 0;
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    for (addrinfo *a = found; a != NULL && fd < 0; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+        {
+            error = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) < 0 || listen(fd, 64) < 0 || getsockname(fd, (sockaddr *)&addr, &len) < 0)
+        {
+            error = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd < 0)
+    {
+        throw std::runtime_error("can't listen on " + where + ": " + strerror(error));
+    }
+    port = ntohs(addr.ss_family == AF_INET6 ? ((sockaddr_in6 *)&addr)->sin6_port : ((sockaddr_in *)&addr)->sin_port);
+    return fd;
+}
+
+void servePricingWorker(int listen_fd)
+{
+    signal(SIGCHLD, SIG_IGN); // connection processes are reaped by the system
+    while (true)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("accept failed: ") + strerror(errno));
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(listen_fd);
+            serveConnection(fd);
+            _exit(0);
+        }
+        // If the fork failed the coordinator sees the connection close and moves on
+        close(fd);
+    }
+}
+
+pid_t spawnLocalWorker(int connections, WorkerAddress &address)
+{
+    // Bound before the fork, so the caller can connect as soon as we return.
+    // Loopback only: nothing but this process should reach it.
+    int port = 0;
+    int fd = listenForCoordinators("127.0.0.1", port);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fd);
+        throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+    }
+    if (pid == 0)
+    {
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // don't outlive the coordinator
+#endif
+        try
+        {
+            servePricingWorker(fd);
+        }
+        catch (...)
+        {
+        }
+        _exit(1);
+    }
+    close(fd);
+    address.host = "127.0.0.1";
+    address.port = port;
+    address.connections = connections;
+    return pid;
+}
+
+void stopLocalWorker(pid_t pid)
+{
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
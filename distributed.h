@@ -0,0 +1,95 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "functions.h"
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+/*
+Monte Carlo spread over processes, on this host or others, over TCP.
+The samples of a run are cut in slices of CLUSTER_SLICE. Each slice is accumulated
+alone, on one thread, and the slices are merged in order, so the result doesn't
+depend on who computed what: any number of workers, or none, gives the same bits
+as estimateOptionSliced. Sample i always draws from Philox substream i of the seed,
+so a worker skips ahead to its slice for free.
+The coordinator (PricingCluster) keeps a couple of slices in flight on every
+connection. A connection that fails or stays silent past the timeout is dropped,
+and its slices are handed to the others; with none left, they run locally.
+Messages are fixed size structs in host byte order: all hosts run the same build.
+Hosts may still pick different SIMD levels at run time: every kernel rounds like
+the scalar code, so a scalar worker and an AVX-512 one return the same bits.
+A worker server forks one process per connection, so a host with n cores takes
+n connections (host:port*n).
+*/
+
+static const long long CLUSTER_SLICE = 1 << 16; // samples, whole path batches
+
+struct WorkerAddress
+{
+    std::string host;
+    int port;
+    int connections; // slices priced at once there, one process each
+};
+// "host:port[*connections],..."
+std::vector<WorkerAddress> parseWorkerAddresses(const std::string &list);
+
+struct ClusterStats
+{
+    int connections;            // opened
+    int lost;                   // dropped, failed or timed out
+    long long slices_remote;
+    long long slices_local;     // run here once no connection was left
+    long long slices_reassigned;
+};
+
+// The single process reference: slices accumulated on the local pool, merged in order
+MonteCarloResult estimateOptionSliced(const MonteCarloSimulation &mcs, const Option &option, int n_threads);
+
+class PricingCluster
+{
+public:
+    // Connects to every worker, an address that can't be reached counts as lost.
+    // local_threads is the pool used when no connection is left.
+    PricingCluster(const std::vector<WorkerAddress> &workers, double timeout_seconds = 60.0, int local_threads = 1);
+    ~PricingCluster();
+    PricingCluster(const PricingCluster &) = delete;
+    PricingCluster &operator=(const PricingCluster &) = delete;
+
+    // Same result as estimateOptionSliced. Not thread safe, one run at a time.
+    MonteCarloResult estimate(const MonteCarloSimulation &mcs, const Option &option);
+
+    int liveConnections() const;
+    ClusterStats stats() const { return totals; }
+
+private:
+    struct Connection
+    {
+        int fd; // -1 once lost
+        std::string name;
+        std::vector<long long> in_flight; // slices sent, oldest first
+        double last_heard;                // steady clock seconds
+    };
+
+    std::vector<Connection> connections;
+    double timeout;
+    int local_threads;
+    uint64_t next_job;
+    ClusterStats totals;
+
+    void drop(Connection &connection, std::vector<long long> &pending);
+};
+
+// Listening socket on the address host resolves to ("127.0.0.1", or "0.0.0.0" for
+// every interface), port 0 for any free one. Sets port to the one bound.
+// Workers run whatever slices they are sent, don't bind where strangers can reach.
+int listenForCoordinators(const std::string &host, int &port);
+// Accepts coordinators on listen_fd forever, one forked process per connection
+void servePricingWorker(int listen_fd);
+// Forks a worker server on a free loopback port, address takes the given number of connections.
+// Fork before starting threads: the server process only keeps the calling one.
+pid_t spawnLocalWorker(int connections, WorkerAddress &address);
+// Kills a spawned server, its connection processes exit when the coordinator disconnects
+void stopLocalWorker(pid_t pid);
+
+#endif //
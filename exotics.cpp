@@ -0,0 +1,44 @@
+#include <stdexcept>
+#include "exotics.h"
+
+double geometricAsianPrice(bool call, double s0, double k, double mu, double sigma, double dt, int steps)
+{
+    if (steps < 1 || !(dt > 0.0) || !(sigma > 0.0) || !(s0 > 0.0) || !(k > 0.0))
+    {
+        throw std::invalid_argument("Geometric Asian needs positive steps, dt, vol, spot and strike");
+    }
+    double m = log(s0) + (mu - 0.5 * sigma * sigma) * dt * (steps + 1) / 2.0;
+    double v = sigma * sigma * dt * (steps + 1) * (2.0 * steps + 1) / (6.0 * steps);
+    double sd = sqrt(v);
+    double d1 = (m - log(k) + v) / sd;
+    double d2 = d1 - sd;
+    double forward = exp(m + 0.5 * v);
+    if (call)
+    {
+        return forward * normalCDF(d1) - k * normalCDF(d2);
+    }
+    return k * normalCDF(-d2) - forward * normalCDF(-d1);
+}
+
+template <class Payoff>
+MonteCarloResult estimateExoticOption(const MonteCarloSimulation &mcs, const Payoff &payoff, int n_threads)
+{
+    const Asset &stock = mcs.stock;
+    if (!(stock.price > 0.0) || !(stock.volatility > 0.0))
+    {
+        throw std::invalid_argument("Exotic payoffs need a positive spot and volatility");
+    }
+    GbmModel model;
+    model.mu = stock.drift;
+    model.sigma = stock.volatility;
+    return estimatePathOption(mcs, model, payoff, n_threads);
+}
+
+template MonteCarloResult estimateExoticOption<ArithmeticAsianPayoff>(const MonteCarloSimulation &, const ArithmeticAsianPayoff &, int);
+template MonteCarloResult estimateExoticOption<GeometricAsianPayoff>(const MonteCarloSimulation &, const GeometricAsianPayoff &, int);
+template MonteCarloResult estimateExoticOption<UpAndOutPayoff>(const MonteCarloSimulation &, const UpAndOutPayoff &, int);
+template MonteCarloResult estimateExoticOption<UpAndInPayoff>(const MonteCarloSimulation &, const UpAndInPayoff &, int);
+template MonteCarloResult estimateExoticOption<DownAndOutPayoff>(const MonteCarloSimulation &, const DownAndOutPayoff &, int);
+template MonteCarloResult estimateExoticOption<DownAndInPayoff>(const MonteCarloSimulation &, const DownAndInPayoff &, int);
+template MonteCarloResult estimateExoticOption<FloatingLookbackPayoff>(const MonteCarloSimulation &, const FloatingLookbackPayoff &, int);
+template MonteCarloResult estimateExoticOption<FixedLookbackPayoff>(const MonteCarloSimulation &, const FixedLookbackPayoff &, int);
@@ -0,0 +1,219 @@
+#include <cmath>
+#include <algorithm>
+#include "functions.h"
+#include "models.h"
+#ifndef EXOTICS_H
+#define EXOTICS_H
+
+/*
+Path dependent payoffs as compile time policies for estimatePathOption (models.h).
+A payoff keeps what it needs of a batch of paths in its State (a running sum,
+an extreme, a survival probability: O(1) per path) and updates it in observe()
+after every step from the log prices before and after it, so no path is stored.
+Payoffs with BRIDGE set also get the variance of each path's step from the model.
+The engine is instantiated once per model and payoff, and the observe loops have
+no branch, call / put and up / down are either arithmetic or template parameters.
+estimateExoticOption runs them on GbmModel, the paths of GbmPathEngine for the
+same seed; estimatePathOption on any model.
+*/
+
+// max(sign (x - k), 0), sign 1 for a call and -1 for a put
+inline double signedPayoff(double sign, double x, double k)
+{
+    return std::max(sign * (x - k), 0.0);
+}
+
+// Undiscounted closed form of the geometric average over the steps 1..steps of dt, S0 excluded.
+// log G is normal with mean log S0 + (mu - sigma^2 / 2) dt (steps + 1) / 2 and
+// variance sigma^2 dt (steps + 1) (2 steps + 1) / (6 steps).
+double geometricAsianPrice(bool call, double s0, double k, double mu, double sigma, double dt, int steps);
+
+// Average of the prices after every step
+struct ArithmeticAsianPayoff
+{
+    // The geometric average with the same strike, with its closed form as the mean
+    static const bool HAS_CONTROL = true;
+    static const bool BRIDGE = false;
+    bool call;
+    double strike;
+
+    struct State
+    {
+        double sum[MODEL_BATCH];
+        double log_sum[MODEL_BATCH];
+    };
+
+    void start(State &state, double log_s0, int n) const
+    {
+        (void)log_s0;
+        std::fill(state.sum, state.sum + n, 0.0);
+        std::fill(state.log_sum, state.log_sum + n, 0.0);
+    }
+    void observe(State &state, int n, const double *prev, const double *log_s, const double *bridge_var) const
+    {
+        (void)prev;
+        (void)bridge_var;
+        for (int p = 0; p < n; ++p)
+        {
+            state.sum[p] += exp(log_s[p]);
+            state.log_sum[p] += log_s[p];
+        }
+    }
+    double value(const State &state, int p, double log_s, int steps) const
+    {
+        (void)log_s;
+        return signedPayoff(call ? 1.0 : -1.0, state.sum[p] / steps, strike);
+    }
+    double control(const State &state, int p, int steps) const
+    {
+        return signedPayoff(call ? 1.0 : -1.0, exp(state.log_sum[p] / steps), strike);
+    }
+    double controlMean(double s0, double mu, double sigma, double dt, int steps) const
+    {
+        return geometricAsianPrice(call, s0, strike, mu, sigma, dt, steps);
+    }
+};
+
+// Geometric average of the prices after every step, priced in closed form by geometricAsianPrice
+struct GeometricAsianPayoff
+{
+    static const bool HAS_CONTROL = false;
+    static const bool BRIDGE = false;
+    bool call;
+    double strike;
+
+    struct State
+    {
+        double log_sum[MODEL_BATCH];
+    };
+
+    void start(State &state, double log_s0, int n) const
+    {
+        (void)log_s0;
+        std::fill(state.log_sum, state.log_sum + n, 0.0);
+    }
+    void observe(State &state, int n, const double *prev, const double *log_s, const double *bridge_var) const
+    {
+        (void)prev;
+        (void)bridge_var;
+        for (int p = 0; p < n; ++p)
+        {
+            state.log_sum[p] += log_s[p];
+        }
+    }
+    double value(const State &state, int p, double log_s, int steps) const
+    {
+        (void)log_s;
+        return signedPayoff(call ? 1.0 : -1.0, exp(state.log_sum[p] / steps), strike);
+    }
+    double control(const State &, int, int) const { return 0.0; }
+    double controlMean(double, double, double, double, int) const { return 0.0; }
+};
+
+// Vanilla on S_T, knocked out (or in) when the price crosses the barrier, watched continuously.
+// Between two steps the path is a brownian bridge in log space, which stays on the start side of
+// log B with probability 1 - exp(-2 (x0 - b) (x1 - b) / v), v the model's bridgeVariance:
+// sigma^2 dt under GBM, the variance at the start of the step under Heston or local vol. The state is the survival
+// probability of the path so far, the payoff is weighted by it rather than by a sampled crossing:
+// no extra draws, and less variance.
+template <bool UP, bool KNOCK_IN>
+struct BarrierPayoff
+{
+    static const bool HAS_CONTROL = false;
+    static const bool BRIDGE = true;
+    bool call;
+    double strike;
+    double barrier;
+
+    struct State
+    {
+        double log_barrier;
+        double survival[MODEL_BATCH];
+    };
+
+    void start(State &state, double log_s0, int n) const
+    {
+        state.log_barrier = log(barrier);
+        double inside = UP ? (log_s0 < state.log_barrier) : (log_s0 > state.log_barrier);
+        std::fill(state.survival, state.survival + n, inside);
+    }
+    void observe(State &state, int n, const double *prev, const double *log_s, const double *bridge_var) const
+    {
+        double b = state.log_barrier;
+        for (int p = 0; p < n; ++p)
+        {
+            double inside = UP ? (log_s[p] < b) : (log_s[p] > b);
+            // Clamped at 0 for a step ending across the barrier, already zeroed by inside
+            double crossing = exp(-2.0 / bridge_var[p] * std::max((prev[p] - b) * (log_s[p] - b), 0.0));
+            state.survival[p] *= inside * (1.0 - crossing);
+        }
+    }
+    double value(const State &state, int p, double log_s, int steps) const
+    {
+        (void)steps;
+        double alive = KNOCK_IN ? 1.0 - state.survival[p] : state.survival[p];
+        return alive * signedPayoff(call ? 1.0 : -1.0, exp(log_s), strike);
+    }
+    double control(const State &, int, int) const { return 0.0; }
+    double controlMean(double, double, double, double, int) const { return 0.0; }
+};
+typedef BarrierPayoff<true, false> UpAndOutPayoff;
+typedef BarrierPayoff<true, true> UpAndInPayoff;
+typedef BarrierPayoff<false, false> DownAndOutPayoff;
+typedef BarrierPayoff<false, true> DownAndInPayoff;
+
+// Extremes over S0 and the prices after every step (discrete monitoring).
+// Floating strike: S_T - min for a call, max - S_T for a put, strike unused.
+// Fixed strike: max(max - K, 0) for a call, max(K - min, 0) for a put.
+template <bool FLOATING>
+struct LookbackPayoff
+{
+    static const bool HAS_CONTROL = false;
+    static const bool BRIDGE = false;
+    bool call;
+    double strike;
+
+    struct State
+    {
+        double high[MODEL_BATCH]; // log
+        double low[MODEL_BATCH];
+    };
+
+    void start(State &state, double log_s0, int n) const
+    {
+        std::fill(state.high, state.high + n, log_s0);
+        std::fill(state.low, state.low + n, log_s0);
+    }
+    void observe(State &state, int n, const double *prev, const double *log_s, const double *bridge_var) const
+    {
+        (void)prev;
+        (void)bridge_var;
+        for (int p = 0; p < n; ++p)
+        {
+            state.high[p] = std::max(state.high[p], log_s[p]);
+            state.low[p] = std::min(state.low[p], log_s[p]);
+        }
+    }
+    double value(const State &state, int p, double log_s, int steps) const
+    {
+        (void)steps;
+        if (FLOATING)
+        {
+            return call ? exp(log_s) - exp(state.low[p]) : exp(state.high[p]) - exp(log_s);
+        }
+        return call ? signedPayoff(1.0, exp(state.high[p]), strike) : signedPayoff(-1.0, exp(state.low[p]), strike);
+    }
+    double control(const State &, int, int) const { return 0.0; }
+    double controlMean(double, double, double, double, int) const { return 0.0; }
+};
+typedef LookbackPayoff<true> FloatingLookbackPayoff;
+typedef LookbackPayoff<false> FixedLookbackPayoff;
+
+// estimatePathOption with GbmModel at mcs.stock's drift and volatility: GBM paths over
+// mcs.duration steps of mcs.increment, seeded by mcs.seed. The arithmetic Asian's control
+// is used with any control variate setting. Instantiated for the payoffs above, which
+// models.cpp instantiates estimatePathOption with for every model.
+template <class Payoff>
+MonteCarloResult estimateExoticOption(const MonteCarloSimulation &mcs, const Payoff &payoff, int n_threads);
+
+#endif //
@@ -9,6 +9,12 @@
 #include <vector>
 #include <algorithm>
 #include "functions.h"
+#include "path_engine.h"
+#include "thread_pool.h"
+#include "lattice.h"
+#include "implied_vol.h"
+#include "live_book.h"
+#include "metrics.h"
 
 // For Weiner Process
 std::atomic<bool> sim_stop(false);
@@ -16,24 +22,8 @@ std::atomic<bool> sim_running(false);
 std::atomic<bool> sim_paused(false);
 std::atomic<double> current_price(0.0);
 
-std::mutex sim_mutex;
 std::thread simulation_thread;
 
-// For Montecarlo simulation
-std::atomic<bool> mcs_running(false);
-std::atomic<bool> mcs_stop(false);
-std::atomic<double> mcs_approx_price(0.0);
-std::atomic<double> mcs_progress(0.0);
-std::atomic<bool> mcs_finish(false);
-
-std::mutex mcs_mutex;
-std::thread mcs_thread;
-
-//For multithreaded montecarlo simulation
-std::thread mcs_multithread;
-std::atomic<bool> mcs_multithread_running(false);
-std::atomic<int> mcs_multithread_progress(0);
-
 
 /*
 Project structure:
@@ -52,6 +42,43 @@ double normalCDF(double x)
     return 0.5 * erfc(-x * M_SQRT1_2);
 }
 
+double inverseNormalCDF(double p)
+{
+    // Acklam's rational approximation (relative error 1.2e-9)...
+    static const double a[6] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+    static const double b[5] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01};
+    static const double c[6] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+    static const double d[4] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00};
+    const double p_low = 0.02425;
+
+    if (p <= 0.0 || p >= 1.0)
+    {
+        throw std::invalid_argument("inverseNormalCDF needs 0 < p < 1");
+    }
+    double x;
+    if (p < p_low)
+    {
+        double q = sqrt(-2.0 * log(p));
+        x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+    }
+    else if (p <= 1.0 - p_low)
+    {
+        double q = p - 0.5;
+        double r = q * q;
+        x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1.0);
+    }
+    else
+    {
+        double q = sqrt(-2.0 * log(1.0 - p));
+        x = -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+    }
+
+    // ...then one Halley step on normalCDF(x) = p brings it to full double precision
+    double e = normalCDF(x) - p;
+    double u = e * sqrt(2.0 * M_PI) * exp(0.5 * x * x);
+    return x - u / (1.0 + 0.5 * x * u);
+}
+
 double bsOptionPrice(bool call, double s, double k, double r, double t, double sigma)
 {
     double d1 = (log(s / k) + (r + 0.5 * sigma * sigma) * t) / (sigma * sqrt(t));
@@ -71,6 +98,12 @@ double bsOptionPrice(bool call, double s, double k, double r, double t, double s
 
 double binomialOptionPrice(bool call, double s, double k, double r, double t, double sigma, int n, bool show_steps)
 {
+    // The full matrices below are only kept for the step by step trace
+    if (!show_steps)
+    {
+        return latticeOptionPrice(call, true, s, k, r, t, sigma, n, LATTICE_BINOMIAL);
+    }
+
     double time_step = t / (double)n;
     double up_factor = exp(sigma * sqrt(time_step));
     double down_factor = 1.0 / up_factor;
@@ -136,6 +169,11 @@ double binomialOptionPrice(bool call, double s, double k, double r, double t, do
     return option_values[0][0];
 }
 
+double optionPayoff(const Option &option, double final_price)
+{
+    return option.call ? std::max(final_price - option.strike, 0.0) : std::max(option.strike - final_price, 0.0);
+}
+
 double calculateAverage(const std::vector<double> &values)
 {
     if (values.empty())
@@ -151,36 +189,22 @@ double calculateAverage(const std::vector<double> &values)
 }
 
 // refine this func
-double impliedVolatility(double S, double K, double T, double r, double marketPrice, double tol = 1e-6, int maxIter = 1000)
+// Single quote through the batch solver, NaN when no volatility reproduces the price
+double impliedVolatility(bool call, double s, double k, double r, double t, double market_price)
 {
-    double lowVol = 0.0;
-    double highVol = 5.0; // Start with a high guess for volatility
-    double midVol = 0.0;
-
-    for (int i = 0; i < maxIter; ++i)
-    {
-        midVol = (lowVol + highVol) / 2.0;
-        double price = bsOptionPrice(true, S, K, T, r, midVol);
-
-        if (fabs(price - marketPrice) < tol)
-        {
-            return midVol; // Solution found
-        }
-
-        if (price > marketPrice)
-        {
-            highVol = midVol; // Volatility too high, reduce it
-        }
-        else
-        {
-            lowVol = midVol; // Volatility too low, increase it
-        }
-    }
+    unsigned char is_call = call ? 1 : 0;
+    double vol;
+    ImpliedVolStatus status;
+    impliedVolBatch(SIMD_SCALAR, 1, &s, &k, &r, &t, &is_call, &market_price, &vol, &status);
+    return vol;
+}
+WeinerProcessSimulator::WeinerProcessSimulator(double initialPrice, double drift, double volatility, double timeStep, bool loop, uint64_t seed, uint64_t stream) : price(initialPrice), mu(drift), sigma(volatility), dt(timeStep), rng(seed, stream), keep_going(loop) {}
 
-    // If it doesn't converge, return the best guess
-    return midVol;
+void WeinerProcessSimulator::reset(double initialPrice, uint64_t path)
+{
+    price = initialPrice;
+    rng.setStream(path);
 }
-WeinerProcessSimulator::WeinerProcessSimulator(double initialPrice, double drift, double volatility, double timeStep, bool loop) : price(initialPrice), mu(drift), sigma(volatility), dt(timeStep), keep_going(loop) {}
 
 // actually geometric brownian motion
 void WeinerProcessSimulator::simulateStep(bool show)
@@ -197,6 +221,11 @@ void WeinerProcessSimulator::simulateStep(bool show)
     price = new_price;
 }
 
+void WeinerProcessSimulator::stepWithIncrement(double dW, double h)
+{
+    price *= exp((mu - 0.5 * sigma * sigma) * h + sigma * dW);
+}
+
 void WeinerProcessSimulator::runSimulation(int n, int delay_ms, bool show)
 {
     if (n == -1)
@@ -225,13 +254,10 @@ void WeinerProcessSimulator::runSimulation(int n, int delay_ms, bool show)
 
 double WeinerProcessSimulator::generateNormal(double mean, double stddev)
 {
-    static std::random_device rd;
-    std::mt19937 gen(rd()); // Mersenne twister
-    std::normal_distribution<> d(mean, stddev);
-    return d(gen);
+    return mean + stddev * rng.nextNormal();
 }
 
-void runSimulationThread(int ms_delay, WeinerProcessSimulator &wps, bool sim_show_steps)
+void runSimulationThread(int ms_delay, WeinerProcessSimulator wps, bool sim_show_steps, LiveBook *book)
 {
     sim_running = true;
     while (!sim_stop)
@@ -241,12 +267,16 @@ void runSimulationThread(int ms_delay, WeinerProcessSimulator &wps, bool sim_sho
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
             continue;
         }
+        wps.simulateStep(sim_show_steps);
+        current_price.store(wps.getPrice(), std::memory_order_relaxed);
+        if (book != NULL)
+        {
+            book->pushTick(wps.getPrice());
+        }
+        if (ms_delay > 0)
         {
-            std::lock_guard<std::mutex> lock(sim_mutex);
-            wps.simulateStep(sim_show_steps);
-            current_price = wps.getPrice();
+            std::this_thread::sleep_for(std::chrono::milliseconds(ms_delay));
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(ms_delay));
     }
     sim_running = false;
 }
@@ -265,155 +295,323 @@ void stopCurrentSimulation()
     }
 }
 
-MonteCarloSimulation::MonteCarloSimulation(int iter, int durat, double dt, Asset stock, bool show_inc) : iterations(iter), duration(durat), stock(stock), increment(dt), show(show_inc) {}
+MonteCarloSimulation::MonteCarloSimulation(int iter, int durat, double dt, Asset stock, bool show_inc, uint64_t seed) : iterations(iter), duration(durat), stock(stock), increment(dt), show(show_inc), seed(seed), mode(PRICING_AUTO), variance_reduction(noVarianceReduction()) {}
+
+const char *pricingModeName(PricingMode mode)
+{
+    switch (mode)
+    {
+    case PRICING_STEPPED:
+        return "stepped";
+    case PRICING_EXACT_TERMINAL:
+        return "exact terminal";
+    default:
+        return "auto";
+    }
+}
+
+bool dependsOnTerminalOnly(const Option &option)
+{
+    // Plain calls and puts only look at the final price
+    (void)option;
+    return true;
+}
+
+PricingMode MonteCarloSimulation::resolveMode(const Option &option) const
+{
+    if (mode != PRICING_AUTO)
+    {
+        return mode;
+    }
+    // Tracing wants to see every step
+    return (dependsOnTerminalOnly(option) && !show) ? PRICING_EXACT_TERMINAL : PRICING_STEPPED;
+}
+
+void MonteCarloSimulation::finalPrices(PricingMode used, uint64_t first_path, int count, double *out, double *antithetic) const
+{
+    if (used == PRICING_EXACT_TERMINAL)
+    {
+        pathEngine().simulateTerminalExact(first_path, count, out, antithetic);
+    }
+    else
+    {
+        pathEngine().simulateTerminal(first_path, count, out, antithetic);
+    }
+}
+
+static double controlValue(ControlVariate control, const Option &control_option, double final_price)
+{
+    switch (control)
+    {
+    case CV_TERMINAL_STOCK:
+        return final_price;
+    case CV_BLACK_SCHOLES:
+        return optionPayoff(control_option, final_price);
+    default:
+        return 0.0;
+    }
+}
+
+Option MonteCarloSimulation::blackScholesControl(const Option &option) const
+{
+    double forward = stock.price * exp(stock.drift * duration * increment);
+    Option control = option;
+    control.strike = forward;
+    if (fabs(option.strike / forward - 1.0) < 0.05)
+    {
+        control.strike = option.call ? 1.1 * forward : 0.9 * forward;
+    }
+    return control;
+}
+
+double MonteCarloSimulation::controlMean(const Option &option) const
+{
+    // Expectations under the simulated drift, undiscounted like the payoffs
+    double horizon = duration * increment;
+    double growth = exp(stock.drift * horizon);
+    switch (variance_reduction.control)
+    {
+    case CV_TERMINAL_STOCK:
+        return stock.price * growth;
+    case CV_BLACK_SCHOLES:
+        return growth * bsOptionPrice(option.call, stock.price, blackScholesControl(option).strike, stock.drift, horizon, stock.volatility);
+    default:
+        return 0.0;
+    }
+}
+
+EstimatorAccumulator MonteCarloSimulation::makeAccumulator(const Option &option) const
+{
+    return EstimatorAccumulator(variance_reduction.control != CV_NONE, controlMean(option));
+}
+
+long long MonteCarloSimulation::sampleCount() const
+{
+    // With antithetics one sample costs two paths
+    return variance_reduction.antithetic ? (iterations + 1) / 2 : iterations;
+}
 
 
 double MonteCarloSimulation::estimateOption(Option option)
+{
+    return estimateOptionResult(option).price;
+}
+
+MonteCarloResult MonteCarloSimulation::estimateOptionResult(Option option)
 {
     
     /*
     Given an option properties, evaluate it's profitability knowing that prof=0 should be the bsOptionPrice
     */
-    std::vector<double> final_stock_prices;
+    PricingMode used = resolveMode(option);
+    EstimatorAccumulator acc = makeAccumulator(option);
 
-    // Collect data from weiner process
-
-    for (int i = 0; i < iterations; i++)
+    if (show && used == PRICING_STEPPED)
+    {
+        // Step by step trace (crude estimator), one random stream for the whole job
+        EstimatorAccumulator crude;
+        WeinerProcessSimulator wps(stock.price, stock.drift, stock.volatility, increment, true, seed);
+        for (int i = 0; i < iterations; i++)
+        {
+            PRINT_STEP(show, "iteration %d\n", i);
+            wps.reset(stock.price, i);
+            wps.runSimulation(duration, 0, show);
+            double payoff = optionPayoff(option, wps.getPrice());
+            crude.addPath(payoff);
+            crude.addSample(payoff, 0.0);
+        }
+        acc = crude;
+    }
+    else
     {
-        PRINT_STEP(show, "iteration %d\n", i);
-        WeinerProcessSimulator wps(stock.price, stock.drift, stock.volatility, increment, true);
-        wps.runSimulation(duration, 0, show);
-        final_stock_prices.push_back(wps.getPrice());
+        // Same paths, advanced in batches by the vectorized engine
+        accumulatePaths(option, used, 0, sampleCount(), acc);
     }
+    if (acc.paths() == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate option");
+    }
+    return makeResult(acc, used);
+}
 
-    std::vector<double> option_profit;
-    double profit;
-    for (const double &value : final_stock_prices)
+MonteCarloResult MonteCarloSimulation::estimateOptionToPrecision(Option option, double target_std_error, double max_seconds)
+{
+    /*
+    Run until the standard error of the estimate goes below target_std_error or
+    the time budget runs out, whichever comes first. iterations is ignored.
+    */
+    const long long chunk = 4096;
+    PricingMode used = resolveMode(option);
+    EstimatorAccumulator acc = makeAccumulator(option);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long next_sample = 0;
+    while (true)
     {
-        if (option.call)
+        accumulatePaths(option, used, next_sample, chunk, acc);
+        next_sample += chunk;
+        if (acc.stdError() < target_std_error)
         {
-            profit = std::max(value - option.strike, 0.0);
+            break;
         }
-        else
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() >= max_seconds)
         {
-            profit = std::max(option.strike - value, 0.0);
+            break;
         }
-        option_profit.push_back(profit);
     }
-    return calculateAverage(option_profit);
+    return makeResult(acc, used);
 }
 
-double MonteCarloSimulation::estimateOptionSingleTrial(Option option){
-    WeinerProcessSimulator wps(stock.price, stock.drift, stock.volatility, increment, true);
-    wps.runSimulation(duration, 0, show);
-    double finalPrice = wps.getPrice();
-
-    return (option.call) ? std::max(finalPrice - option.strike,0.0) : std::max(option.strike - finalPrice, 0.0);
-
-}
-
-void runMonteCarloThread(MonteCarloSimulation &mcs, Option &option)
+void MonteCarloSimulation::accumulatePaths(const Option &option, PricingMode used, uint64_t first_sample, long long count, EstimatorAccumulator &acc) const
 {
-    int i = 0;
-    mcs_running = true;
-    double discount_rate = exp(-mcs.stock.interest_rate * option.t);
-    std::vector<double> options_profit;
-    while (!mcs_stop && i < mcs.iterations)
+    double final_prices[GbmPathEngine::BATCH];
+    double mirrored[GbmPathEngine::BATCH];
+    bool antithetic = variance_reduction.antithetic;
+    bool moment_matched = variance_reduction.moment_matching;
+    ControlVariate control = variance_reduction.control;
+    Option control_option = blackScholesControl(option);
+    MC_METRIC_SCOPE(STAGE_PAYOFF); // the paths themselves are charged by the engine
+    MC_METRIC_COUNT(COUNTER_PATHS, antithetic ? 2 * count : count);
+
+    double group_payoff = 0.0;
+    double group_x = 0.0;
+    int in_group = 0;
+
+    for (long long done = 0, n = 0; done < count; done += n)
     {
-        ++i;
-
+        uint64_t sample = first_sample + done;
+        n = std::min((long long)GbmPathEngine::BATCH, count - done);
+        if (moment_matched)
         {
-
-            std::lock_guard<std::mutex> lock(mcs_mutex);
-            WeinerProcessSimulator wps(mcs.stock.price, mcs.stock.drift, mcs.stock.volatility, mcs.increment, true);
-            wps.runSimulation(mcs.duration, 0, false);
-            double option_profit = option.call ? std::max(wps.getPrice() - option.strike, 0.0) : std::max(option.strike - wps.getPrice(), 0.0);
-            options_profit.push_back(discount_rate * option_profit);
-
-            if (i % 10 == 0)
+            // Stop at the end of the group, like the engine
+            n = std::min(n, (long long)(GbmPathEngine::MOMENT_GROUP - sample % GbmPathEngine::MOMENT_GROUP));
+        }
+        finalPrices(used, sample, (int)n, final_prices, antithetic ? mirrored : NULL);
+        for (int p = 0; p < n; ++p)
+        {
+            double payoff = optionPayoff(option, final_prices[p]);
+            double x = controlValue(control, control_option, final_prices[p]);
+            acc.addPath(payoff);
+            if (antithetic)
             {
-                // OPTIMISABLE!!!
-                mcs_approx_price = calculateAverage(options_profit);
-                mcs_progress = (double)i / mcs.iterations;
+                double mirrored_payoff = optionPayoff(option, mirrored[p]);
+                acc.addPath(mirrored_payoff);
+                payoff = 0.5 * (payoff + mirrored_payoff);
+                x = 0.5 * (x + controlValue(control, control_option, mirrored[p]));
+            }
+            if (moment_matched)
+            {
+                group_payoff += payoff;
+                group_x += x;
+            }
+            else
+            {
+                acc.addSample(payoff, x);
             }
         }
+        in_group += moment_matched ? (int)n : 0;
+        if (moment_matched && ((sample + n) % GbmPathEngine::MOMENT_GROUP == 0 || done + n == count))
+        {
+            // Paths of a moment matched group aren't independent, whole groups are.
+            // A group cut short counts for the samples it has.
+            acc.addSample(group_payoff / in_group, group_x / in_group, in_group);
+            group_payoff = 0.0;
+            group_x = 0.0;
+            in_group = 0;
+        }
     }
-    mcs_progress = 1.0;
-    mcs_approx_price = calculateAverage(options_profit);
-    mcs_finish = true;
 }
 
-void stopMonteCarloThread()
+MonteCarloResult MonteCarloSimulation::estimateOptionParallel(Option option, int n_threads, std::atomic<int> *progress)
 {
-    if (mcs_running)
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    PricingMode used = resolveMode(option);
+
+    // One accumulator per slice, merged in slice order below
+    long long total = sampleCount();
+    std::vector<EstimatorAccumulator> per_slice((size_t)((total + SAMPLE_SLICE - 1) / SAMPLE_SLICE), makeAccumulator(option));
+    int paths_per_sample = variance_reduction.antithetic ? 2 : 1;
+    pool->parallelFor(total, SAMPLE_SLICE, [&](int, long long begin, long long end) {
+        accumulatePaths(option, used, begin, end - begin, per_slice[begin / SAMPLE_SLICE]);
+        if (progress != NULL)
+        {
+            progress->fetch_add((int)(end - begin) * paths_per_sample, std::memory_order_relaxed);
+        }
+    }, n_threads);
+
+    EstimatorAccumulator acc = makeAccumulator(option);
     {
-        mcs_stop = true;
-        if (mcs_thread.joinable())
+        MC_METRIC_SCOPE(STAGE_REDUCE);
+        for (const EstimatorAccumulator &slice : per_slice)
         {
-            mcs_thread.join();
+            acc.merge(slice);
         }
-        mcs_stop = false;
-        mcs_running = false;
     }
-}
-
-void stopMonteCarloMultiThread(){
-    if (mcs_multithread.joinable()){
-        mcs_multithread.join();
+    if (acc.paths() == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate option");
     }
+    return makeResult(acc, used);
 }
 
-double runMonteCarloSim(int start, int end, MonteCarloSimulation &mcs, Option option)
+MonteCarloResult makeResult(const RunningStats &stats, PricingMode used)
 {
-    std::vector<double> profits;
-    int length = end - start;
-    for (int i =0; i<length; ++i){
-        profits.push_back(mcs.estimateOptionSingleTrial(option));
-        mcs_multithread_progress.fetch_add(1, std::memory_order_relaxed);
-    }
-    return calculateAverage(profits);
+    MonteCarloResult result;
+    result.price = stats.mean();
+    result.std_error = stats.stdError();
+    stats.confidenceInterval(1.96, result.ci_low, result.ci_high);
+    result.mode = used;
+    result.paths = stats.count();
+    result.variance_reduction_factor = 1.0;
+    return result;
 }
 
-double runMonteCarloMultiThreading(int n_threads, MonteCarloSimulation &mcs, Option option)
+MonteCarloResult makeResult(const EstimatorAccumulator &acc, PricingMode used)
 {
-    mcs_multithread_running =true;
-    mcs_multithread_progress =0;
-    
-    std::vector<std::thread> threads;
-    std::vector<double> results(n_threads);
-    
-    int n_trials = mcs.iterations;
+    MonteCarloResult result;
+    result.price = acc.estimate();
+    result.std_error = acc.stdError();
+    result.ci_low = result.price - 1.96 * result.std_error;
+    result.ci_high = result.price + 1.96 * result.std_error;
+    result.mode = used;
+    result.paths = acc.paths();
+    result.variance_reduction_factor = acc.reductionFactor();
+    return result;
+}
 
-    //Make sure the workload between threads is even
-    while (n_trials % n_threads != 0){
-        ++n_trials;
-    }
+double MonteCarloSimulation::estimateOptionSingleTrial(Option option, uint64_t path){
+    double finalPrice;
+    finalPrices(resolveMode(option), path, 1, &finalPrice);
 
-    int trials_per_thread = n_trials / n_threads;
-    for (int i = 0; i < n_threads; ++i)
-    {
-        int start = i * trials_per_thread;
-        int end = (i+1) * trials_per_thread;
+    return optionPayoff(option, finalPrice);
 
-        threads.emplace_back([&, start, end, i]()
+}
 
-                             {  
-                                results[i] = runMonteCarloSim(start, end, std::ref(mcs), option); 
-                                }
-        );
-        
-    }
+GbmPathEngine MonteCarloSimulation::pathEngine() const
+{
+    GbmPathEngine engine(stock.price, stock.drift, stock.volatility, increment, duration, seed);
+    engine.setMomentMatching(variance_reduction.moment_matching);
+    return engine;
+}
 
-    for (auto &thread : threads)    
+double runMonteCarloSim(int start, int end, MonteCarloSimulation &mcs, Option option)
+{
+    // start and end index samples (path pairs with antithetics)
+    EstimatorAccumulator profits = mcs.makeAccumulator(option);
+    PricingMode used = mcs.resolveMode(option);
+    if (end > start)
     {
-        if (thread.joinable()){
-        thread.join();
-
-        }
+        mcs.accumulatePaths(option, used, start, end - start, profits);
+    }
+    if (profits.paths() == 0)
+    {
+        throw std::invalid_argument("Empty range, can't calculate average");
     }
-    threads.clear();
-    mcs_multithread_running =false;
-    double average_result = calculateAverage(results);
-    results.clear();
-    return average_result;
+    return profits.estimate();
+}
+
+double runMonteCarloMultiThreading(int n_threads, MonteCarloSimulation &mcs, Option option)
+{
+    // Exactly mcs.iterations trials, balanced over the shared pool
+    return mcs.estimateOptionParallel(option, n_threads).price;
 }
\ No newline at end of file
@@ -3,38 +3,27 @@
 #include <atomic>
 #include <mutex>
 #include <thread>
+#include "rng.h"
+#include "path_engine.h"
+#include "running_stats.h"
+#include "variance_reduction.h"
 #ifndef FUNCTIONS_H
 #define FUNCTIONS_H
 
 double normalCDF(double x);
+double inverseNormalCDF(double p);
 double bsOptionPrice(bool call, double s, double k, double r, double t, double sigma);
 double binomialOptionPrice(bool call, double s, double k, double r, double t, double sigma, int n, bool show_steps);
 double calculateAverage(const std::vector<double> &values);
-double impliedVolatility(double S, double K, double T, double r, double marketPrice, double tol, int maxIter);
+double impliedVolatility(bool call, double s, double k, double r, double t, double market_price);
 
 extern std::atomic<bool> sim_stop;
 extern std::atomic<bool> sim_running;
 extern std::atomic<bool> sim_paused;
 extern std::atomic<double> current_price;
 
-extern std::mutex sim_mutex;
 extern std::thread simulation_thread;
 
-extern std::atomic<bool> mcs_running;
-extern std::atomic<bool> mcs_stop;
-extern std::atomic<double> mcs_approx_price;
-extern std::atomic<double> mcs_progress;
-extern std::atomic<bool> mcs_finish;
-
-extern std::mutex mcs_mutex;
-extern std::thread mcs_thread;
-
-
-extern std::thread mcs_multithread;
-
-extern std::atomic<bool> mcs_multithread_running;
-extern std::atomic<int> mcs_multithread_progress;
-
 struct Asset
 {
     std::string name;
@@ -58,20 +47,57 @@ private:
     double mu;
     double sigma;
     double dt;
-    std::mt19937 gen;
+    RandomStream rng;
     bool keep_going;
 
     double generateNormal(double mean, double stddev);
 
 public:
-    WeinerProcessSimulator(double initialPrice, double drift, double volatility, double timeStep, bool keep_going);
+    WeinerProcessSimulator(double initialPrice, double drift, double volatility, double timeStep, bool keep_going, uint64_t seed = randomSeed(), uint64_t stream = 0);
 
+    // Restart from initialPrice on the substream of another path
+    void reset(double initialPrice, uint64_t path);
     void simulateStep(bool show);
+    // Step of length h driven by a given Brownian increment dW ~ N(0, h), for paths coupled
+    // through the same increments (multilevel Monte Carlo). dt and the stream aren't used.
+    void stepWithIncrement(double dW, double h);
     void runSimulation(int n, int delay_ms, bool show);
     double getPrice() { return price; }
 };
 
-void runSimulationThread(int ms_delay, WeinerProcessSimulator &wps, bool sim_show_steps);
+double optionPayoff(const Option &option, double final_price);
+
+// How MonteCarloSimulation gets the final price of a path
+enum PricingMode
+{
+    PRICING_AUTO,          // exact terminal when the payoff allows it, stepped otherwise
+    PRICING_STEPPED,       // walk all duration steps
+    PRICING_EXACT_TERMINAL // one lognormal draw of S_T per path
+};
+const char *pricingModeName(PricingMode mode);
+bool dependsOnTerminalOnly(const Option &option);
+
+// Samples per slice of estimateOptionParallel and PricingJob, whole path batches.
+// Each slice is accumulated alone and the slices are merged in order, so the bits
+// don't depend on the threads or on which of them took which slice.
+static const long long SAMPLE_SLICE = 4096;
+
+struct MonteCarloResult
+{
+    double price;
+    double std_error;
+    double ci_low; // 95% confidence interval
+    double ci_high;
+    PricingMode mode; // mode actually used, never PRICING_AUTO
+    long long paths;
+    double variance_reduction_factor; // crude MC variance / achieved variance, same paths
+};
+MonteCarloResult makeResult(const RunningStats &stats, PricingMode used);
+MonteCarloResult makeResult(const EstimatorAccumulator &acc, PricingMode used);
+
+class LiveBook;
+// Steps wps until sim_stop, publishing every price to current_price and, if given, as a tick to book
+void runSimulationThread(int ms_delay, WeinerProcessSimulator wps, bool sim_show_steps, LiveBook *book = NULL);
 void stopCurrentSimulation();
 
 class MonteCarloSimulation
@@ -83,16 +109,30 @@ public:
     Asset stock;
     double increment;
     bool show;
+    uint64_t seed; // path i always uses substream i of this seed
+    PricingMode mode;
+    VarianceReduction variance_reduction; // all off by default
     double estimateOption(Option option);
-    double estimateOptionSingleTrial(Option option);
-    MonteCarloSimulation(int iter, int durat, double dt, Asset stock, bool show);
+    MonteCarloResult estimateOptionResult(Option option);
+    MonteCarloResult estimateOptionToPrecision(Option option, double target_std_error, double max_seconds);
+    // Spread over the shared work stealing pool, progress counts finished paths
+    MonteCarloResult estimateOptionParallel(Option option, int n_threads, std::atomic<int> *progress = NULL);
+    // Add samples [first_sample, first_sample + count) to acc. A sample is one path,
+    // or a path and its mirror with antithetics.
+    void accumulatePaths(const Option &option, PricingMode used, uint64_t first_sample, long long count, EstimatorAccumulator &acc) const;
+    EstimatorAccumulator makeAccumulator(const Option &option) const;
+    double controlMean(const Option &option) const;
+    // The vanilla used as the CV_BLACK_SCHOLES control when pricing option
+    Option blackScholesControl(const Option &option) const;
+    long long sampleCount() const;
+    double estimateOptionSingleTrial(Option option, uint64_t path);
+    GbmPathEngine pathEngine() const;
+    PricingMode resolveMode(const Option &option) const;
+    void finalPrices(PricingMode used, uint64_t first_path, int count, double *out, double *antithetic = NULL) const;
+    MonteCarloSimulation(int iter, int durat, double dt, Asset stock, bool show, uint64_t seed = randomSeed());
 };
 
-void runMonteCarloThread(MonteCarloSimulation &mcs, Option &option);
-void stopMonteCarloThread();
-
-
-void stopMonteCarloMultiThread();
+// Background pricing goes through PricingExecutor (pricing_job.h)
 double runMonteCarloSim(int start, int end, MonteCarloSimulation &mcs, Option option);
 double runMonteCarloMultiThreading(int n_threads, MonteCarloSimulation &mcs, Option option);
 
@@ -0,0 +1,248 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "greeks.h"
+#include "thread_pool.h"
+
+// Bumps of the checking mode: spot and time relative, vol and rate absolute
+static const double SPOT_BUMP = 0.01;
+static const double VOL_BUMP = 1e-3;
+static const double RATE_BUMP = 1e-4;
+static const double TIME_BUMP = 1e-3;
+
+static const int N_VALUES = 6; // price, delta, gamma, vega, theta, rho
+
+Greeks bsGreeks(bool call, double s, double k, double r, double t, double sigma)
+{
+    double sqrt_t = sqrt(t);
+    double d1 = (log(s / k) + (r + 0.5 * sigma * sigma) * t) / (sigma * sqrt_t);
+    double d2 = d1 - sigma * sqrt_t;
+    double density = exp(-0.5 * d1 * d1) / sqrt(2.0 * M_PI);
+    double strike_pv = k * exp(-r * t);
+
+    Greeks g;
+    g.gamma = density / (s * sigma * sqrt_t);
+    g.vega = s * density * sqrt_t;
+    double decay = -s * density * sigma / (2.0 * sqrt_t);
+    if (call)
+    {
+        g.price = normalCDF(d1) * s - normalCDF(d2) * strike_pv;
+        g.delta = normalCDF(d1);
+        g.theta = decay - r * strike_pv * normalCDF(d2);
+        g.rho = t * strike_pv * normalCDF(d2);
+    }
+    else
+    {
+        g.price = normalCDF(-d2) * strike_pv - normalCDF(-d1) * s;
+        g.delta = normalCDF(d1) - 1.0;
+        g.theta = decay + r * strike_pv * normalCDF(-d2);
+        g.rho = -t * strike_pv * normalCDF(-d2);
+    }
+    return g;
+}
+
+const char *greeksMethodName(GreeksMethod method)
+{
+    switch (method)
+    {
+    case GREEKS_PATHWISE:
+        return "pathwise";
+    case GREEKS_LIKELIHOOD_RATIO:
+        return "likelihood ratio";
+    case GREEKS_BUMP:
+        return "bump and revalue";
+    }
+    return "unknown";
+}
+
+namespace
+{
+// What every path needs to turn its S_T into the six estimates
+struct GreeksModel
+{
+    Option option;
+    GreeksMethod method;
+    double s0;
+    double mu;
+    double sigma;
+    double horizon;
+    double sqrt_h;
+    double disc;
+
+    // Discounted payoff with the normal z, for bumped parameters
+    double value(double s0_, double mu_, double sigma_, double horizon_, double z) const
+    {
+        double s_t = s0_ * exp((mu_ - 0.5 * sigma_ * sigma_) * horizon_ + sigma_ * sqrt(horizon_) * z);
+        return exp(-mu_ * horizon_) * optionPayoff(option, s_t);
+    }
+
+    void sample(double s_t, double out[N_VALUES]) const
+    {
+        // The normal that produced this path, stepped paths included (their log increments add up)
+        double z = (log(s_t / s0) - (mu - 0.5 * sigma * sigma) * horizon) / (sigma * sqrt_h);
+        double payoff = optionPayoff(option, s_t);
+        out[0] = disc * payoff;
+
+        if (method == GREEKS_PATHWISE)
+        {
+            // d payoff / d S_T, times S_T: every sensitivity of S_T is S_T times something
+            double slope = option.call ? (s_t > option.strike ? 1.0 : 0.0) : (s_t < option.strike ? -1.0 : 0.0);
+            double ds = slope * s_t;
+            out[1] = ds / s0;
+            // The payoff has no second derivative, gamma differentiates the density once more instead
+            out[2] = ds * (z / (sigma * sqrt_h) - 1.0) / (s0 * s0);
+            out[3] = ds * (sqrt_h * z - sigma * horizon);
+            out[4] = mu * payoff - ds * (mu - 0.5 * sigma * sigma + 0.5 * sigma * z / sqrt_h);
+            out[5] = horizon * (ds - payoff);
+        }
+        else if (method == GREEKS_LIKELIHOOD_RATIO)
+        {
+            double vol_sqrt_h = sigma * sqrt_h;
+            out[1] = payoff * z / (s0 * vol_sqrt_h);
+            out[2] = payoff * (z * z - 1.0 - z * vol_sqrt_h) / (s0 * s0 * vol_sqrt_h * vol_sqrt_h);
+            out[3] = payoff * ((z * z - 1.0) / sigma - z * sqrt_h);
+            out[4] = mu * payoff - payoff * ((mu - 0.5 * sigma * sigma) * z / vol_sqrt_h + (z * z - 1.0) / (2.0 * horizon));
+            out[5] = payoff * (z * sqrt_h / sigma - horizon);
+        }
+        else
+        {
+            double ds = SPOT_BUMP * s0;
+            double up = value(s0 + ds, mu, sigma, horizon, z);
+            double down = value(s0 - ds, mu, sigma, horizon, z);
+            out[1] = (up - down) / (2.0 * ds);
+            out[2] = (up - 2.0 * out[0] + down) / (ds * ds);
+            out[3] = (value(s0, mu, sigma + VOL_BUMP, horizon, z) - value(s0, mu, sigma - VOL_BUMP, horizon, z)) / (2.0 * VOL_BUMP);
+            double dt = TIME_BUMP * horizon;
+            out[4] = -(value(s0, mu, sigma, horizon + dt, z) - value(s0, mu, sigma, horizon - dt, z)) / (2.0 * dt);
+            out[5] = (value(s0, mu + RATE_BUMP, sigma, horizon, z) - value(s0, mu - RATE_BUMP, sigma, horizon, z)) / (2.0 * RATE_BUMP);
+            return;
+        }
+        for (int v = 1; v < N_VALUES; ++v)
+        {
+            out[v] *= disc;
+        }
+    }
+};
+
+struct GreeksStats
+{
+    char front[64];
+    RunningStats stats[N_VALUES];
+    char back[64];
+};
+}
+
+static void accumulateGreeks(const MonteCarloSimulation &mcs, const GreeksModel &model, PricingMode used, uint64_t first_sample, long long count, RunningStats *stats)
+{
+    double final_prices[GbmPathEngine::BATCH];
+    double mirrored[GbmPathEngine::BATCH];
+    bool antithetic = mcs.variance_reduction.antithetic;
+    bool moment_matched = mcs.variance_reduction.moment_matching;
+    double values[N_VALUES];
+    double mirrored_values[N_VALUES];
+    double group[N_VALUES] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    int in_group = 0;
+
+    for (long long done = 0, n = 0; done < count; done += n)
+    {
+        uint64_t sample = first_sample + done;
+        n = std::min((long long)GbmPathEngine::BATCH, count - done);
+        if (moment_matched)
+        {
+            n = std::min(n, (long long)(GbmPathEngine::MOMENT_GROUP - sample % GbmPathEngine::MOMENT_GROUP));
+        }
+        mcs.finalPrices(used, sample, (int)n, final_prices, antithetic ? mirrored : NULL);
+        for (int p = 0; p < n; ++p)
+        {
+            model.sample(final_prices[p], values);
+            if (antithetic)
+            {
+                model.sample(mirrored[p], mirrored_values);
+                for (int v = 0; v < N_VALUES; ++v)
+                {
+                    values[v] = 0.5 * (values[v] + mirrored_values[v]);
+                }
+            }
+            for (int v = 0; v < N_VALUES; ++v)
+            {
+                if (moment_matched)
+                {
+                    group[v] += values[v];
+                }
+                else
+                {
+                    stats[v].add(values[v]);
+                }
+            }
+        }
+        in_group += moment_matched ? (int)n : 0;
+        if (moment_matched && ((sample + n) % GbmPathEngine::MOMENT_GROUP == 0 || done + n == count))
+        {
+            // Same as for the price: only whole groups are independent
+            for (int v = 0; v < N_VALUES; ++v)
+            {
+                stats[v].add(group[v] / in_group, in_group);
+                group[v] = 0.0;
+            }
+            in_group = 0;
+        }
+    }
+}
+
+static Greeks greeksFrom(const RunningStats *stats, bool std_error)
+{
+    double x[N_VALUES];
+    for (int v = 0; v < N_VALUES; ++v)
+    {
+        x[v] = std_error ? stats[v].stdError() : stats[v].mean();
+    }
+    Greeks g = {x[0], x[1], x[2], x[3], x[4], x[5]};
+    return g;
+}
+
+MonteCarloGreeks estimateGreeksMonteCarlo(const MonteCarloSimulation &mcs, const Option &option, GreeksMethod method, int n_threads)
+{
+    GreeksModel model;
+    model.option = option;
+    model.method = method;
+    model.s0 = mcs.stock.price;
+    model.mu = mcs.stock.drift;
+    model.sigma = mcs.stock.volatility;
+    model.horizon = mcs.duration * mcs.increment;
+    model.sqrt_h = sqrt(model.horizon);
+    model.disc = exp(-model.mu * model.horizon);
+    if (!(model.s0 > 0.0 && model.sigma > 0.0 && model.horizon > 0.0))
+    {
+        throw std::invalid_argument("Greeks need a positive spot, volatility and horizon");
+    }
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    PricingMode used = mcs.resolveMode(option);
+    // Same slices as estimateOptionParallel, merged in order
+    long long total = mcs.sampleCount();
+    std::vector<GreeksStats> per_slice((size_t)((total + SAMPLE_SLICE - 1) / SAMPLE_SLICE));
+    pool->parallelFor(total, SAMPLE_SLICE, [&](int, long long begin, long long end) {
+        accumulateGreeks(mcs, model, used, begin, end - begin, per_slice[begin / SAMPLE_SLICE].stats);
+    }, n_threads);
+
+    RunningStats stats[N_VALUES];
+    for (const GreeksStats &slice : per_slice)
+    {
+        for (int v = 0; v < N_VALUES; ++v)
+        {
+            stats[v].merge(slice.stats[v]);
+        }
+    }
+    if (stats[0].count() == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate Greeks");
+    }
+
+    MonteCarloGreeks result;
+    result.value = greeksFrom(stats, false);
+    result.std_error = greeksFrom(stats, true);
+    result.method = method;
+    result.mode = used;
+    result.paths = total * (mcs.variance_reduction.antithetic ? 2 : 1);
+    return result;
+}
@@ -0,0 +1,45 @@
+#include "functions.h"
+#ifndef GREEKS_H
+#define GREEKS_H
+
+/*
+Option sensitivities. Vega and rho are per unit of vol / rate (not per 1%),
+theta is -dV/dt per year.
+*/
+struct Greeks
+{
+    double price;
+    double delta;
+    double gamma;
+    double vega;
+    double theta;
+    double rho;
+};
+
+// Closed form, same inputs as bsOptionPrice
+Greeks bsGreeks(bool call, double s, double k, double r, double t, double sigma);
+
+enum GreeksMethod
+{
+    GREEKS_PATHWISE,         // differentiate the payoff along each path (gamma: pathwise x likelihood ratio)
+    GREEKS_LIKELIHOOD_RATIO, // weight the payoff by the score of the lognormal density
+    GREEKS_BUMP              // central differences, each path revalued with its own normal (common random numbers)
+};
+const char *greeksMethodName(GreeksMethod method);
+
+struct MonteCarloGreeks
+{
+    Greeks value;
+    Greeks std_error;
+    GreeksMethod method;
+    PricingMode mode; // mode actually used, never PRICING_AUTO
+    long long paths;
+};
+
+// Price and all Greeks from one pass over the paths of mcs.
+// The drift is taken as the rate: everything is for exp(-drift T) E[payoff] with
+// T = duration * increment, i.e. what bsGreeks gives with r = drift.
+// Antithetics and moment matching are honored, control variates aren't used.
+MonteCarloGreeks estimateGreeksMonteCarlo(const MonteCarloSimulation &mcs, const Option &option, GreeksMethod method, int n_threads);
+
+#endif //
@@ -0,0 +1,235 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <stdexcept>
+#include "implied_vol.h"
+#include "thread_pool.h"
+
+static const int TILE = 256;                   // quotes solved together
+static const long long PARALLEL_CHUNK = 16384; // quotes per pool task
+static const int MAX_ITERATIONS = 40;
+static const double VOL_MAX = 20.0;
+static const double VOL_TOL = 1e-12;   // relative size of the last step
+static const double HALLEY_TOL = 1e-6; // same, when that step was a Halley step
+static const double SQRT_2PI = 2.50662827463100050242;
+
+const char *impliedVolStatusName(ImpliedVolStatus status)
+{
+    switch (status)
+    {
+    case IV_OK:
+        return "ok";
+    case IV_BELOW_INTRINSIC:
+        return "below intrinsic";
+    case IV_ABOVE_MAXIMUM:
+        return "above maximum";
+    case IV_NO_CONVERGENCE:
+        return "no convergence";
+    case IV_BAD_INPUT:
+        return "bad input";
+    }
+    return "unknown";
+}
+
+// Corrado-Miller approximation of sigma, from the call price c (discounted strike x)
+static double corradoMillerGuess(double c, double s, double x, double sqrt_t)
+{
+    double half_gap = c - 0.5 * (s - x);
+    double root = half_gap * half_gap - (s - x) * (s - x) / M_PI;
+    double sigma = SQRT_2PI / (s + x) * (half_gap + sqrt(std::max(root, 0.0))) / sqrt_t;
+    return (sigma > 1e-3 && sigma < VOL_MAX) ? sigma : 0.2;
+}
+
+static void solveTile(SimdLevel level, int n, const double *s, const double *k, const double *r, const double *t, const unsigned char *call, const double *market_price, double *vol, ImpliedVolStatus *status)
+{
+    // Out of the money side of every quote
+    unsigned char otm_call[TILE];
+    double target[TILE];
+    double log_moneyness[TILE];
+    double sqrt_t[TILE];
+    double disc[TILE];
+    double trial[TILE];
+    double lo[TILE];
+    double hi[TILE];
+    int active[TILE];
+    int n_active = 0;
+
+    bsExpiryTerms(n, r, t, sqrt_t, disc);
+    for (int i = 0; i < n; ++i)
+    {
+        vol[i] = NAN;
+        if (!(s[i] > 0.0 && k[i] > 0.0 && t[i] > 0.0 && std::isfinite(r[i]) && std::isfinite(market_price[i])))
+        {
+            status[i] = IV_BAD_INPUT;
+            continue;
+        }
+        double strike_pv = k[i] * disc[i];
+        otm_call[i] = (strike_pv >= s[i]) ? 1 : 0;
+        double price = market_price[i];
+        // Below this the price can't be told from 0: denormals, or what's left
+        // of an ITM quote after parity when that is pure rounding
+        double noise = DBL_MIN;
+        if (call[i] && !otm_call[i])
+        {
+            price -= s[i] - strike_pv; // ITM call -> OTM put
+            noise = 4.0 * DBL_EPSILON * market_price[i];
+        }
+        else if (!call[i] && otm_call[i])
+        {
+            price -= strike_pv - s[i]; // ITM put -> OTM call
+            noise = 4.0 * DBL_EPSILON * market_price[i];
+        }
+
+        if (price <= noise)
+        {
+            status[i] = IV_BELOW_INTRINSIC;
+            continue;
+        }
+        if (price >= (otm_call[i] ? s[i] : strike_pv))
+        {
+            status[i] = IV_ABOVE_MAXIMUM;
+            continue;
+        }
+        target[i] = price;
+        log_moneyness[i] = log(s[i] / k[i]);
+        lo[i] = 0.0;
+        hi[i] = VOL_MAX;
+        double call_price = otm_call[i] ? price : price + s[i] - strike_pv;
+        trial[i] = corradoMillerGuess(call_price, s[i], strike_pv, sqrt_t[i]);
+        status[i] = IV_NO_CONVERGENCE;
+        active[n_active++] = i;
+    }
+
+    // Quotes still being solved, gathered so the pricing call stays dense
+    double g_s[TILE];
+    double g_k[TILE];
+    double g_r[TILE];
+    double g_t[TILE];
+    double g_sigma[TILE];
+    double g_sqrt_t[TILE];
+    double g_disc[TILE];
+    unsigned char g_call[TILE];
+    double g_price[TILE];
+    double g_vega[TILE];
+
+    for (int iteration = 0; iteration < MAX_ITERATIONS && n_active > 0; ++iteration)
+    {
+        for (int m = 0; m < n_active; ++m)
+        {
+            int i = active[m];
+            g_s[m] = s[i];
+            g_k[m] = k[i];
+            g_r[m] = r[i];
+            g_t[m] = t[i];
+            g_sigma[m] = trial[i];
+            g_sqrt_t[m] = sqrt_t[i];
+            g_disc[m] = disc[i];
+            g_call[m] = otm_call[i];
+        }
+        bsPriceBatchTerms(level, n_active, g_s, g_k, g_r, g_t, g_sigma, g_call, g_sqrt_t, g_disc, g_price, g_vega);
+
+        int still_active = 0;
+        for (int m = 0; m < n_active; ++m)
+        {
+            int i = active[m];
+            double sigma = g_sigma[m];
+            double model = g_price[m];
+            double vega = g_vega[m];
+            if (model < target[i])
+            {
+                lo[i] = sigma;
+            }
+            else
+            {
+                hi[i] = sigma;
+            }
+
+            double next = NAN;
+            double tolerance = VOL_TOL;
+            if (model > 0.0 && vega > 0.0)
+            {
+                double vol_sqrt_t = sigma * sqrt_t[i];
+                double d1 = (log_moneyness[i] + (r[i] + 0.5 * sigma * sigma) * t[i]) / vol_sqrt_t;
+                double d2 = d1 - vol_sqrt_t;
+                double volga = vega * d1 * d2 / sigma;
+                double ratio = model / target[i];
+                double g, g1, g2;
+                if (ratio > 0.9 && ratio < 1.1)
+                {
+                    // Close enough: Halley on the price itself
+                    g = model - target[i];
+                    g1 = vega;
+                    g2 = volga;
+                }
+                else
+                {
+                    // Far away: Halley on log(model / target), much straighter than the price for OTM quotes
+                    g = log(ratio);
+                    g1 = vega / model;
+                    g2 = volga / model - g1 * g1;
+                }
+                double newton = -g / g1;
+                double halley = 1.0 + 0.5 * newton * g2 / g1;
+                if (halley > 0.5)
+                {
+                    // Cubic convergence: a step this small leaves an error around its cube, no need to check it
+                    next = sigma + newton / halley;
+                    tolerance = HALLEY_TOL;
+                }
+                else
+                {
+                    next = sigma + newton;
+                }
+            }
+            // Out of the bracket (or no usable slope): bisect. A bracket end is fine, the step is then 0.
+            if (!(next > 0.0 && next >= lo[i] && next <= hi[i]))
+            {
+                next = 0.5 * (lo[i] + hi[i]);
+                tolerance = VOL_TOL;
+            }
+
+            if (fabs(next - sigma) <= tolerance * next)
+            {
+                vol[i] = next;
+                status[i] = IV_OK;
+            }
+            else
+            {
+                trial[i] = next;
+                active[still_active++] = i;
+            }
+        }
+        n_active = still_active;
+    }
+}
+
+void impliedVolBatch(SimdLevel level, size_t n, const double *s, const double *k, const double *r, const double *t, const unsigned char *call, const double *market_price, double *vol, ImpliedVolStatus *status)
+{
+    for (size_t first = 0; first < n; first += TILE)
+    {
+        int m = (int)std::min((size_t)TILE, n - first);
+        solveTile(level, m, s + first, k + first, r + first, t + first, call + first, market_price + first, vol + first, status + first);
+    }
+}
+
+void impliedVolBatch(OptionBatch &quotes, const std::vector<double> &market_price, std::vector<ImpliedVolStatus> &status, int n_threads)
+{
+    size_t n = quotes.size();
+    if (market_price.size() != n)
+    {
+        throw std::invalid_argument("One market price per quote needed");
+    }
+    quotes.vol.resize(n);
+    status.resize(n);
+    SimdLevel level = detectSimdLevel();
+    if (n_threads <= 1 || (long long)n < 2 * PARALLEL_CHUNK)
+    {
+        impliedVolBatch(level, n, quotes.spot.data(), quotes.strike.data(), quotes.rate.data(), quotes.time.data(), quotes.call.data(), market_price.data(), quotes.vol.data(), status.data());
+        return;
+    }
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    pool->parallelFor((long long)n, PARALLEL_CHUNK, [&](int, long long begin, long long end) {
+        impliedVolBatch(level, (size_t)(end - begin), &quotes.spot[begin], &quotes.strike[begin], &quotes.rate[begin], &quotes.time[begin], &quotes.call[begin], &market_price[begin], &quotes.vol[begin], &status[begin]);
+    }, n_threads);
+}
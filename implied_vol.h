@@ -0,0 +1,34 @@
+#include <cstddef>
+#include <vector>
+#include "simd.h"
+#include "bs_batch.h"
+#ifndef IMPLIED_VOL_H
+#define IMPLIED_VOL_H
+
+/*
+Implied volatility for whole batches of quotes, calls and puts.
+Every quote is first turned into its out of the money side through put-call
+parity, then solved with Halley steps on log(price) from a Corrado-Miller guess,
+inside a bracket that falls back to bisection. Each iteration prices all quotes
+still unsolved with one bsPriceBatch call, so the work is vectorized across quotes.
+Typical quotes converge in 2 to 4 iterations.
+*/
+
+enum ImpliedVolStatus
+{
+    IV_OK,
+    IV_BELOW_INTRINSIC, // price at or under the intrinsic value (to rounding), no volatility reproduces it
+    IV_ABOVE_MAXIMUM,   // price at or over the spot (call) or discounted strike (put)
+    IV_NO_CONVERGENCE,
+    IV_BAD_INPUT        // non positive spot, strike or time, or a price that isn't a number
+};
+
+const char *impliedVolStatusName(ImpliedVolStatus status);
+
+// vol[i], status[i] for i in [0, n). vol is NaN when status isn't IV_OK.
+void impliedVolBatch(SimdLevel level, size_t n, const double *s, const double *k, const double *r, const double *t, const unsigned char *call, const double *market_price, double *vol, ImpliedVolStatus *status);
+
+// Fills quotes.vol from market_price, split over the shared thread pool when large
+void impliedVolBatch(OptionBatch &quotes, const std::vector<double> &market_price, std::vector<ImpliedVolStatus> &status, int n_threads = 1);
+
+#endif //
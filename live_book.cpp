@@ -0,0 +1,203 @@
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include "live_book.h"
+
+static long long steadyNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LiveBook::LiveBook(double reprice_threshold, size_t ring_capacity) : threshold(reprice_threshold), ring(ring_capacity), dropped(0), stopping(false), ticks(0), revaluations(0), full_reprices(0), latency_sum_us(0.0), max_latency_us(0.0)
+{
+    if (!(reprice_threshold >= 0.0))
+    {
+        throw std::invalid_argument("Reprice threshold must be non negative");
+    }
+}
+
+LiveBook::~LiveBook()
+{
+    stop();
+}
+
+int LiveBook::addPosition(const Option &option, double quantity)
+{
+    if (running())
+    {
+        throw std::runtime_error("Can't change the book while it is running");
+    }
+    if (!(option.strike > 0.0) || !(option.t > 0.0) || !(option.stock.volatility > 0.0))
+    {
+        throw std::invalid_argument("Book positions need a positive strike, expiry and volatility");
+    }
+    Entry entry;
+    entry.position.option = option;
+    entry.position.quantity = quantity;
+    entry.reference_spot = 0.0; // not valued yet
+    entries.push_back(entry);
+    return (int)entries.size() - 1;
+}
+
+void LiveBook::clearPositions()
+{
+    if (running())
+    {
+        throw std::runtime_error("Can't change the book while it is running");
+    }
+    entries.clear();
+}
+
+void LiveBook::start()
+{
+    if (running())
+    {
+        return;
+    }
+    for (Entry &entry : entries)
+    {
+        entry.reference_spot = 0.0;
+    }
+    ticks = 0;
+    revaluations = 0;
+    full_reprices = 0;
+    latency_sum_us = 0.0;
+    max_latency_us = 0.0;
+    stopping = false;
+    consumer = std::thread(&LiveBook::consumerLoop, this);
+}
+
+void LiveBook::stop()
+{
+    if (!running())
+    {
+        return;
+    }
+    stopping = true;
+    consumer.join();
+}
+
+bool LiveBook::pushTick(double spot)
+{
+    Tick tick = {spot, steadyNanos()};
+    if (!ring.push(tick))
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void LiveBook::revalue(double spot)
+{
+    for (Entry &entry : entries)
+    {
+        const Option &option = entry.position.option;
+        double ds = spot - entry.reference_spot;
+        if (entry.reference_spot <= 0.0 || fabs(ds) > threshold * entry.reference_spot)
+        {
+            entry.reference = bsGreeks(option.call, spot, option.strike, option.stock.interest_rate, option.t, option.stock.volatility);
+            entry.reference_spot = spot;
+            entry.current = entry.reference;
+            ++full_reprices;
+            continue;
+        }
+        // Second order in spot around the reference, the other sensitivities held
+        const Greeks &ref = entry.reference;
+        entry.current = ref;
+        entry.current.price = ref.price + ref.delta * ds + 0.5 * ref.gamma * ds * ds;
+        entry.current.delta = ref.delta + ref.gamma * ds;
+    }
+}
+
+size_t LiveBook::drain()
+{
+    Tick tick;
+    double spot = 0.0;
+    long long pushed_sum = 0;
+    long long oldest = 0;
+    long long newest = 0;
+    size_t n = 0;
+    // At most one ring's worth, so a producer faster than us can't keep us from publishing
+    while (n < ring.capacity() && ring.pop(tick))
+    {
+        if (n == 0)
+        {
+            oldest = tick.pushed_ns;
+        }
+        spot = tick.spot;
+        newest = tick.pushed_ns;
+        pushed_sum += tick.pushed_ns - oldest; // relative, no overflow
+        ++n;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    revalue(spot);
+    ++revaluations;
+    ticks += (long long)n;
+
+    BookSnapshot &out = published.writeBuffer();
+    out.spot = spot;
+    out.positions.resize(entries.size());
+    Greeks total = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const Greeks &g = entries[i].current;
+        double q = entries[i].position.quantity;
+        out.positions[i] = g;
+        total.price += q * g.price;
+        total.delta += q * g.delta;
+        total.gamma += q * g.gamma;
+        total.vega += q * g.vega;
+        total.theta += q * g.theta;
+        total.rho += q * g.rho;
+    }
+    out.total = total;
+
+    // Every drained tick waited until now
+    long long now = steadyNanos();
+    double oldest_us = 1e-3 * (now - oldest);
+    latency_sum_us += 1e-3 * ((double)(now - oldest) * n - (double)pushed_sum);
+    max_latency_us = std::max(max_latency_us, oldest_us);
+    out.ticks = ticks;
+    out.revaluations = revaluations;
+    out.full_reprices = full_reprices;
+    out.last_latency_us = 1e-3 * (now - newest);
+    out.mean_latency_us = latency_sum_us / ticks;
+    out.max_latency_us = max_latency_us;
+    published.publish();
+    return n;
+}
+
+void LiveBook::consumerLoop()
+{
+    int idle = 0;
+    while (!stopping.load(std::memory_order_relaxed))
+    {
+        if (drain() > 0)
+        {
+            idle = 0;
+        }
+        else if (++idle < 1000)
+        {
+            // Spin a little for the next tick, then back off
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+    drain();
+}
+
+BookSnapshot LiveBook::snapshot()
+{
+    BookSnapshot snap = published.read();
+    snap.dropped = dropped.load(std::memory_order_relaxed);
+    return snap;
+}
@@ -0,0 +1,187 @@
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstddef>
+#include "functions.h"
+#include "greeks.h"
+#ifndef LIVE_BOOK_H
+#define LIVE_BOOK_H
+
+/*
+Live repricing of a book of options from a stream of spot ticks.
+The price process pushes ticks into a lock free single producer / single consumer
+ring. The repricer thread drains it and, since the book only depends on the last
+spot, revalues once per drain (ticks that arrived together are conflated).
+Each position moves by delta-gamma from the spot of its last full Black-Scholes
+revaluation, and is fully revalued once spot is more than a threshold away from it.
+Results go to a triple buffer: the UI reads the latest snapshot without ever
+waiting for the repricer, and the repricer never waits for the UI.
+*/
+
+// Bounded ring, one pushing thread and one popping thread. Capacity is rounded up to a power of two.
+template <class T>
+class SpscRing
+{
+private:
+    std::vector<T> slots;
+    size_t mask;
+    char pad0[64];
+    std::atomic<size_t> head; // next slot to pop, written by the consumer
+    char pad1[64];
+    std::atomic<size_t> tail; // next slot to push, written by the producer
+    char pad2[64];
+
+public:
+    explicit SpscRing(size_t capacity) : head(0), tail(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    size_t capacity() const { return slots.size(); }
+
+    // Producer only, false when full
+    bool push(const T &item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size())
+        {
+            return false;
+        }
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only, false when empty
+    bool pop(T &item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// One writer, one reader, neither ever blocks. The reader sees the last published value.
+template <class T>
+class TripleBuffer
+{
+private:
+    static const int FRESH = 4; // set on middle when it holds a value the reader hasn't taken
+    T slots[3];
+    int back;                // writer's slot
+    char pad[64];
+    std::atomic<int> middle; // slot index, | FRESH
+    char pad1[64];
+    int front;               // reader's slot
+
+public:
+    TripleBuffer() : slots(), back(0), middle(1), front(2) {}
+
+    // Writer: fill this, then publish()
+    T &writeBuffer() { return slots[back]; }
+    void publish() { back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3; }
+
+    // Reader: the latest published value, stays valid until the next read()
+    const T &read()
+    {
+        if (middle.load(std::memory_order_relaxed) & FRESH)
+        {
+            front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        }
+        return slots[front];
+    }
+};
+
+struct Tick
+{
+    double spot;
+    long long pushed_ns; // steady clock when pushed, for the latency figures
+};
+
+struct BookPosition
+{
+    Option option; // strike, call and t; stock.volatility and stock.interest_rate price it
+    double quantity;
+};
+
+struct BookSnapshot
+{
+    long long ticks;         // consumed so far
+    long long revaluations;  // drains that moved the book, the other ticks were conflated
+    long long full_reprices; // positions revalued in closed form instead of delta-gamma
+    long long dropped;       // ticks refused because the ring was full
+    double spot;
+    std::vector<Greeks> positions; // per unit of each position
+    Greeks total;                  // sum of quantity * per unit
+    // Tick push to snapshot publish, in microseconds
+    double last_latency_us;
+    double mean_latency_us;
+    double max_latency_us;
+};
+
+class LiveBook
+{
+private:
+    struct Entry
+    {
+        BookPosition position;
+        Greeks reference; // full revaluation at reference_spot
+        double reference_spot;
+        Greeks current;
+    };
+
+    std::vector<Entry> entries;
+    double threshold;
+    SpscRing<Tick> ring;
+    TripleBuffer<BookSnapshot> published;
+    std::atomic<long long> dropped;
+    std::atomic<bool> stopping;
+    std::thread consumer;
+
+    // Repricer side
+    long long ticks;
+    long long revaluations;
+    long long full_reprices;
+    double latency_sum_us;
+    double max_latency_us;
+
+    void revalue(double spot);
+    void consumerLoop();
+
+public:
+    // reprice_threshold: relative spot move from the last full revaluation that triggers another one
+    explicit LiveBook(double reprice_threshold = 0.005, size_t ring_capacity = 1 << 16);
+    ~LiveBook();
+
+    // Only while stopped. Returns the index of the position in snapshots.
+    int addPosition(const Option &option, double quantity);
+    void clearPositions();
+
+    // Starts the repricer thread, positions are fully valued on the first tick
+    void start();
+    // Drains what's left, then joins
+    void stop();
+    bool running() const { return consumer.joinable(); }
+
+    // From the one producer thread. false if the ring is full and the tick was dropped.
+    bool pushTick(double spot);
+    // Consumer step: takes every pending tick, revalues and publishes. Returns the number of ticks.
+    // Called by the repricer thread, or directly when the book isn't started.
+    size_t drain();
+
+    // From one reader thread at a time (the UI), never blocks
+    BookSnapshot snapshot();
+};
+
+#endif //
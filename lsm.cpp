@@ -0,0 +1,455 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "lsm.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+static const int MAX_TERMS = 8;
+static const long long TRAINING_CHUNK = 16384;
+// Pricing paths use substreams far away from the training ones
+static const uint64_t PRICING_STREAMS = 1ULL << 40;
+
+LsmSettings defaultLsmSettings()
+{
+    LsmSettings settings;
+    settings.basis = LSM_LAGUERRE;
+    settings.degree = 3;
+    settings.training_paths = 0;
+    return settings;
+}
+
+static void basisValues(LsmBasis basis, int terms, double x, double *out)
+{
+    out[0] = 1.0;
+    if (terms == 1)
+    {
+        return;
+    }
+    switch (basis)
+    {
+    case LSM_MONOMIAL:
+        out[1] = x;
+        for (int i = 2; i < terms; ++i)
+        {
+            out[i] = out[i - 1] * x;
+        }
+        break;
+    case LSM_LAGUERRE:
+        // (i + 1) L_{i+1} = (2i + 1 - x) L_i - i L_{i-1}, all weighted by exp(-x/2)
+        out[1] = 1.0 - x;
+        for (int i = 1; i + 1 < terms; ++i)
+        {
+            out[i + 1] = ((2 * i + 1 - x) * out[i] - i * out[i - 1]) / (i + 1);
+        }
+        {
+            double weight = exp(-0.5 * x);
+            for (int i = 0; i < terms; ++i)
+            {
+                out[i] *= weight;
+            }
+        }
+        break;
+    case LSM_HERMITE:
+        // He_{i+1} = x He_i - i He_{i-1}
+        out[1] = x;
+        for (int i = 1; i + 1 < terms; ++i)
+        {
+            out[i + 1] = x * out[i] - i * out[i - 1];
+        }
+        break;
+    }
+}
+
+// Solves a x = b (n x n, row major) by Gaussian elimination with partial pivoting,
+// after scaling the diagonal to 1, so the pivot test is relative. False when a is
+// too ill conditioned for the normal equations (condition number around 1e10).
+static bool solveNormalEquations(int n, double *a, double *b, double *x)
+{
+    double scale[MAX_TERMS];
+    for (int i = 0; i < n; ++i)
+    {
+        scale[i] = a[i * n + i] > 0.0 ? 1.0 / sqrt(a[i * n + i]) : 1.0;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            a[i * n + j] *= scale[i] * scale[j];
+        }
+        b[i] *= scale[i];
+    }
+    for (int col = 0; col < n; ++col)
+    {
+        int pivot = col;
+        for (int row = col + 1; row < n; ++row)
+        {
+            if (fabs(a[row * n + col]) > fabs(a[pivot * n + col]))
+            {
+                pivot = row;
+            }
+        }
+        if (fabs(a[pivot * n + col]) < 1e-10)
+        {
+            return false;
+        }
+        if (pivot != col)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                std::swap(a[col * n + j], a[pivot * n + j]);
+            }
+            std::swap(b[col], b[pivot]);
+        }
+        for (int row = col + 1; row < n; ++row)
+        {
+            double factor = a[row * n + col] / a[col * n + col];
+            for (int j = col; j < n; ++j)
+            {
+                a[row * n + j] -= factor * a[col * n + j];
+            }
+            b[row] -= factor * b[col];
+        }
+    }
+    for (int row = n - 1; row >= 0; --row)
+    {
+        double sum = b[row];
+        for (int j = row + 1; j < n; ++j)
+        {
+            sum -= a[row * n + j] * x[j];
+        }
+        x[row] = sum / a[row * n + row];
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] *= scale[i];
+    }
+    return true;
+}
+
+namespace
+{
+// Exercise rule found by the backward pass: at step j exercise when the payoff
+// beats the regressed continuation value. The basis is taken on the moneyness
+// S / strike standardized over the in the money paths of the step: high powers of
+// the raw moneyness, all close to 1, make the normal equations singular.
+struct ExerciseRule
+{
+    LsmBasis basis;
+    int terms;
+    double strike;
+    std::vector<double> coefficients; // terms per step, zero past the degree used
+    std::vector<double> center;       // mean moneyness in the money, per step
+    std::vector<double> inv_spread;   // 1 / its standard deviation
+    std::vector<unsigned char> usable;  // regression done at that step
+
+    double moneyness(int step, double s) const
+    {
+        return (s / strike - center[step]) * inv_spread[step];
+    }
+
+    double continuation(int step, double s) const
+    {
+        double f[MAX_TERMS];
+        basisValues(basis, terms, moneyness(step, s), f);
+        const double *beta = &coefficients[(size_t)step * terms];
+        double sum = 0.0;
+        for (int i = 0; i < terms; ++i)
+        {
+            sum += beta[i] * f[i];
+        }
+        return sum;
+    }
+};
+
+// Normal equations of one chunk of training paths
+struct RegressionSums
+{
+    double gram[MAX_TERMS * MAX_TERMS];
+    double rhs[MAX_TERMS];
+    double moneyness;    // sums of S / strike and its square in the money
+    double moneyness_sq;
+    long long in_the_money;
+};
+}
+
+MonteCarloResult estimateAmericanLsm(const MonteCarloSimulation &mcs, const Option &option, const LsmSettings &settings, int n_threads)
+{
+    int steps = mcs.duration;
+    double dt = mcs.increment;
+    double s0 = mcs.stock.price;
+    double rate = mcs.stock.drift;
+    double sigma = mcs.stock.volatility;
+    int terms = settings.degree + 1;
+    if (steps < 1 || !(dt > 0.0) || !(s0 > 0.0) || !(sigma > 0.0))
+    {
+        throw std::invalid_argument("American Monte Carlo needs steps, a positive increment, spot and volatility");
+    }
+    if (terms < 1 || terms > MAX_TERMS)
+    {
+        throw std::invalid_argument("Regression degree must be between 0 and 7");
+    }
+    long long training = settings.training_paths > 0 ? settings.training_paths : mcs.iterations;
+    if (training < 1 || mcs.iterations < 1)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate option");
+    }
+
+    SimdLevel level = detectSimdLevel();
+    double drift = rate - 0.5 * sigma * sigma;
+    double step_discount = exp(-rate * dt);
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+
+    ExerciseRule rule;
+    rule.basis = settings.basis;
+    rule.terms = terms;
+    rule.strike = option.strike;
+    rule.coefficients.assign((size_t)(steps + 1) * terms, 0.0);
+    rule.center.assign(steps + 1, 0.0);
+    rule.inv_spread.assign(steps + 1, 1.0);
+    rule.usable.assign(steps + 1, 0);
+
+    // Training paths, backward: w is the Brownian motion at the current step,
+    // cash the cash flow of the path discounted to the current step
+    std::vector<double> w((size_t)training);
+    std::vector<double> cash((size_t)training);
+    long long n_chunks = (training + TRAINING_CHUNK - 1) / TRAINING_CHUNK;
+    std::vector<RegressionSums> per_chunk((size_t)n_chunks);
+
+    // Normal number block of path i: z0 of Philox block `block` of substream i
+    auto draw = [&](long long begin, long long end, uint64_t block, double *z) {
+        double z0[GbmPathEngine::BATCH];
+        double z1[GbmPathEngine::BATCH];
+        for (long long first = begin; first < end; first += GbmPathEngine::BATCH)
+        {
+            int n = (int)std::min((long long)GbmPathEngine::BATCH, end - first);
+            philoxNormalBlock(level, mcs.seed, (uint64_t)first, block, n, z0, z1);
+            std::copy(z0, z0 + n, z + (first - begin));
+        }
+    };
+
+    pool->parallelFor(training, TRAINING_CHUNK, [&](int, long long begin, long long end) {
+        MC_METRIC_COUNT(COUNTER_PATHS, end - begin);
+        draw(begin, end, 0, &w[begin]);
+        double sqrt_t = sqrt(steps * dt);
+        for (long long i = begin; i < end; ++i)
+        {
+            w[i] *= sqrt_t;
+            cash[i] = optionPayoff(option, s0 * exp(drift * steps * dt + sigma * w[i]));
+        }
+    }, n_threads);
+
+    for (int step = steps - 1; step >= 1; --step)
+    {
+        double t = step * dt;
+        // W at t given W at t + dt: mean shrinks by t / (t + dt), variance dt t / (t + dt)
+        double shrink = (double)step / (step + 1);
+        double spread = sqrt(dt * shrink);
+        pool->parallelFor(training, TRAINING_CHUNK, [&](int, long long begin, long long end) {
+            RegressionSums &sums = per_chunk[begin / TRAINING_CHUNK];
+            sums.moneyness = 0.0;
+            sums.moneyness_sq = 0.0;
+            sums.in_the_money = 0;
+            double z[TRAINING_CHUNK];
+            draw(begin, end, (uint64_t)(steps - step), z);
+            for (long long i = begin; i < end; ++i)
+            {
+                w[i] = shrink * w[i] + spread * z[i - begin];
+                cash[i] *= step_discount;
+                double s = s0 * exp(drift * t + sigma * w[i]);
+                // Only in the money paths matter for the exercise decision
+                if (optionPayoff(option, s) > 0.0)
+                {
+                    double x = s / rule.strike;
+                    sums.moneyness += x;
+                    sums.moneyness_sq += x * x;
+                    ++sums.in_the_money;
+                }
+            }
+        }, n_threads);
+
+        double moneyness = 0.0;
+        double moneyness_sq = 0.0;
+        long long in_the_money = 0;
+        for (const RegressionSums &sums : per_chunk)
+        {
+            moneyness += sums.moneyness;
+            moneyness_sq += sums.moneyness_sq;
+            in_the_money += sums.in_the_money;
+        }
+        if (in_the_money <= 2)
+        {
+            continue; // too few paths in the money to tell, keep holding
+        }
+        rule.center[step] = moneyness / in_the_money;
+        double variance = moneyness_sq / in_the_money - rule.center[step] * rule.center[step];
+        rule.inv_spread[step] = variance > 0.0 ? 1.0 / sqrt(variance) : 1.0;
+
+        pool->parallelFor(training, TRAINING_CHUNK, [&](int, long long begin, long long end) {
+            RegressionSums &sums = per_chunk[begin / TRAINING_CHUNK];
+            std::fill(sums.gram, sums.gram + terms * terms, 0.0);
+            std::fill(sums.rhs, sums.rhs + terms, 0.0);
+            double f[MAX_TERMS];
+            for (long long i = begin; i < end; ++i)
+            {
+                double s = s0 * exp(drift * t + sigma * w[i]);
+                if (optionPayoff(option, s) <= 0.0)
+                {
+                    continue;
+                }
+                basisValues(rule.basis, terms, rule.moneyness(step, s), f);
+                for (int a = 0; a < terms; ++a)
+                {
+                    for (int b = 0; b <= a; ++b)
+                    {
+                        sums.gram[a * terms + b] += f[a] * f[b];
+                    }
+                    sums.rhs[a] += f[a] * cash[i];
+                }
+            }
+        }, n_threads);
+
+        // Chunks merged in order: same rule at any thread count
+        double gram[MAX_TERMS * MAX_TERMS] = {0.0};
+        double rhs[MAX_TERMS] = {0.0};
+        for (const RegressionSums &sums : per_chunk)
+        {
+            for (int a = 0; a < terms; ++a)
+            {
+                for (int b = 0; b <= a; ++b)
+                {
+                    gram[a * terms + b] += sums.gram[a * terms + b];
+                }
+                rhs[a] += sums.rhs[a];
+            }
+        }
+        for (int a = 0; a < terms; ++a)
+        {
+            for (int b = a + 1; b < terms; ++b)
+            {
+                gram[a * terms + b] = gram[b * terms + a];
+            }
+        }
+        // The bases are nested, so a lower degree is the leading block of the
+        // equations: fall back one degree at a time when they can't be solved.
+        // Degree 0, the mean cash flow in the money, always can.
+        double *beta = &rule.coefficients[(size_t)step * terms];
+        for (int used = terms; used >= 1 && !rule.usable[step]; --used)
+        {
+            if (in_the_money <= 2 * used)
+            {
+                continue;
+            }
+            double a[MAX_TERMS * MAX_TERMS];
+            double b[MAX_TERMS];
+            for (int i = 0; i < used; ++i)
+            {
+                std::copy(gram + i * terms, gram + i * terms + used, a + i * used);
+                b[i] = rhs[i];
+            }
+            rule.usable[step] = solveNormalEquations(used, a, b, beta);
+            std::fill(beta + (rule.usable[step] ? used : 0), beta + terms, 0.0);
+        }
+
+        pool->parallelFor(training, TRAINING_CHUNK, [&](int, long long begin, long long end) {
+            for (long long i = begin; i < end; ++i)
+            {
+                double s = s0 * exp(drift * t + sigma * w[i]);
+                double exercise = optionPayoff(option, s);
+                if (exercise > 0.0 && exercise > rule.continuation(step, s))
+                {
+                    cash[i] = exercise;
+                }
+            }
+        }, n_threads);
+    }
+
+    // Exercise is allowed at t = 0 too: every path is at s0 there, so the
+    // continuation value is the mean cash flow of the training paths
+    double intrinsic = optionPayoff(option, s0);
+    double hold = 0.0;
+    for (long long i = 0; i < training; ++i)
+    {
+        hold += cash[i];
+    }
+    hold *= step_discount / training;
+    // Exercising now is exact: the price is the intrinsic value, without error
+    auto exercisedNow = [&]() {
+        MonteCarloResult result = MonteCarloResult();
+        result.price = intrinsic;
+        result.ci_low = intrinsic;
+        result.ci_high = intrinsic;
+        result.mode = PRICING_STEPPED;
+        result.variance_reduction_factor = 1.0;
+        return result;
+    };
+    if (intrinsic > 0.0 && intrinsic >= hold)
+    {
+        return exercisedNow();
+    }
+
+    // The backward arrays aren't needed any more, free them before pricing
+    std::vector<double>().swap(w);
+    std::vector<double>().swap(cash);
+
+    // Pricing paths, forward with the rule above
+    GbmPathEngine engine(s0, rate, sigma, dt, steps, mcs.seed);
+    bool antithetic = mcs.variance_reduction.antithetic;
+    long long samples = mcs.sampleCount();
+    std::vector<double> discount(steps + 1);
+    for (int step = 0; step <= steps; ++step)
+    {
+        discount[step] = exp(-rate * step * dt);
+    }
+    auto pathValue = [&](const double *prices) {
+        for (int step = 1; step < steps; ++step)
+        {
+            double s = prices[step - 1];
+            double exercise = optionPayoff(option, s);
+            if (rule.usable[step] && exercise > 0.0 && exercise > rule.continuation(step, s))
+            {
+                return discount[step] * exercise;
+            }
+        }
+        return discount[steps] * optionPayoff(option, prices[steps - 1]);
+    };
+
+    // Fixed slices merged in order, like the training chunks: same price at any thread count
+    const long long chunk = SAMPLE_SLICE;
+    std::vector<RunningStats> per_pricing_chunk((size_t)((samples + chunk - 1) / chunk));
+    pool->parallelFor(samples, chunk, [&](int, long long begin, long long end) {
+        RunningStats &stats = per_pricing_chunk[begin / chunk];
+        MC_METRIC_SCOPE(STAGE_PAYOFF); // the paths themselves are charged by the engine
+        MC_METRIC_COUNT(COUNTER_PATHS, antithetic ? 2 * (end - begin) : end - begin);
+        std::vector<double> prices((size_t)GbmPathEngine::BATCH * steps);
+        std::vector<double> mirrored(antithetic ? prices.size() : 0);
+        for (long long first = begin; first < end; first += GbmPathEngine::BATCH)
+        {
+            int n = (int)std::min((long long)GbmPathEngine::BATCH, end - first);
+            engine.simulatePaths(PRICING_STREAMS + (uint64_t)first, n, 1, prices.data(), antithetic ? mirrored.data() : NULL);
+            for (int p = 0; p < n; ++p)
+            {
+                double value = pathValue(&prices[(size_t)p * steps]);
+                if (antithetic)
+                {
+                    value = 0.5 * (value + pathValue(&mirrored[(size_t)p * steps]));
+                }
+                stats.add(value);
+            }
+        }
+    }, n_threads);
+
+    RunningStats stats;
+    for (const RunningStats &s : per_pricing_chunk)
+    {
+        stats.merge(s);
+    }
+    MonteCarloResult result = makeResult(stats, PRICING_STEPPED);
+    result.paths = samples * (antithetic ? 2 : 1);
+    // The rule holds on, but out of sample it's worth less than exercising now
+    if (result.price < intrinsic)
+    {
+        return exercisedNow();
+    }
+    return result;
+}
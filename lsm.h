@@ -0,0 +1,37 @@
+#include "functions.h"
+#ifndef LSM_H
+#define LSM_H
+
+/*
+Least squares Monte Carlo (Longstaff-Schwartz) for American exercise.
+Training paths are walked backward from S_T with a Brownian bridge, so only the
+current price and cash flow of each path are kept: 16 bytes per path whatever
+the number of steps. The continuation value at each date is regressed on the
+in the money paths, then a second, independent set of paths is run forward with
+that exercise rule, which gives a lower bound free of the in-sample bias.
+*/
+
+enum LsmBasis
+{
+    LSM_MONOMIAL, // 1, x, x^2...
+    LSM_LAGUERRE, // weighted Laguerre polynomials, as in Longstaff-Schwartz
+    LSM_HERMITE   // probabilists' Hermite polynomials
+};
+
+struct LsmSettings
+{
+    LsmBasis basis; // functions of S / strike, standardized over the paths in the money
+    int degree;     // highest power, the regression has degree + 1 terms; a step
+                    // whose equations are too ill conditioned drops to a lower one
+    long long training_paths; // 0: as many as mcs.iterations
+};
+LsmSettings defaultLsmSettings();
+
+// Exercise allowed at every step of mcs (duration steps of increment years).
+// As for Greeks the drift is taken as the rate: cash flows are discounted at it.
+// Out of sample, discounted price; antithetics are honored on the pricing paths.
+// Exercise at t = 0 is allowed, so the price is never below the intrinsic value;
+// when that wins the result is exact, with no error and no paths.
+MonteCarloResult estimateAmericanLsm(const MonteCarloSimulation &mcs, const Option &option, const LsmSettings &settings, int n_threads);
+
+#endif //
@@ -4,7 +4,14 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <algorithm>
 #include "functions.h"
+#include "lattice.h"
+#include "greeks.h"
+#include "pricing_job.h"
+#include "live_book.h"
+#include "pricing_cache.h"
+#include "metrics.h"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -13,7 +20,6 @@
 #define WINDOW_HEIGHT = 400;
 
 /*FUTURE IDEAS
-More choice of distributions, not just simple weiner process
 Weiner process itself is can be rewritten with fourier series
 
 TODO:
@@ -101,18 +107,28 @@ int main()
     double stock_vol = 0.6;
     double stock_dri = 0.0;
     double black_scholes_price = 0.0;
+    Greeks bs_greeks = {};
     double american_option_price = 0.0;
     bool show_binomial = false;
     int tree_size = 100;
+    bool use_trinomial = false;
+    bool use_richardson = false;
     double sim_option_strike = 110.0;
     bool call = true;
     bool calculate_montecarlo = false;
     bool show_mcs_result = false;
 
-    double mcs_current_price;
-    double mcs_progress_bar;
+    // Both MonteCarlo buttons run as jobs on one executor, the handles own their inputs.
+    // Its slices run on the shared pool, so it adds no threads of its own.
+    PricingExecutor pricing_executor(sharedThreadPool()->size());
+    PricingJob mcs_job;
+    PricingJob mcs_multithread_job;
+    // Pressing a button again with the same inputs doesn't reprice
+    PricingCache pricing_cache;
     int n_threads = std::thread::hardware_concurrency(); 
-    double mcs_multithread_result =0.0;
+    bool use_antithetic = false;
+    bool use_moment_matching = false;
+    int control_variate = CV_NONE;
     bool show_mcs_multithread_result =false;
 
     // Simulation characteristics
@@ -135,7 +151,15 @@ int main()
     bool sim_stop = false;
     int ms_delay = 10;
     double init_price_process = 50.0;
-    WeinerProcessSimulator wps(init_price_process, sim_drift, sim_sigma, sim_step_size, sim_stop);
+    int rng_seed = 42;
+    WeinerProcessSimulator wps(init_price_process, sim_drift, sim_sigma, sim_step_size, sim_stop, rng_seed);
+    // The simulated process streams its ticks to a one option book: the option of the first window
+    LiveBook live_book;
+    // Live rate of the metrics window, from the counters a moment ago
+    double metrics_last_wall = 0.0;
+    unsigned long long metrics_last_paths = 0;
+    double metrics_paths_per_second = 0.0;
+    std::string metrics_message;
 
     // GameLoop
     while (!glfwWindowShouldClose(window))
@@ -161,59 +185,68 @@ int main()
         ImGui::InputInt("Number of trials", &n_trials);
         ImGui::InputInt("Number of steps per trial", &n_trial_steps);
         ImGui::InputInt("thread number ", &n_threads);
+        ImGui::InputInt("Random seed", &rng_seed);
+        ImGui::Checkbox("Antithetic paths", &use_antithetic);
+        ImGui::Checkbox("Moment matching", &use_moment_matching);
+        ImGui::Combo("Control variate", &control_variate, "None\0Terminal stock\0Black-Scholes vanilla at the forward\0");
     
         ImGui::Checkbox("Show steps in simulation", &show);
         ImGui::InputInt("Binomial tree size", &tree_size);
+        tree_size = std::max(tree_size, 4); // Richardson halves it
+        ImGui::Checkbox("Trinomial tree", &use_trinomial);
+        ImGui::SameLine();
+        ImGui::Checkbox("Richardson extrapolation", &use_richardson);
 
         if (ImGui::Button("Run MonteCarlo simulation"))
         {
-            mcs_finish = false;
             printf("Running montecarlo simulation...");
-            stopMonteCarloThread();
+            if (mcs_job.valid())
+            {
+                mcs_job.cancel();
+            }
             Asset simulated_stock = {"ABC", stock_init_price, stock_dri, stock_vol, interest_rate};
 
             double step_size = t_sim / (double)n_trial_steps;
-            MonteCarloSimulation mc_sim(n_trials, n_trial_steps, step_size, simulated_stock, show);
+            MonteCarloSimulation mc_sim(n_trials, n_trial_steps, step_size, simulated_stock, show, rng_seed);
+            mc_sim.mode = PRICING_STEPPED;
             Option sim_option;
             sim_option.stock = simulated_stock;
             sim_option.call = call;
             sim_option.strike = sim_option_strike;
+            sim_option.t = t_sim;
 
-            mcs_thread = std::thread(runMonteCarloThread, std::ref(mc_sim), std::ref(sim_option));
-
-            // result = exp(-interest_rate * t_sim) * mc_sim.estimateOption(sim_option);
+            // One worker at a time, the running estimate is the point of this one
+            mcs_job = pricing_executor.submit(mc_sim, sim_option, JOB_PRIORITY_HIGH, 1);
             show_mcs_result = true;
         }
-        if (show_mcs_result && !mcs_finish && mcs_running)
+        if (show_mcs_result && !mcs_job.ready())
         {
             if (ImGui::Button("Stop MonteCarlo Simulation"))
             {
-                stopMonteCarloThread();
+                mcs_job.cancel();
             }
         }
 
         if (ImGui::Button("Run multithreaded MonteCarlo simulation")){
-            stopMonteCarloMultiThread();
+            if (mcs_multithread_job.valid())
+            {
+                mcs_multithread_job.cancel();
+            }
             Asset simulated_stock = {"ABC", stock_init_price, stock_dri, stock_vol, interest_rate};
 
             double step_size = t_sim / (double)n_trial_steps;
             
-            MonteCarloSimulation mc_sim_multithread(n_trials, n_trial_steps, step_size, simulated_stock, show);
+            MonteCarloSimulation mc_sim_multithread(n_trials, n_trial_steps, step_size, simulated_stock, show, rng_seed);
+            mc_sim_multithread.variance_reduction.antithetic = use_antithetic;
+            mc_sim_multithread.variance_reduction.moment_matching = use_moment_matching;
+            mc_sim_multithread.variance_reduction.control = (ControlVariate)control_variate;
             Option sim_option;
             sim_option.stock = simulated_stock;
             sim_option.call = call;
             sim_option.strike = sim_option_strike;
-            
+            sim_option.t = t_sim;
 
-            mcs_multithread = std::thread([&]() {
-        // This runs the simulation on a separate thread and stores the result
-            
-            mcs_multithread_result = exp(-interest_rate * t_sim) * runMonteCarloMultiThreading(n_threads, std::ref(mc_sim_multithread), sim_option);
-        
-        // Once the simulation is finished, update the running flag
-
-            });
-            
+            mcs_multithread_job = pricing_executor.submit(mc_sim_multithread, sim_option, JOB_PRIORITY_NORMAL, std::max(n_threads, 1));
             show_mcs_multithread_result =true;
 
         }
@@ -221,47 +254,47 @@ int main()
         if (ImGui::Button("Calculate Black-Scholes Price"))
         {
             show_bs_price = true;
-            black_scholes_price = bsOptionPrice(call, stock_init_price, sim_option_strike, interest_rate, t_sim, stock_vol);
+            black_scholes_price = pricing_cache.bsPrice(call, stock_init_price, sim_option_strike, interest_rate, t_sim, stock_vol);
+            bs_greeks = bsGreeks(call, stock_init_price, sim_option_strike, interest_rate, t_sim, stock_vol);
         }
 
         if (ImGui::Button("Calculate binomial tree"))
         {
             show_binomial = true;
-            american_option_price = binomialOptionPrice(call, stock_init_price, sim_option_strike, interest_rate, t_sim, stock_vol, tree_size = 100, false);
+            LatticeType lattice = use_trinomial ? LATTICE_TRINOMIAL : LATTICE_BINOMIAL;
+            LatticeVariant variant = use_richardson ? LATTICE_RICHARDSON : LATTICE_PLAIN;
+            american_option_price = pricing_cache.latticePrice(call, true, stock_init_price, sim_option_strike, interest_rate, t_sim, stock_vol, tree_size, lattice, variant);
         }
 
         if (show_mcs_result)
         {
-
-            if (mcs_running && !mcs_finish)
+            double discount = exp(-interest_rate * t_sim);
+            JobProgress p = mcs_job.progress();
+            if (p.status == JOB_DONE)
             {
-                {
-                    std::lock_guard<std::mutex> lock(mcs_mutex);
-                    mcs_current_price = mcs_approx_price;
-                    mcs_progress_bar = mcs_progress;
-                }
-
-                ImGui::Text("Simulation progress %.1f % \nApproximating price: %.2f ", mcs_progress_bar * 100.0, mcs_current_price);
+                ImGui::Text("MonteCarlo simulation price estimate: %.2f", discount * p.estimate);
             }
-            else if (mcs_finish)
+            else
             {
-                ImGui::Text("MonteCarlo simulation price estimate: %.2f", mcs_current_price);
+                ImGui::Text("Simulation %s %.1f %% \nApproximating price: %.2f ", jobStatusName(p.status), 100.0 * p.paths_done / p.paths_total, discount * p.estimate);
             }
         }
         if (show_mcs_multithread_result){
-            if (mcs_multithread_running){
-                float progress = (float)mcs_multithread_progress / (float)n_trials;
+            JobProgress p = mcs_multithread_job.progress();
+            if (!mcs_multithread_job.ready()){
+                float progress = (float)p.paths_done / (float)p.paths_total;
                 ImGui::ProgressBar(progress, ImVec2(0.0f, 0.0f));
+             } else if (p.status == JOB_DONE) {
+                ImGui::Text("Multithread MonteCarlo simulation price estimate: %.2f +- %.2f", exp(-interest_rate * t_sim) * p.estimate, exp(-interest_rate * t_sim) * p.std_error);
              } else {
-                
-                double result = mcs_multithread_result;
-                ImGui::Text("Multithread MonteCarlo simulation price estimate: %.2f", mcs_multithread_result);
+                ImGui::Text("Multithread MonteCarlo simulation %s", jobStatusName(p.status));
              }
         }
 
         if (show_bs_price)
         {
             ImGui::Text("Black-Scholes price: %.2f", black_scholes_price);
+            ImGui::Text("Delta %.4f  Gamma %.4f  Vega %.3f  Theta %.3f  Rho %.3f", bs_greeks.delta, bs_greeks.gamma, bs_greeks.vega, bs_greeks.theta, bs_greeks.rho);
         }
 
         if (show_binomial)
@@ -288,15 +321,26 @@ int main()
         if (ImGui::Button("Run simulation: ") && !sim_running)
         {
             stopCurrentSimulation();
-            WeinerProcessSimulator wps(init_price_process, sim_drift, sim_sigma, sim_step_size, sim_stop);
-
-            simulation_thread = std::thread(runSimulationThread, ms_delay, std::ref(wps), sim_show_steps);
+            live_book.stop();
+            WeinerProcessSimulator wps(init_price_process, sim_drift, sim_sigma, sim_step_size, sim_stop, rng_seed);
+
+            Option book_option;
+            book_option.stock = {"ABC", init_price_process, sim_drift, sim_sigma, interest_rate};
+            book_option.call = call;
+            book_option.strike = sim_option_strike;
+            book_option.t = t_sim;
+            live_book.clearPositions();
+            live_book.addPosition(book_option, 1.0);
+            live_book.start();
+
+            simulation_thread = std::thread(runSimulationThread, ms_delay, wps, sim_show_steps, &live_book);
             show_sim_result = true;
         }
         if (ImGui::Button("Stop simulation"))
         {
             // Stop simulation
             stopCurrentSimulation();
+            live_book.stop();
         }
 
         std::string state = sim_paused ? "Resume simulation" : "Pause simulation";
@@ -307,14 +351,84 @@ int main()
         }
         if (show_sim_result)
         {
-            double sim_price;
+            BookSnapshot book = live_book.snapshot();
+            ImGui::Text("Price: %.2f", book.spot);
+            ImGui::Text("Option %.4f  Delta %.4f  Gamma %.5f", book.total.price, book.total.delta, book.total.gamma);
+            ImGui::Text("Ticks %lld  full reprices %lld", book.ticks, book.full_reprices);
+            ImGui::Text("Tick latency %.1f us (mean %.1f, max %.1f)", book.last_latency_us, book.mean_latency_us, book.max_latency_us);
+        }
+
+        ImGui::End();
+
+        // third window, where the time goes in the engines
+        ImGui::SetNextWindowSize(ImVec2(300, 400), ImGuiCond_FirstUseEver);
+        ImGui::Begin("Engine metrics");
+        if (!metricsEnabled())
+        {
+            ImGui::Text("Built without metrics, rebuild with make METRICS=1");
+        }
+        MetricsSnapshot metrics = snapshotMetrics();
+        if (metricsEnabled())
+        {
+            unsigned long long paths = metrics.counters[COUNTER_PATHS];
+            if (metrics.wall_seconds < metrics_last_wall || paths < metrics_last_paths)
             {
-                std::lock_guard<std::mutex> lock(sim_mutex);
-                sim_price = current_price;
+                metrics_last_wall = metrics.wall_seconds; // reset since
+                metrics_last_paths = paths;
+            }
+            if (metrics.wall_seconds - metrics_last_wall >= 0.5)
+            {
+                metrics_paths_per_second = (paths - metrics_last_paths) / (metrics.wall_seconds - metrics_last_wall);
+                metrics_last_wall = metrics.wall_seconds;
+                metrics_last_paths = paths;
             }
-            ImGui::Text("Price: %.2f", sim_price);
-        }
 
+            double total = 0.0;
+            for (int s = STAGE_NONE + 1; s < METRIC_STAGES; ++s)
+            {
+                total += metrics.stage_seconds[s];
+            }
+            for (int s = STAGE_NONE + 1; s < METRIC_STAGES; ++s)
+            {
+                ImGui::Text("%-8s %9.3f s  %5.1f %%", metricStageName((MetricStage)s), metrics.stage_seconds[s], total > 0.0 ? 100.0 * metrics.stage_seconds[s] / total : 0.0);
+            }
+            ImGui::Separator();
+            ImGui::Text("Paths/s now %.3g, overall %.3g", metrics_paths_per_second, metrics.paths_per_second);
+            ImGui::Text("ns per normal draw %.2f", metrics.ns_per_normal);
+            ImGui::Text("Paths %llu  normals %llu  trees %llu  tasks %llu", metrics.counters[COUNTER_PATHS], metrics.counters[COUNTER_NORMALS], metrics.counters[COUNTER_TREES], metrics.counters[COUNTER_TASKS]);
+            ImGui::Separator();
+            for (const ThreadMetrics &thread : metrics.threads)
+            {
+                char label[64];
+                if (thread.worker >= 0)
+                {
+                    snprintf(label, sizeof(label), "worker %d  %.0f %%", thread.worker, 100.0 * thread.utilization);
+                }
+                else
+                {
+                    snprintf(label, sizeof(label), "thread %d  %.0f %%", thread.slot, 100.0 * thread.utilization);
+                }
+                ImGui::ProgressBar((float)thread.utilization, ImVec2(-1.0f, 0.0f), label);
+            }
+            if (ImGui::Button("Reset"))
+            {
+                resetMetrics();
+                metrics_paths_per_second = 0.0;
+            }
+        }
+        if (ImGui::Button("Dump JSON"))
+        {
+            metrics_message = writeMetrics("metrics.json", metrics) ? "Wrote metrics.json" : "Couldn't write metrics.json";
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Dump Prometheus"))
+        {
+            metrics_message = writeMetrics("metrics.prom", metrics) ? "Wrote metrics.prom" : "Couldn't write metrics.prom";
+        }
+        if (!metrics_message.empty())
+        {
+            ImGui::Text("%s", metrics_message.c_str());
+        }
         ImGui::End();
 
         ImGui::Render();
@@ -326,6 +440,8 @@ int main()
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         glfwSwapBuffers(window);
     }
+    stopCurrentSimulation();
+    live_book.stop();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
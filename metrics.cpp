@@ -0,0 +1,344 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include "metrics.h"
+#include "thread_pool.h"
+
+thread_local ThreadMetricsState thread_metrics = {NULL, STAGE_NONE, 0};
+
+static ThreadMetricsSlot slots[MAX_METRIC_THREADS];
+static std::atomic<int> slots_used(0);
+static std::mutex free_mutex;
+static std::vector<int> free_slots;
+
+// Gives the slot of a thread back when it exits, so threads coming and going don't
+// run out of slots. The totals stay in the slot for the next thread to add to.
+struct SlotRelease
+{
+    int index; // -1: none, or the shared last slot
+    ~SlotRelease()
+    {
+        if (index < 0)
+        {
+            return;
+        }
+        ThreadMetricsSlot &slot = slots[index];
+        slot.open_stage.store(STAGE_NONE, std::memory_order_relaxed);
+        slot.task_since.store(0, std::memory_order_relaxed);
+        slot.live.store(false, std::memory_order_relaxed);
+        thread_metrics.slot = NULL;
+        std::lock_guard<std::mutex> lock(free_mutex);
+        free_slots.push_back(index);
+    }
+};
+static thread_local SlotRelease slot_release = {-1};
+
+// Raw values of every slot, what a reset subtracts from later snapshots
+struct RawMetrics
+{
+    uint64_t ticks[MAX_METRIC_THREADS][METRIC_STAGES];
+    uint64_t counts[MAX_METRIC_THREADS][METRIC_COUNTERS];
+    uint64_t task_ticks[MAX_METRIC_THREADS];
+    std::chrono::steady_clock::time_point time;
+};
+static std::mutex baseline_mutex;
+static RawMetrics baseline;
+static bool has_baseline = false;
+
+// Ticks to ns, from the clock and the tick counter read now and at start up
+static const uint64_t start_ticks = metricTicks();
+static const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+const char *metricStageName(MetricStage stage)
+{
+    switch (stage)
+    {
+    case STAGE_RNG:
+        return "rng";
+    case STAGE_STEP:
+        return "step";
+    case STAGE_PAYOFF:
+        return "payoff";
+    case STAGE_REDUCE:
+        return "reduce";
+    case STAGE_WAIT:
+        return "wait";
+    case STAGE_LATTICE:
+        return "lattice";
+    default:
+        return "none";
+    }
+}
+
+const char *metricCounterName(MetricCounter counter)
+{
+    switch (counter)
+    {
+    case COUNTER_PATHS:
+        return "paths";
+    case COUNTER_NORMALS:
+        return "normals";
+    case COUNTER_TREES:
+        return "trees";
+    case COUNTER_TASKS:
+        return "tasks";
+    default:
+        return "unknown";
+    }
+}
+
+void claimMetricsSlot(ThreadMetricsState &state)
+{
+    int index = -1;
+    {
+        // The mutex also orders the last writes of the thread that freed it before ours
+        std::lock_guard<std::mutex> lock(free_mutex);
+        if (!free_slots.empty())
+        {
+            index = free_slots.back();
+            free_slots.pop_back();
+        }
+    }
+    if (index < 0 && slots_used.load() < MAX_METRIC_THREADS - 1)
+    {
+        index = slots_used.fetch_add(1);
+    }
+    if (index < 0 || index >= MAX_METRIC_THREADS - 1)
+    {
+        // Out of slots: share the last one, never given back
+        index = MAX_METRIC_THREADS - 1;
+        slots_used.store(MAX_METRIC_THREADS);
+    }
+    else
+    {
+        slot_release.index = index;
+    }
+    slots[index].worker.store(ThreadPool::currentWorker(), std::memory_order_relaxed);
+    slots[index].live.store(true, std::memory_order_relaxed);
+    state.slot = &slots[index];
+    state.stage = STAGE_NONE;
+    state.last = metricTicks();
+}
+
+MetricTaskScope::MetricTaskScope() : start(metricTicks())
+{
+    ThreadMetricsState &state = thread_metrics;
+    if (state.slot == NULL)
+    {
+        claimMetricsSlot(state);
+    }
+    state.slot->task_since.store(start, std::memory_order_relaxed);
+    // Counted now: a task releases its caller before this scope closes, and the caller
+    // may read the counters right away. Snapshots take its time so far from task_since.
+    metricAdd(state.slot->counts[COUNTER_TASKS], 1);
+}
+
+MetricTaskScope::~MetricTaskScope()
+{
+    ThreadMetricsSlot &slot = *thread_metrics.slot;
+    metricAdd(slot.task_ticks, metricTicks() - start);
+    slot.task_since.store(0, std::memory_order_relaxed);
+}
+
+bool metricsEnabled()
+{
+    return MC_METRICS != 0;
+}
+
+static int usedSlots()
+{
+    return std::min(slots_used.load(), MAX_METRIC_THREADS);
+}
+
+static void readRaw(RawMetrics &raw)
+{
+    memset(raw.ticks, 0, sizeof(raw.ticks));
+    memset(raw.counts, 0, sizeof(raw.counts));
+    memset(raw.task_ticks, 0, sizeof(raw.task_ticks));
+    int n = usedSlots();
+    uint64_t now = metricTicks();
+    for (int i = 0; i < n; ++i)
+    {
+        const ThreadMetricsSlot &slot = slots[i];
+        for (int s = 0; s < METRIC_STAGES; ++s)
+        {
+            raw.ticks[i][s] = slot.ticks[s].load(std::memory_order_relaxed);
+        }
+        for (int c = 0; c < METRIC_COUNTERS; ++c)
+        {
+            raw.counts[i][c] = slot.counts[c].load(std::memory_order_relaxed);
+        }
+        raw.task_ticks[i] = slot.task_ticks.load(std::memory_order_relaxed);
+        // Plus the stage and task still open, read apart from the totals: off by a stage change at worst
+        int open = slot.open_stage.load(std::memory_order_relaxed);
+        uint64_t since = slot.open_since.load(std::memory_order_relaxed);
+        if (open != STAGE_NONE && open < METRIC_STAGES && now > since)
+        {
+            raw.ticks[i][open] += now - since;
+        }
+        uint64_t task_since = slot.task_since.load(std::memory_order_relaxed);
+        if (task_since != 0 && now > task_since)
+        {
+            raw.task_ticks[i] += now - task_since;
+        }
+    }
+    raw.time = std::chrono::steady_clock::now();
+}
+
+static double nsPerTick()
+{
+    // Needs a little time since start up to be accurate
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (now - start_time < std::chrono::milliseconds(2))
+    {
+        std::this_thread::yield();
+        now = std::chrono::steady_clock::now();
+    }
+    uint64_t ticks = metricTicks();
+    double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_time).count();
+    return (ticks > start_ticks) ? ns / (double)(ticks - start_ticks) : 1.0;
+}
+
+MetricsSnapshot snapshotMetrics()
+{
+    // Static, the two of them are a few hundred KB
+    static std::mutex snapshot_mutex;
+    static RawMetrics raw;
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    readRaw(raw);
+    double to_seconds = 1e-9 * nsPerTick();
+
+    MetricsSnapshot snapshot;
+    snapshot.enabled = metricsEnabled();
+    memset(snapshot.stage_seconds, 0, sizeof(snapshot.stage_seconds));
+    memset(snapshot.counters, 0, sizeof(snapshot.counters));
+    std::lock_guard<std::mutex> base_lock(baseline_mutex);
+    std::chrono::steady_clock::time_point since = has_baseline ? baseline.time : start_time;
+    snapshot.wall_seconds = std::chrono::duration<double>(raw.time - since).count();
+
+    int n = usedSlots();
+    for (int i = 0; i < n; ++i)
+    {
+        ThreadMetrics thread;
+        thread.slot = i;
+        thread.worker = slots[i].worker.load(std::memory_order_relaxed);
+        double stages_busy = 0.0;
+        for (int s = 0; s < METRIC_STAGES; ++s)
+        {
+            uint64_t ticks = raw.ticks[i][s] - (has_baseline ? baseline.ticks[i][s] : 0);
+            thread.stage_seconds[s] = ticks * to_seconds;
+            snapshot.stage_seconds[s] += thread.stage_seconds[s];
+            if (s != STAGE_NONE && s != STAGE_WAIT)
+            {
+                stages_busy += thread.stage_seconds[s];
+            }
+        }
+        for (int c = 0; c < METRIC_COUNTERS; ++c)
+        {
+            snapshot.counters[c] += raw.counts[i][c] - (has_baseline ? baseline.counts[i][c] : 0);
+        }
+        uint64_t task_ticks = raw.task_ticks[i] - (has_baseline ? baseline.task_ticks[i] : 0);
+        thread.busy_seconds = (task_ticks > 0) ? task_ticks * to_seconds : stages_busy;
+        thread.wait_seconds = thread.stage_seconds[STAGE_WAIT];
+        double total = thread.busy_seconds + thread.wait_seconds;
+        thread.utilization = (total > 0.0) ? thread.busy_seconds / total : 0.0;
+        if (slots[i].live.load(std::memory_order_relaxed))
+        {
+            snapshot.threads.push_back(thread);
+        }
+    }
+    snapshot.paths_per_second = (snapshot.wall_seconds > 0.0) ? snapshot.counters[COUNTER_PATHS] / snapshot.wall_seconds : 0.0;
+    snapshot.ns_per_normal = (snapshot.counters[COUNTER_NORMALS] > 0) ? 1e9 * snapshot.stage_seconds[STAGE_RNG] / snapshot.counters[COUNTER_NORMALS] : 0.0;
+    return snapshot;
+}
+
+void resetMetrics()
+{
+    std::lock_guard<std::mutex> lock(baseline_mutex);
+    readRaw(baseline);
+    has_baseline = true;
+}
+
+static std::string format(const char *fmt, double x)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), fmt, x);
+    return buffer;
+}
+
+std::string metricsJson(const MetricsSnapshot &snapshot)
+{
+    std::string out = "{\n";
+    out += std::string("  \"enabled\": ") + (snapshot.enabled ? "true" : "false") + ",\n";
+    out += "  \"wall_seconds\": " + format("%.9g", snapshot.wall_seconds) + ",\n";
+    out += "  \"stage_seconds\": {";
+    for (int s = STAGE_NONE + 1; s < METRIC_STAGES; ++s)
+    {
+        out += std::string(s > STAGE_NONE + 1 ? ", " : "") + "\"" + metricStageName((MetricStage)s) + "\": " + format("%.9g", snapshot.stage_seconds[s]);
+    }
+    out += "},\n  \"counters\": {";
+    for (int c = 0; c < METRIC_COUNTERS; ++c)
+    {
+        out += std::string(c > 0 ? ", " : "") + "\"" + metricCounterName((MetricCounter)c) + "\": " + std::to_string(snapshot.counters[c]);
+    }
+    out += "},\n";
+    out += "  \"paths_per_second\": " + format("%.6g", snapshot.paths_per_second) + ",\n";
+    out += "  \"ns_per_normal\": " + format("%.6g", snapshot.ns_per_normal) + ",\n";
+    out += "  \"threads\": [";
+    for (size_t i = 0; i < snapshot.threads.size(); ++i)
+    {
+        const ThreadMetrics &thread = snapshot.threads[i];
+        out += std::string(i > 0 ? "," : "") + "\n    {\"slot\": " + std::to_string(thread.slot) + ", \"worker\": " + std::to_string(thread.worker);
+        out += ", \"busy_seconds\": " + format("%.9g", thread.busy_seconds) + ", \"wait_seconds\": " + format("%.9g", thread.wait_seconds);
+        out += ", \"utilization\": " + format("%.4f", thread.utilization) + "}";
+    }
+    out += snapshot.threads.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    return out;
+}
+
+std::string metricsPrometheus(const MetricsSnapshot &snapshot)
+{
+    std::string out;
+    out += "# HELP mc_stage_seconds_total Time spent in each pricing stage, all threads.\n";
+    out += "# TYPE mc_stage_seconds_total counter\n";
+    for (int s = STAGE_NONE + 1; s < METRIC_STAGES; ++s)
+    {
+        out += std::string("mc_stage_seconds_total{stage=\"") + metricStageName((MetricStage)s) + "\"} " + format("%.9g", snapshot.stage_seconds[s]) + "\n";
+    }
+    for (int c = 0; c < METRIC_COUNTERS; ++c)
+    {
+        std::string name = std::string("mc_") + metricCounterName((MetricCounter)c) + "_total";
+        out += "# TYPE " + name + " counter\n";
+        out += name + " " + std::to_string(snapshot.counters[c]) + "\n";
+    }
+    out += "# TYPE mc_wall_seconds gauge\nmc_wall_seconds " + format("%.9g", snapshot.wall_seconds) + "\n";
+    out += "# TYPE mc_paths_per_second gauge\nmc_paths_per_second " + format("%.6g", snapshot.paths_per_second) + "\n";
+    out += "# TYPE mc_ns_per_normal gauge\nmc_ns_per_normal " + format("%.6g", snapshot.ns_per_normal) + "\n";
+    out += "# HELP mc_thread_utilization Busy / (busy + wait) per thread.\n";
+    out += "# TYPE mc_thread_utilization gauge\n";
+    for (const ThreadMetrics &thread : snapshot.threads)
+    {
+        out += "mc_thread_utilization{slot=\"" + std::to_string(thread.slot) + "\",worker=\"" + std::to_string(thread.worker) + "\"} " + format("%.4f", thread.utilization) + "\n";
+    }
+    out += "# TYPE mc_thread_wait_seconds_total counter\n";
+    for (const ThreadMetrics &thread : snapshot.threads)
+    {
+        out += "mc_thread_wait_seconds_total{slot=\"" + std::to_string(thread.slot) + "\",worker=\"" + std::to_string(thread.worker) + "\"} " + format("%.9g", thread.wait_seconds) + "\n";
+    }
+    return out;
+}
+
+bool writeMetrics(const std::string &path, const MetricsSnapshot &snapshot)
+{
+    bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    std::string text = json ? metricsJson(snapshot) : metricsPrometheus(snapshot);
+    FILE *out = fopen(path.c_str(), "w");
+    if (out == NULL)
+    {
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), out) == text.size();
+    return fclose(out) == 0 && ok;
+}
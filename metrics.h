@@ -0,0 +1,199 @@
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "simd.h"
+#if MC_X86
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+Where the time goes inside the engines, compiled in with -DMC_METRICS=1 (make METRICS=1).
+Off, the MC_METRIC_* macros are empty and cost nothing; the snapshot and export
+functions stay, and report metricsEnabled() false.
+Every thread charges the time between two stage changes to the stage it was in:
+a scope nested in another takes its time out of the outer one, so the stages add
+up without double counting. Clock reads are rdtsc on x86, a few ns each, and the
+scopes sit at batch level (64 paths), never per path.
+Each thread writes only its own cache line aligned slot, with relaxed loads and
+stores, so a reader can take a snapshot at any time without stopping anyone.
+*/
+
+#ifndef MC_METRICS
+#define MC_METRICS 0
+#endif
+
+enum MetricStage
+{
+    STAGE_NONE,    // outside every scope, not reported
+    STAGE_RNG,     // normal draws
+    STAGE_STEP,    // path stepping
+    STAGE_PAYOFF,  // payoffs and per path accumulation
+    STAGE_REDUCE,  // merging accumulators
+    STAGE_WAIT,    // pool threads idle, callers blocked on a parallelFor
+    STAGE_LATTICE, // tree backward induction
+    METRIC_STAGES
+};
+const char *metricStageName(MetricStage stage);
+
+enum MetricCounter
+{
+    COUNTER_PATHS,   // simulated paths, mirrors included
+    COUNTER_NORMALS, // normals drawn
+    COUNTER_TREES,   // lattices priced
+    COUNTER_TASKS,   // pool tasks run
+    METRIC_COUNTERS
+};
+const char *metricCounterName(MetricCounter counter);
+
+// Slots are given back when their thread exits and reused. Past this many threads
+// alive at once, the extra ones share the last slot and their numbers are approximate.
+static const int MAX_METRIC_THREADS = 256;
+
+struct alignas(64) ThreadMetricsSlot
+{
+    std::atomic<uint64_t> ticks[METRIC_STAGES];
+    std::atomic<uint64_t> counts[METRIC_COUNTERS];
+    std::atomic<uint64_t> task_ticks; // inside pool tasks
+    std::atomic<int> worker;          // pool worker index, -1 for other threads
+    std::atomic<bool> live;           // held by a running thread, exited ones keep their totals
+    // What the thread is in right now, so a snapshot sees a long wait or task before it ends
+    std::atomic<int> open_stage;
+    std::atomic<uint64_t> open_since;
+    std::atomic<uint64_t> task_since; // 0 outside tasks
+};
+
+// Zero initialized, so reading it needs no guard
+struct ThreadMetricsState
+{
+    ThreadMetricsSlot *slot;
+    int stage;
+    uint64_t last;
+};
+extern thread_local ThreadMetricsState thread_metrics;
+
+void claimMetricsSlot(ThreadMetricsState &state);
+
+inline uint64_t metricTicks()
+{
+#if MC_X86
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Single writer per slot: a plain load and store, no locked instruction
+inline void metricAdd(std::atomic<uint64_t> &value, uint64_t n)
+{
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Charges the time since the last change to the current stage, then switches to stage.
+// Returns the stage left.
+inline int metricSwitch(int stage)
+{
+    ThreadMetricsState &state = thread_metrics;
+    uint64_t now = metricTicks();
+    if (state.slot == NULL)
+    {
+        claimMetricsSlot(state);
+    }
+    if (state.stage != STAGE_NONE)
+    {
+        metricAdd(state.slot->ticks[state.stage], now - state.last);
+    }
+    state.slot->open_stage.store(stage, std::memory_order_relaxed);
+    state.slot->open_since.store(now, std::memory_order_relaxed);
+    state.last = now;
+    int left = state.stage;
+    state.stage = stage;
+    return left;
+}
+
+inline void metricCount(MetricCounter counter, uint64_t n)
+{
+    ThreadMetricsState &state = thread_metrics;
+    if (state.slot == NULL)
+    {
+        claimMetricsSlot(state);
+    }
+    metricAdd(state.slot->counts[counter], n);
+}
+
+class MetricScope
+{
+private:
+    int outer;
+
+public:
+    explicit MetricScope(MetricStage stage) : outer(metricSwitch(stage)) {}
+    ~MetricScope() { metricSwitch(outer); }
+};
+
+// Wraps a pool task: counts it and the time spent in it, for the thread's utilization
+class MetricTaskScope
+{
+private:
+    uint64_t start;
+
+public:
+    MetricTaskScope();
+    ~MetricTaskScope();
+};
+
+#if MC_METRICS
+#define MC_METRIC_SCOPE(stage) MetricScope metric_scope(stage)
+#define MC_METRIC_COUNT(counter, n) metricCount(counter, (uint64_t)(n))
+#define MC_METRIC_TASK() MetricTaskScope metric_task
+#else
+#define MC_METRIC_SCOPE(stage) \
+    do                         \
+    {                          \
+    } while (0)
+#define MC_METRIC_COUNT(counter, n) \
+    do                              \
+    {                               \
+    } while (0)
+#define MC_METRIC_TASK() \
+    do                   \
+    {                    \
+    } while (0)
+#endif
+
+struct ThreadMetrics
+{
+    int slot;
+    int worker; // pool worker index, -1 for other threads
+    double stage_seconds[METRIC_STAGES];
+    double busy_seconds; // in pool tasks, or in every stage but STAGE_WAIT outside the pool
+    double wait_seconds;
+    double utilization;  // busy / (busy + wait)
+};
+
+struct MetricsSnapshot
+{
+    bool enabled;
+    double wall_seconds; // since the last resetMetrics, or the start
+    double stage_seconds[METRIC_STAGES];
+    unsigned long long counters[METRIC_COUNTERS];
+    double paths_per_second; // over wall_seconds
+    double ns_per_normal;    // RNG time / normals drawn
+    std::vector<ThreadMetrics> threads; // the ones alive, a reused slot counts both its threads
+};
+
+bool metricsEnabled();
+MetricsSnapshot snapshotMetrics();
+// Later snapshots count from now on
+void resetMetrics();
+std::string metricsJson(const MetricsSnapshot &snapshot);
+// Prometheus text exposition format
+std::string metricsPrometheus(const MetricsSnapshot &snapshot);
+// JSON if path ends in .json, Prometheus text otherwise
+bool writeMetrics(const std::string &path, const MetricsSnapshot &snapshot);
+
+#endif //
@@ -0,0 +1,260 @@
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "mlmc.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+static const long long SAMPLE_CHUNK = 1024;
+// Level l draws from substreams l << LEVEL_SHIFT onward, so levels never share paths
+static const int LEVEL_SHIFT = 48;
+
+MlmcSettings defaultMlmcSettings()
+{
+    MlmcSettings settings;
+    settings.target_rmse = 0.01;
+    settings.base_steps = 1;
+    settings.max_level = 10;
+    settings.warmup_samples = 10000;
+    return settings;
+}
+
+struct LevelStats
+{
+    RunningStats correction; // P_l - P_{l-1}
+    RunningStats fine;       // P_l
+    double seconds;
+};
+
+// Adds samples [first, first + count) of level to stats
+static void runLevel(const MonteCarloSimulation &mcs, const PathPayoff &payoff, int base_steps, double horizon, int level, long long first, long long count, LevelStats &stats, int n_threads)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int fine_steps = base_steps << level;
+    double h = horizon / fine_steps;
+    double sqrt_h = sqrt(h);
+    const Asset &stock = mcs.stock;
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    // One accumulator per chunk, merged in order: same result at any thread count
+    std::vector<LevelStats> per_chunk((size_t)((count + SAMPLE_CHUNK - 1) / SAMPLE_CHUNK));
+    pool->parallelFor(count, SAMPLE_CHUNK, [&](int, long long begin, long long end) {
+        LevelStats &chunk = per_chunk[begin / SAMPLE_CHUNK];
+        MC_METRIC_SCOPE(STAGE_STEP); // draws and payoffs included
+        // A coupled sample is a fine and a coarse path on the same normals
+        MC_METRIC_COUNT(COUNTER_PATHS, (level == 0 ? 1 : 2) * (end - begin));
+        MC_METRIC_COUNT(COUNTER_NORMALS, (long long)fine_steps * (end - begin));
+        std::vector<double> fine_path(fine_steps);
+        std::vector<double> coarse_path(fine_steps / 2);
+        WeinerProcessSimulator fine(stock.price, stock.drift, stock.volatility, h, false, mcs.seed);
+        WeinerProcessSimulator coarse(stock.price, stock.drift, stock.volatility, 2.0 * h, false, mcs.seed);
+        for (long long i = begin; i < end; ++i)
+        {
+            // Normal pair k of the substream drives fine steps 2k and 2k + 1, i.e. coarse step k
+            uint64_t stream = (uint64_t)level << LEVEL_SHIFT | (uint64_t)(first + i);
+            fine.reset(stock.price, 0);
+            double p_coarse = 0.0;
+            if (level == 0)
+            {
+                double z[2];
+                for (int j = 0; j < fine_steps; ++j)
+                {
+                    if (j % 2 == 0)
+                    {
+                        philoxNormalPair(mcs.seed, stream, (uint64_t)(j / 2), z[0], z[1]);
+                    }
+                    fine.stepWithIncrement(sqrt_h * z[j % 2], h);
+                    fine_path[j] = fine.getPrice();
+                }
+            }
+            else
+            {
+                coarse.reset(stock.price, 0);
+                for (int j = 0; j < fine_steps / 2; ++j)
+                {
+                    double z1;
+                    double z2;
+                    philoxNormalPair(mcs.seed, stream, (uint64_t)j, z1, z2);
+                    double dw1 = sqrt_h * z1;
+                    double dw2 = sqrt_h * z2;
+                    fine.stepWithIncrement(dw1, h);
+                    fine_path[2 * j] = fine.getPrice();
+                    fine.stepWithIncrement(dw2, h);
+                    fine_path[2 * j + 1] = fine.getPrice();
+                    coarse.stepWithIncrement(dw1 + dw2, 2.0 * h);
+                    coarse_path[j] = coarse.getPrice();
+                }
+                p_coarse = payoff(coarse_path.data(), fine_steps / 2);
+            }
+            double p_fine = payoff(fine_path.data(), fine_steps);
+            chunk.correction.add(p_fine - p_coarse);
+            chunk.fine.add(p_fine);
+        }
+    }, n_threads);
+    for (const LevelStats &chunk : per_chunk)
+    {
+        stats.correction.merge(chunk.correction);
+        stats.fine.merge(chunk.fine);
+    }
+    stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Slope of -log2 y against l over the levels from 1 with y > 0, fallback if fewer than two
+static double decayRate(const std::vector<double> &y, double fallback)
+{
+    double n = 0.0;
+    double sx = 0.0;
+    double sy = 0.0;
+    double sxx = 0.0;
+    double sxy = 0.0;
+    for (size_t l = 1; l < y.size(); ++l)
+    {
+        if (y[l] > 0.0)
+        {
+            double v = -log2(y[l]);
+            n += 1.0;
+            sx += l;
+            sy += v;
+            sxx += (double)l * l;
+            sxy += l * v;
+        }
+    }
+    if (n < 2.0)
+    {
+        return fallback;
+    }
+    return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+MlmcResult estimateMlmc(const MonteCarloSimulation &mcs, const PathPayoff &payoff, const MlmcSettings &settings, int n_threads)
+{
+    double horizon = mcs.duration * mcs.increment;
+    if (!(settings.target_rmse > 0.0) || settings.base_steps < 1 || settings.max_level < 0 || settings.max_level > 30 || settings.warmup_samples < 2)
+    {
+        throw std::invalid_argument("MLMC needs a positive target, base steps, a level cap up to 30 and 2 warm up samples");
+    }
+    if (!(horizon > 0.0))
+    {
+        throw std::invalid_argument("MLMC needs a positive horizon (duration * increment)");
+    }
+    double eps2 = settings.target_rmse * settings.target_rmse;
+
+    std::vector<LevelStats> stats;
+    std::vector<long long> wanted;
+    std::vector<double> cost;
+    std::vector<double> variance;
+    double alpha = 1.0;
+    double beta = 1.0;
+    bool converged = false;
+    int finest = std::min(2, settings.max_level);
+    for (int l = 0; l <= finest; ++l)
+    {
+        LevelStats level = {RunningStats(), RunningStats(), 0.0};
+        stats.push_back(level);
+        wanted.push_back(settings.warmup_samples);
+        double steps = (double)settings.base_steps * (1LL << l);
+        cost.push_back(l == 0 ? steps : 1.5 * steps);
+    }
+
+    while (true)
+    {
+        for (int l = 0; l <= finest; ++l)
+        {
+            long long have = stats[l].correction.count();
+            if (wanted[l] > have)
+            {
+                runLevel(mcs, payoff, settings.base_steps, horizon, l, have, wanted[l] - have, stats[l], n_threads);
+            }
+        }
+
+        // Decay of the corrections, and their variances with the small samples of new levels floored by it
+        std::vector<double> means(finest + 1);
+        variance.assign(finest + 1, 0.0);
+        for (int l = 0; l <= finest; ++l)
+        {
+            means[l] = fabs(stats[l].correction.mean());
+            variance[l] = stats[l].correction.variance();
+        }
+        alpha = std::max(0.5, decayRate(means, 1.0));
+        beta = std::max(0.5, decayRate(variance, 1.0));
+        for (int l = 2; l <= finest; ++l)
+        {
+            variance[l] = std::max(variance[l], 0.5 * variance[l - 1] / pow(2.0, beta));
+        }
+
+        // Samples minimizing the cost for a variance of eps^2 / 2 (Lagrange multiplier)
+        double sum = 0.0;
+        for (int l = 0; l <= finest; ++l)
+        {
+            sum += sqrt(variance[l] * cost[l]);
+        }
+        bool more = false;
+        for (int l = 0; l <= finest; ++l)
+        {
+            long long optimal = (long long)ceil(2.0 / eps2 * sqrt(variance[l] / cost[l]) * sum);
+            wanted[l] = std::max(stats[l].correction.count(), optimal);
+            more = more || wanted[l] > stats[l].correction.count() + stats[l].correction.count() / 100;
+        }
+        if (more)
+        {
+            continue;
+        }
+
+        // Remaining bias from the last corrections, assuming they keep decaying as 2^-alpha
+        double ratio = pow(2.0, alpha);
+        double bias = means[finest] / (ratio - 1.0);
+        if (finest >= 1)
+        {
+            bias = std::max(bias, means[finest - 1] / (ratio * (ratio - 1.0)));
+        }
+        if (bias <= settings.target_rmse / sqrt(2.0))
+        {
+            converged = true;
+            break;
+        }
+        if (finest == settings.max_level)
+        {
+            break;
+        }
+        ++finest;
+        LevelStats level = {RunningStats(), RunningStats(), 0.0};
+        stats.push_back(level);
+        wanted.push_back(settings.warmup_samples);
+        cost.push_back(1.5 * settings.base_steps * (double)(1LL << finest));
+    }
+
+    MlmcResult result;
+    result.price = 0.0;
+    result.cost = 0.0;
+    double estimator_variance = 0.0;
+    for (int l = 0; l <= finest; ++l)
+    {
+        const LevelStats &s = stats[l];
+        MlmcLevel level;
+        level.steps = settings.base_steps << l;
+        level.samples = s.correction.count();
+        level.mean = s.correction.mean();
+        level.variance = s.correction.variance();
+        level.fine_variance = s.fine.variance();
+        level.cost_per_sample = cost[l];
+        level.seconds = s.seconds;
+        result.levels.push_back(level);
+        result.price += level.mean;
+        result.cost += level.samples * cost[l];
+        estimator_variance += level.variance / level.samples;
+    }
+    result.std_error = sqrt(estimator_variance);
+    double ratio = pow(2.0, alpha);
+    result.bias_estimate = fabs(result.levels[finest].mean) / (ratio - 1.0);
+    if (finest >= 1)
+    {
+        result.bias_estimate = std::max(result.bias_estimate, fabs(result.levels[finest - 1].mean) / (ratio * (ratio - 1.0)));
+    }
+    result.alpha = alpha;
+    result.beta = beta;
+    result.converged = converged;
+    // Plain Monte Carlo on the finest grid, with the same eps^2 / 2 left for the variance
+    result.single_level_cost = 2.0 * result.levels[finest].fine_variance / eps2 * result.levels[finest].steps;
+    return result;
+}
@@ -0,0 +1,58 @@
+#include <vector>
+#include "functions.h"
+#include "path_store.h"
+#ifndef MLMC_H
+#define MLMC_H
+
+/*
+Multilevel Monte Carlo (Giles) for payoffs that look at the whole path.
+Level l walks base_steps * 2^l steps. E[P_L] = E[P_0] + sum over l of E[P_l - P_{l-1}],
+and each correction is estimated on its own samples, where the fine and coarse path
+are two WeinerProcessSimulator paths driven by the same Brownian increments (a coarse
+increment is the sum of two fine ones). The corrections shrink with the step, so
+most samples are taken on the cheap coarse levels.
+Samples per level come from the variance and cost measured so far, to keep the
+estimator variance under rmse^2 / 2; levels are added until the estimated bias of
+the finest one is under rmse / sqrt(2). RMSE epsilon then costs about eps^-2 steps,
+against eps^-3 for plain Monte Carlo on a grid fine enough for the same bias.
+*/
+
+struct MlmcSettings
+{
+    double target_rmse;      // undiscounted, in price units
+    int base_steps;          // steps of level 0
+    int max_level;           // finest level allowed, base_steps * 2^max_level steps
+    long long warmup_samples; // per new level, before its variance is trusted
+};
+MlmcSettings defaultMlmcSettings();
+
+struct MlmcLevel
+{
+    int steps;               // fine steps of the level
+    long long samples;
+    double mean;             // of P_l - P_{l-1} (P_0 on level 0)
+    double variance;         // same, per sample
+    double fine_variance;    // of P_l alone
+    double cost_per_sample;  // steps walked, fine plus coarse
+    double seconds;          // wall time spent on the level
+};
+
+struct MlmcResult
+{
+    double price;             // undiscounted, like estimateOption
+    double std_error;
+    double bias_estimate;     // of the finest level, from the decay of the corrections
+    double alpha;             // fitted decay of |E[P_l - P_l-1]| ~ 2^(-alpha l)
+    double beta;              // fitted decay of Var[P_l - P_l-1] ~ 2^(-beta l)
+    bool converged;           // false when max_level was hit with the bias still too large
+    double cost;              // steps walked, all levels
+    double single_level_cost; // steps plain Monte Carlo would walk for the same error on the finest grid
+    std::vector<MlmcLevel> levels;
+};
+
+// Paths of mcs.stock over the horizon mcs.duration * mcs.increment (the steps themselves
+// are set by the levels), seeded by mcs.seed. payoff gets the price after every step,
+// S0 excluded, as with PathStore. Variance reduction settings of mcs aren't used.
+MlmcResult estimateMlmc(const MonteCarloSimulation &mcs, const PathPayoff &payoff, const MlmcSettings &settings, int n_threads);
+
+#endif //
@@ -0,0 +1,219 @@
+#include <stdexcept>
+#include "models.h"
+#include "exotics.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+LocalVolModel::LocalVolModel(double mu, const std::vector<double> &times, const std::vector<double> &spots, const std::vector<double> &vols) : mu(mu), times(times), vols(vols)
+{
+    if (times.empty() || spots.empty() || vols.size() != times.size() * spots.size())
+    {
+        throw std::invalid_argument("Local vol grid needs one vol per (time, spot) node");
+    }
+    if (!std::is_sorted(times.begin(), times.end()) || !std::is_sorted(spots.begin(), spots.end()) || !(spots[0] > 0.0))
+    {
+        throw std::invalid_argument("Local vol times and spots must be ascending, spots positive");
+    }
+    for (double s : spots)
+    {
+        log_spot.push_back(log(s));
+    }
+}
+
+
+namespace
+{
+// Philox blocks of the path batch being walked. A block holds two normals per path,
+// so with an odd NORMALS the last block of one step is the first of the next:
+// keeping it saves drawing it twice.
+struct BlockCache
+{
+    uint64_t block;
+    bool valid;
+    double z0[MODEL_BATCH];
+    double z1[MODEL_BATCH];
+};
+}
+
+// Normals of one step for a batch: z[k][p] = normal number first_index + k of path first_path + p
+template <int NORMALS>
+static void stepNormals(SimdLevel level, uint64_t seed, uint64_t first_path, int n, uint64_t first_index, BlockCache &cache, double (*z)[MODEL_BATCH])
+{
+    for (int k = 0; k < NORMALS; ++k)
+    {
+        uint64_t index = first_index + k;
+        if (!cache.valid || cache.block != index / 2)
+        {
+            philoxNormalBlock(level, seed, first_path, index / 2, n, cache.z0, cache.z1);
+            cache.block = index / 2;
+            cache.valid = true;
+        }
+        const double *from = (index % 2 == 0) ? cache.z0 : cache.z1;
+        std::copy(from, from + n, z[k]);
+    }
+}
+
+// The payoffs' controls have a closed form mean under GBM only
+template <class Payoff, class Model>
+static bool controlMean(const Payoff &, const Model &, const MonteCarloSimulation &, double &)
+{
+    return false;
+}
+
+template <class Payoff>
+static bool controlMean(const Payoff &payoff, const GbmModel &model, const MonteCarloSimulation &mcs, double &mean)
+{
+    mean = payoff.controlMean(mcs.stock.price, model.mu, model.sigma, mcs.increment, mcs.duration);
+    return true;
+}
+
+template <class Model, class Payoff>
+static void accumulatePolicyPaths(const MonteCarloSimulation &mcs, const Model &model, const Payoff &payoff, SimdLevel level, long long first_sample, long long count, EstimatorAccumulator &acc)
+{
+    const int K = Model::NORMALS;
+    bool antithetic = mcs.variance_reduction.antithetic;
+    double dt = mcs.increment;
+    double log_s0 = log(mcs.stock.price);
+    int steps = mcs.duration;
+    typename Model::State state;
+    typename Model::State mirror;
+    typename Payoff::State watched;
+    typename Payoff::State watched_mirror;
+    BlockCache cache;
+    double z[K][MODEL_BATCH];
+    double negated[K][MODEL_BATCH];
+    double prev[MODEL_BATCH];
+    double bridge_var[MODEL_BATCH];
+    const double *draws[K];
+    const double *mirrored_draws[K];
+    for (int k = 0; k < K; ++k)
+    {
+        draws[k] = z[k];
+        mirrored_draws[k] = negated[k];
+    }
+    MC_METRIC_SCOPE(STAGE_STEP); // observe() included
+    MC_METRIC_COUNT(COUNTER_PATHS, antithetic ? 2 * count : count);
+
+    for (long long done = 0; done < count; done += MODEL_BATCH)
+    {
+        int n = (int)std::min((long long)MODEL_BATCH, count - done);
+        uint64_t path = (uint64_t)(first_sample + done);
+        model.start(state, mcs.stock.price, n);
+        model.start(mirror, mcs.stock.price, n);
+        payoff.start(watched, log_s0, n);
+        payoff.start(watched_mirror, log_s0, n);
+        cache.valid = false;
+        for (int t = 0; t < steps; ++t)
+        {
+            double time = t * dt;
+            stepNormals<K>(level, mcs.seed, path, n, (uint64_t)t * K, cache, z);
+            if (Payoff::BRIDGE)
+            {
+                model.bridgeVariance(state, n, time, dt, bridge_var);
+            }
+            std::copy(state.log_s, state.log_s + n, prev);
+            model.step(state, n, time, dt, draws);
+            payoff.observe(watched, n, prev, state.log_s, bridge_var);
+            if (antithetic)
+            {
+                for (int k = 0; k < K; ++k)
+                {
+                    for (int p = 0; p < n; ++p)
+                    {
+                        negated[k][p] = -z[k][p];
+                    }
+                }
+                if (Payoff::BRIDGE)
+                {
+                    model.bridgeVariance(mirror, n, time, dt, bridge_var);
+                }
+                std::copy(mirror.log_s, mirror.log_s + n, prev);
+                model.step(mirror, n, time, dt, mirrored_draws);
+                payoff.observe(watched_mirror, n, prev, mirror.log_s, bridge_var);
+            }
+        }
+        MC_METRIC_SCOPE(STAGE_PAYOFF);
+        for (int p = 0; p < n; ++p)
+        {
+            double y = payoff.value(watched, p, state.log_s[p], steps);
+            double x = payoff.control(watched, p, steps);
+            acc.addPath(y);
+            if (antithetic)
+            {
+                double mirrored = payoff.value(watched_mirror, p, mirror.log_s[p], steps);
+                acc.addPath(mirrored);
+                y = 0.5 * (y + mirrored);
+                x = 0.5 * (x + payoff.control(watched_mirror, p, steps));
+            }
+            acc.addSample(y, x);
+        }
+    }
+}
+
+template <class Model, class Payoff>
+MonteCarloResult estimatePathOption(const MonteCarloSimulation &mcs, const Model &model, const Payoff &payoff, int n_threads)
+{
+    if (mcs.duration < 1 || !(mcs.increment > 0.0))
+    {
+        throw std::invalid_argument("Model paths need at least one step of positive length");
+    }
+    if (!(mcs.stock.price > 0.0))
+    {
+        throw std::invalid_argument("Model paths need a positive spot");
+    }
+    double control_mean = 0.0;
+    bool use_control = Payoff::HAS_CONTROL && mcs.variance_reduction.control != CV_NONE && controlMean(payoff, model, mcs, control_mean);
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    SimdLevel level = detectSimdLevel();
+
+    // One accumulator per fixed slice, merged in order: same result at any thread count
+    long long total = mcs.sampleCount();
+    std::vector<EstimatorAccumulator> per_slice((size_t)((total + SAMPLE_SLICE - 1) / SAMPLE_SLICE), EstimatorAccumulator(use_control, control_mean));
+    pool->parallelFor(total, SAMPLE_SLICE, [&](int, long long begin, long long end) {
+        accumulatePolicyPaths(mcs, model, payoff, level, begin, end - begin, per_slice[begin / SAMPLE_SLICE]);
+    }, n_threads);
+
+    EstimatorAccumulator acc(use_control, control_mean);
+    {
+        MC_METRIC_SCOPE(STAGE_REDUCE);
+        for (const EstimatorAccumulator &slice : per_slice)
+        {
+            acc.merge(slice);
+        }
+    }
+    if (acc.paths() == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate option");
+    }
+    return makeResult(acc, PRICING_STEPPED);
+}
+
+template <class Model>
+MonteCarloResult estimateOptionWithModel(const MonteCarloSimulation &mcs, const Model &model, const Option &option, int n_threads)
+{
+    VanillaPayoff payoff;
+    payoff.option = option;
+    return estimatePathOption(mcs, model, payoff, n_threads);
+}
+
+template MonteCarloResult estimateOptionWithModel<GbmModel>(const MonteCarloSimulation &, const GbmModel &, const Option &, int);
+template MonteCarloResult estimateOptionWithModel<HestonModel>(const MonteCarloSimulation &, const HestonModel &, const Option &, int);
+template MonteCarloResult estimateOptionWithModel<MertonModel>(const MonteCarloSimulation &, const MertonModel &, const Option &, int);
+template MonteCarloResult estimateOptionWithModel<LocalVolModel>(const MonteCarloSimulation &, const LocalVolModel &, const Option &, int);
+
+// Every model with every payoff
+#define INSTANTIATE_PATH_OPTION(Payoff) \
+    template MonteCarloResult estimatePathOption<GbmModel, Payoff>(const MonteCarloSimulation &, const GbmModel &, const Payoff &, int); \
+    template MonteCarloResult estimatePathOption<HestonModel, Payoff>(const MonteCarloSimulation &, const HestonModel &, const Payoff &, int); \
+    template MonteCarloResult estimatePathOption<MertonModel, Payoff>(const MonteCarloSimulation &, const MertonModel &, const Payoff &, int); \
+    template MonteCarloResult estimatePathOption<LocalVolModel, Payoff>(const MonteCarloSimulation &, const LocalVolModel &, const Payoff &, int);
+
+INSTANTIATE_PATH_OPTION(VanillaPayoff)
+INSTANTIATE_PATH_OPTION(ArithmeticAsianPayoff)
+INSTANTIATE_PATH_OPTION(GeometricAsianPayoff)
+INSTANTIATE_PATH_OPTION(UpAndOutPayoff)
+INSTANTIATE_PATH_OPTION(UpAndInPayoff)
+INSTANTIATE_PATH_OPTION(DownAndOutPayoff)
+INSTANTIATE_PATH_OPTION(DownAndInPayoff)
+INSTANTIATE_PATH_OPTION(FloatingLookbackPayoff)
+INSTANTIATE_PATH_OPTION(FixedLookbackPayoff)
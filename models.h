@@ -0,0 +1,269 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "functions.h"
+#ifndef MODELS_H
+#define MODELS_H
+
+/*
+Dynamics and payoffs as compile time policies for estimatePathOption.
+A model says how many normals a step needs (NORMALS), keeps the state of a batch
+of paths in its State, log prices in log_s, and moves it one step in step(), over
+the whole batch. bridgeVariance() gives the variance of the log price diffusion
+over the step about to be taken, for payoffs watching a brownian bridge.
+A payoff keeps what it needs of the paths in its own State, updated by observe()
+after every step from the log prices before and after it (see exotics.h).
+The engine is instantiated once per (model, payoff) pair, so the step loop has no
+virtual call. Normal k of step t of a path is normal number t * NORMALS + k of its
+Philox substream: GbmModel gives exactly the paths of GbmPathEngine, bit for bit.
+*/
+
+static const int MODEL_BATCH = GbmPathEngine::BATCH;
+
+// Geometric brownian motion, the reference
+struct GbmModel
+{
+    static const int NORMALS = 1;
+    double mu;
+    double sigma;
+
+    struct State
+    {
+        double log_s[MODEL_BATCH];
+    };
+
+    void start(State &state, double s0, int n) const
+    {
+        std::fill(state.log_s, state.log_s + n, log(s0));
+    }
+    void step(State &state, int n, double t, double dt, const double *const *z) const
+    {
+        (void)t;
+        gbmAdvance(detectSimdLevel(), state.log_s, z[0], n, (mu - 0.5 * sigma * sigma) * dt, sigma * sqrt(dt));
+    }
+    void bridgeVariance(const State &, int n, double, double dt, double *var) const
+    {
+        std::fill(var, var + n, sigma * sigma * dt);
+    }
+};
+
+// Heston stochastic variance, Andersen's quadratic exponential (QE) scheme
+struct HestonModel
+{
+    static const int NORMALS = 2;
+    double mu;
+    double v0;    // initial variance
+    double kappa; // mean reversion speed
+    double theta; // long run variance
+    double xi;    // vol of variance
+    double rho;   // correlation of the price and variance drivers
+
+    struct State
+    {
+        double log_s[MODEL_BATCH];
+        double v[MODEL_BATCH];
+    };
+
+    void start(State &state, double s0, int n) const
+    {
+        std::fill(state.log_s, state.log_s + n, log(s0));
+        std::fill(state.v, state.v + n, v0);
+    }
+    void step(State &state, int n, double t, double dt, const double *const *z) const
+    {
+        (void)t;
+        static const double PSI_SWITCH = 1.5;
+        double decay = exp(-kappa * dt);
+        double var_a = xi * xi * decay * (1.0 - decay) / kappa;
+        double var_b = theta * xi * xi * (1.0 - decay) * (1.0 - decay) / (2.0 * kappa);
+        // Log price with the trapezoidal rule on the variance (gamma1 = gamma2 = 1/2)
+        double k0 = -rho * kappa * theta * dt / xi;
+        double k1 = 0.5 * dt * (kappa * rho / xi - 0.5) - rho / xi;
+        double k2 = 0.5 * dt * (kappa * rho / xi - 0.5) + rho / xi;
+        double k3 = 0.5 * dt * (1.0 - rho * rho);
+        for (int p = 0; p < n; ++p)
+        {
+            double v = state.v[p];
+            double m = theta + (v - theta) * decay;
+            double s2 = v * var_a + var_b;
+            double psi = s2 / (m * m);
+            double next;
+            if (psi <= PSI_SWITCH)
+            {
+                // Moment matched square of a shifted normal
+                double inv = 2.0 / psi;
+                double b2 = inv - 1.0 + sqrt(inv) * sqrt(inv - 1.0);
+                double a = m / (1.0 + b2);
+                double x = sqrt(b2) + z[0][p];
+                next = a * x * x;
+            }
+            else
+            {
+                // Mass at 0 plus an exponential tail, uniform from the same normal
+                double prob = (psi - 1.0) / (psi + 1.0);
+                double beta = (1.0 - prob) / m;
+                double u = normalCDF(z[0][p]);
+                next = (u <= prob) ? 0.0 : log((1.0 - prob) / (1.0 - u)) / beta;
+            }
+            state.log_s[p] += mu * dt + k0 + k1 * v + k2 * next + sqrt(k3 * (v + next)) * z[1][p];
+            state.v[p] = next;
+        }
+    }
+    // From the variance at the start of the step, kept off 0 where the QE scheme put it
+    void bridgeVariance(const State &state, int n, double, double dt, double *var) const
+    {
+        for (int p = 0; p < n; ++p)
+        {
+            var[p] = std::max(state.v[p], 1e-12) * dt;
+        }
+    }
+};
+
+// Merton jump diffusion: GBM plus Poisson(lambda) jumps with N(jump_mean, jump_vol^2) log sizes.
+// The drift is compensated, E[S_t] = S0 exp(mu t) as without jumps.
+struct MertonModel
+{
+    static const int NORMALS = 3;
+    static const int MAX_JUMPS = 64; // per step, far in the tail for any sane lambda dt
+    double mu;
+    double sigma;
+    double lambda;
+    double jump_mean;
+    double jump_vol;
+
+    struct State
+    {
+        double log_s[MODEL_BATCH];
+    };
+
+    void start(State &state, double s0, int n) const
+    {
+        std::fill(state.log_s, state.log_s + n, log(s0));
+    }
+    void step(State &state, int n, double t, double dt, const double *const *z) const
+    {
+        (void)t;
+        double compensator = lambda * (exp(jump_mean + 0.5 * jump_vol * jump_vol) - 1.0);
+        double drift = (mu - 0.5 * sigma * sigma - compensator) * dt;
+        double vol = sigma * sqrt(dt);
+        double no_jump = exp(-lambda * dt);
+        for (int p = 0; p < n; ++p)
+        {
+            // Jump count by inversion of the Poisson law, uniform from the second normal
+            double u = normalCDF(z[1][p]);
+            double term = no_jump;
+            double cumulative = term;
+            int jumps = 0;
+            while (u > cumulative && jumps < MAX_JUMPS)
+            {
+                ++jumps;
+                term *= lambda * dt / jumps;
+                cumulative += term;
+            }
+            double jump = jumps * jump_mean + sqrt((double)jumps) * jump_vol * z[2][p];
+            state.log_s[p] += drift + vol * z[0][p] + jump;
+        }
+    }
+    // The diffusion only: a jump that crosses a barrier and back within one step is missed
+    void bridgeVariance(const State &, int n, double, double dt, double *var) const
+    {
+        std::fill(var, var + n, sigma * sigma * dt);
+    }
+};
+
+// Local volatility sigma(t, S) bilinear in (t, log S) on a grid, flat outside it (Euler in log S)
+struct LocalVolModel
+{
+    static const int NORMALS = 1;
+    double mu;
+    std::vector<double> times;    // ascending
+    std::vector<double> log_spot; // ascending
+    std::vector<double> vols;     // vols[i * log_spot.size() + j] at times[i], log_spot[j]
+
+    LocalVolModel(double mu, const std::vector<double> &times, const std::vector<double> &spots, const std::vector<double> &vols);
+
+    struct State
+    {
+        double log_s[MODEL_BATCH];
+    };
+
+    void start(State &state, double s0, int n) const
+    {
+        std::fill(state.log_s, state.log_s + n, log(s0));
+    }
+    void step(State &state, int n, double t, double dt, const double *const *z) const
+    {
+        double sigma[MODEL_BATCH];
+        localVols(state, n, t, sigma);
+        double sqrt_dt = sqrt(dt);
+        for (int p = 0; p < n; ++p)
+        {
+            state.log_s[p] += (mu - 0.5 * sigma[p] * sigma[p]) * dt + sigma[p] * sqrt_dt * z[0][p];
+        }
+    }
+    void bridgeVariance(const State &state, int n, double t, double dt, double *var) const
+    {
+        localVols(state, n, t, var);
+        for (int p = 0; p < n; ++p)
+        {
+            var[p] *= var[p] * dt;
+        }
+    }
+    void localVols(const State &state, int n, double t, double *sigma) const
+    {
+        // Time interpolation is the same for the whole batch
+        size_t nt = times.size();
+        size_t ns = log_spot.size();
+        size_t i = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+        size_t i0 = (i == 0) ? 0 : i - 1;
+        size_t i1 = std::min(i, nt - 1);
+        double wt = (i0 == i1) ? 0.0 : (t - times[i0]) / (times[i1] - times[i0]);
+        const double *row0 = &vols[i0 * ns];
+        const double *row1 = &vols[i1 * ns];
+        for (int p = 0; p < n; ++p)
+        {
+            double x = state.log_s[p];
+            size_t j = std::upper_bound(log_spot.begin(), log_spot.end(), x) - log_spot.begin();
+            size_t j0 = (j == 0) ? 0 : j - 1;
+            size_t j1 = std::min(j, ns - 1);
+            double ws = (j0 == j1) ? 0.0 : (x - log_spot[j0]) / (log_spot[j1] - log_spot[j0]);
+            double v0 = row0[j0] + ws * (row0[j1] - row0[j0]);
+            double v1 = row1[j0] + ws * (row1[j1] - row1[j0]);
+            sigma[p] = v0 + wt * (v1 - v0);
+        }
+    }
+};
+
+// Vanilla on S_T, the payoff of estimateOptionWithModel
+struct VanillaPayoff
+{
+    static const bool HAS_CONTROL = false;
+    static const bool BRIDGE = false;
+    Option option;
+
+    struct State
+    {
+    };
+
+    void start(State &, double, int) const {}
+    void observe(State &, int, const double *, const double *, const double *) const {}
+    double value(const State &, int, double log_s, int) const { return optionPayoff(option, exp(log_s)); }
+    double control(const State &, int, int) const { return 0.0; }
+    double controlMean(double, double, double, double, int) const { return 0.0; }
+};
+
+// Paths of model from mcs.stock.price over mcs.duration steps of mcs.increment, seeded by
+// mcs.seed, with mcs.iterations and its antithetics, valued by payoff. Any control variate
+// setting turns on the payoff's own control when it has one (HAS_CONTROL) and the model
+// gives it a closed form mean, which is under GbmModel only. Moment matching isn't used.
+// Undiscounted like estimateOption, and the same result at any thread count.
+// Instantiated in models.cpp for the four models above with VanillaPayoff and every
+// payoff of exotics.h.
+template <class Model, class Payoff>
+MonteCarloResult estimatePathOption(const MonteCarloSimulation &mcs, const Model &model, const Payoff &payoff, int n_threads);
+
+// estimatePathOption with VanillaPayoff. Instantiated for the four models above.
+template <class Model>
+MonteCarloResult estimateOptionWithModel(const MonteCarloSimulation &mcs, const Model &model, const Option &option, int n_threads);
+
+#endif //
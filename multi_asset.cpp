@@ -0,0 +1,266 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "multi_asset.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+std::vector<double> choleskyFactor(const std::vector<double> &c, int n)
+{
+    if (n < 1 || c.size() != (size_t)n * n)
+    {
+        throw std::invalid_argument("Correlation matrix must be n x n");
+    }
+    std::vector<double> l((size_t)n * n, 0.0);
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j <= i; ++j)
+        {
+            if (fabs(c[i * n + j] - c[j * n + i]) > 1e-12)
+            {
+                throw std::invalid_argument("Correlation matrix must be symmetric");
+            }
+            double sum = c[i * n + j];
+            for (int k = 0; k < j; ++k)
+            {
+                sum -= l[i * n + k] * l[j * n + k];
+            }
+            if (i == j)
+            {
+                if (!(sum > 0.0))
+                {
+                    throw std::invalid_argument("Correlation matrix must be positive definite");
+                }
+                l[i * n + i] = sqrt(sum);
+            }
+            else
+            {
+                l[i * n + j] = sum / l[j * n + j];
+            }
+        }
+    }
+    return l;
+}
+
+double multiAssetPayoff(const MultiAssetOption &option, const double *final_prices, int n_assets)
+{
+    double value = 0.0;
+    switch (option.type)
+    {
+    case MULTI_BASKET:
+        for (int i = 0; i < n_assets; ++i)
+        {
+            value += (option.weights.empty() ? 1.0 / n_assets : option.weights[i]) * final_prices[i];
+        }
+        break;
+    case MULTI_SPREAD:
+        value = final_prices[0] - final_prices[1];
+        break;
+    case MULTI_BEST_OF:
+        value = *std::max_element(final_prices, final_prices + n_assets);
+        break;
+    case MULTI_WORST_OF:
+        value = *std::min_element(final_prices, final_prices + n_assets);
+        break;
+    }
+    return option.call ? std::max(value - option.strike, 0.0) : std::max(option.strike - value, 0.0);
+}
+
+MultiAssetEngine::MultiAssetEngine(const std::vector<Asset> &assets, const std::vector<double> &correlation, double dt, int steps, uint64_t seed) : d((int)assets.size()), steps(steps), seed(seed), level(detectSimdLevel())
+{
+    std::vector<double> l = choleskyFactor(correlation, d);
+    double t = dt * steps;
+    for (int i = 0; i < d; ++i)
+    {
+        const Asset &asset = assets[i];
+        double ito = asset.drift - 0.5 * asset.volatility * asset.volatility;
+        log_s0.push_back(log(asset.price));
+        drift_dt.push_back(ito * dt);
+        drift_t.push_back(ito * t);
+        for (int j = 0; j <= i; ++j)
+        {
+            vol_chol_dt.push_back(asset.volatility * sqrt(dt) * l[i * d + j]);
+            vol_chol_t.push_back(asset.volatility * sqrt(t) * l[i * d + j]);
+        }
+    }
+}
+
+// z[i * BATCH + p]: normal number first_index + i of path first_path + p, i < d
+void MultiAssetEngine::normals(uint64_t first_path, int n, uint64_t first_index, double *z) const
+{
+    double z0[BATCH];
+    double z1[BATCH];
+    for (int i = 0; i < d;)
+    {
+        uint64_t index = first_index + i;
+        philoxNormalBlock(level, seed, first_path, index / 2, n, z0, z1);
+        if (index % 2 == 0)
+        {
+            std::copy(z0, z0 + n, z + (size_t)i * BATCH);
+            ++i;
+        }
+        if (i < d)
+        {
+            std::copy(z1, z1 + n, z + (size_t)i * BATCH);
+            ++i;
+        }
+    }
+}
+
+// log_s_i += drift_i + sign * sum_j vol_chol_ij z_j, a row of BATCH paths at a time
+void MultiAssetEngine::advance(double *log_s, const double *z, int n, const std::vector<double> &drift, const std::vector<double> &vol_chol, double sign) const
+{
+    const double *row = vol_chol.data();
+    for (int i = 0; i < d; ++i)
+    {
+        double *target = log_s + (size_t)i * BATCH;
+        gbmAdvance(level, target, z, n, drift[i], sign * row[0]);
+        for (int j = 1; j <= i; ++j)
+        {
+            gbmAdvance(level, target, z + (size_t)j * BATCH, n, 0.0, sign * row[j]);
+        }
+        row += i + 1;
+    }
+}
+
+void MultiAssetEngine::simulateTerminal(uint64_t first_path, int count, double *terminal, double *antithetic) const
+{
+    std::vector<double> log_s((size_t)d * BATCH);
+    std::vector<double> log_a((size_t)d * BATCH);
+    std::vector<double> z((size_t)d * BATCH);
+
+    for (int done = 0; done < count; done += BATCH)
+    {
+        int n = std::min(BATCH, count - done);
+        for (int i = 0; i < d; ++i)
+        {
+            std::fill(&log_s[(size_t)i * BATCH], &log_s[(size_t)i * BATCH] + n, log_s0[i]);
+            std::fill(&log_a[(size_t)i * BATCH], &log_a[(size_t)i * BATCH] + n, log_s0[i]);
+        }
+        for (int t = 0; t < steps; ++t)
+        {
+            normals(first_path + done, n, (uint64_t)t * d, z.data());
+            advance(log_s.data(), z.data(), n, drift_dt, vol_chol_dt, 1.0);
+            if (antithetic != NULL)
+            {
+                advance(log_a.data(), z.data(), n, drift_dt, vol_chol_dt, -1.0);
+            }
+        }
+        for (int p = 0; p < n; ++p)
+        {
+            for (int i = 0; i < d; ++i)
+            {
+                terminal[(size_t)(done + p) * d + i] = exp(log_s[(size_t)i * BATCH + p]);
+                if (antithetic != NULL)
+                {
+                    antithetic[(size_t)(done + p) * d + i] = exp(log_a[(size_t)i * BATCH + p]);
+                }
+            }
+        }
+    }
+}
+
+void MultiAssetEngine::simulateTerminalExact(uint64_t first_path, int count, double *terminal, double *antithetic) const
+{
+    std::vector<double> log_s((size_t)d * BATCH);
+    std::vector<double> log_a((size_t)d * BATCH);
+    std::vector<double> z((size_t)d * BATCH);
+
+    for (int done = 0; done < count; done += BATCH)
+    {
+        int n = std::min(BATCH, count - done);
+        for (int i = 0; i < d; ++i)
+        {
+            std::fill(&log_s[(size_t)i * BATCH], &log_s[(size_t)i * BATCH] + n, log_s0[i]);
+            std::fill(&log_a[(size_t)i * BATCH], &log_a[(size_t)i * BATCH] + n, log_s0[i]);
+        }
+        normals(first_path + done, n, 0, z.data());
+        advance(log_s.data(), z.data(), n, drift_t, vol_chol_t, 1.0);
+        if (antithetic != NULL)
+        {
+            advance(log_a.data(), z.data(), n, drift_t, vol_chol_t, -1.0);
+        }
+        for (int p = 0; p < n; ++p)
+        {
+            for (int i = 0; i < d; ++i)
+            {
+                terminal[(size_t)(done + p) * d + i] = exp(log_s[(size_t)i * BATCH + p]);
+                if (antithetic != NULL)
+                {
+                    antithetic[(size_t)(done + p) * d + i] = exp(log_a[(size_t)i * BATCH + p]);
+                }
+            }
+        }
+    }
+}
+
+MultiAssetSimulation::MultiAssetSimulation(int iter, int durat, double dt, const std::vector<Asset> &assets, const std::vector<double> &correlation, uint64_t seed) : iterations(iter), duration(durat), increment(dt), assets(assets), correlation(correlation), seed(seed), mode(PRICING_AUTO), antithetic(false) {}
+
+MultiAssetEngine MultiAssetSimulation::engine() const
+{
+    return MultiAssetEngine(assets, correlation, increment, duration, seed);
+}
+
+MonteCarloResult MultiAssetSimulation::estimateOption(const MultiAssetOption &option, int n_threads) const
+{
+    int d = (int)assets.size();
+    if (option.type == MULTI_SPREAD && d < 2)
+    {
+        throw std::invalid_argument("Spread option needs two assets");
+    }
+    if (option.type == MULTI_BASKET && !option.weights.empty() && (int)option.weights.size() != d)
+    {
+        throw std::invalid_argument("Basket needs one weight per asset");
+    }
+    MultiAssetEngine paths = engine();
+    PricingMode used = (mode == PRICING_STEPPED) ? PRICING_STEPPED : PRICING_EXACT_TERMINAL;
+    long long samples = antithetic ? (iterations + 1) / 2 : iterations;
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    // One accumulator per fixed slice of whole batches, merged in order: same
+    // result at any thread count
+    const long long chunk = SAMPLE_SLICE;
+    std::vector<RunningStats> per_chunk((size_t)((samples + chunk - 1) / chunk));
+    pool->parallelFor(samples, chunk, [&](int, long long begin, long long end) {
+        RunningStats &stats = per_chunk[begin / chunk];
+        MC_METRIC_SCOPE(STAGE_STEP); // payoffs included, the draws are charged to STAGE_RNG
+        MC_METRIC_COUNT(COUNTER_PATHS, antithetic ? 2 * (end - begin) : end - begin);
+        std::vector<double> final_prices((size_t)MultiAssetEngine::BATCH * d);
+        std::vector<double> mirrored(antithetic ? final_prices.size() : 0);
+        for (long long first = begin; first < end; first += MultiAssetEngine::BATCH)
+        {
+            int n = (int)std::min((long long)MultiAssetEngine::BATCH, end - first);
+            double *mirror = antithetic ? mirrored.data() : NULL;
+            if (used == PRICING_EXACT_TERMINAL)
+            {
+                paths.simulateTerminalExact((uint64_t)first, n, final_prices.data(), mirror);
+            }
+            else
+            {
+                paths.simulateTerminal((uint64_t)first, n, final_prices.data(), mirror);
+            }
+            for (int p = 0; p < n; ++p)
+            {
+                double payoff = multiAssetPayoff(option, &final_prices[(size_t)p * d], d);
+                if (antithetic)
+                {
+                    payoff = 0.5 * (payoff + multiAssetPayoff(option, &mirrored[(size_t)p * d], d));
+                }
+                stats.add(payoff);
+            }
+        }
+    }, n_threads);
+
+    RunningStats stats;
+    for (const RunningStats &s : per_chunk)
+    {
+        stats.merge(s);
+    }
+    if (stats.count() == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate option");
+    }
+    MonteCarloResult result = makeResult(stats, used);
+    result.paths = samples * (antithetic ? 2 : 1);
+    return result;
+}
@@ -0,0 +1,88 @@
+#include <vector>
+#include <cstdint>
+#include "functions.h"
+#ifndef MULTI_ASSET_H
+#define MULTI_ASSET_H
+
+/*
+Correlated geometric brownian motions for several assets.
+The correlation matrix is factorized once (Cholesky, C = L L^T) and every step
+turns d independent normals z into L z. Paths go BATCH at a time, one row of
+BATCH log prices per asset, and each term L_ij z_j is one gbmAdvance call over
+the batch, so the transform runs on the vector kernels.
+Normal number k of a path (step k / d, asset k % d) comes from its Philox substream,
+with a single asset this gives the same paths as GbmPathEngine.
+*/
+
+enum MultiAssetPayoffType
+{
+    MULTI_BASKET,   // sum of weights[i] * S_i
+    MULTI_SPREAD,   // S_0 - S_1
+    MULTI_BEST_OF,  // max of the S_i
+    MULTI_WORST_OF  // min of the S_i
+};
+
+struct MultiAssetOption
+{
+    MultiAssetPayoffType type;
+    bool call;
+    double strike;
+    std::vector<double> weights; // basket only, empty means equal weights summing to 1
+};
+
+double multiAssetPayoff(const MultiAssetOption &option, const double *final_prices, int n_assets);
+
+class MultiAssetEngine
+{
+private:
+    int d;
+    std::vector<double> log_s0;
+    std::vector<double> drift_dt;    // per asset
+    std::vector<double> vol_chol_dt; // sigma_i sqrt(dt) L_ij, lower triangle row major
+    std::vector<double> drift_t;
+    std::vector<double> vol_chol_t; // same over the whole horizon
+    int steps;
+    uint64_t seed;
+    SimdLevel level;
+
+    void normals(uint64_t first_path, int n, uint64_t first_index, double *z) const;
+    void advance(double *log_s, const double *z, int n, const std::vector<double> &drift, const std::vector<double> &vol_chol, double sign) const;
+
+public:
+    static const int BATCH = 64;
+
+    // correlation is d x d row major, symmetric with a unit diagonal and positive definite
+    MultiAssetEngine(const std::vector<Asset> &assets, const std::vector<double> &correlation, double dt, int steps, uint64_t seed);
+
+    int assets() const { return d; }
+
+    // Final prices of paths [first_path, first_path + count), terminal[p * assets() + i] for asset i.
+    // antithetic, if given, gets the mirrored paths.
+    void simulateTerminal(uint64_t first_path, int count, double *terminal, double *antithetic = NULL) const;
+    // Same with one correlated lognormal draw per path instead of walking the steps
+    void simulateTerminalExact(uint64_t first_path, int count, double *terminal, double *antithetic = NULL) const;
+};
+
+// Lower triangular L with L L^T = c (n x n row major), throws if c isn't positive definite
+std::vector<double> choleskyFactor(const std::vector<double> &c, int n);
+
+class MultiAssetSimulation
+{
+public:
+    int iterations;
+    int duration;
+    double increment;
+    std::vector<Asset> assets;
+    std::vector<double> correlation;
+    uint64_t seed;
+    PricingMode mode; // AUTO means exact terminal, every payoff above only looks at S_T
+    bool antithetic;
+
+    MultiAssetSimulation(int iter, int durat, double dt, const std::vector<Asset> &assets, const std::vector<double> &correlation, uint64_t seed = randomSeed());
+
+    MultiAssetEngine engine() const;
+    // Undiscounted mean payoff, like MonteCarloSimulation::estimateOption
+    MonteCarloResult estimateOption(const MultiAssetOption &option, int n_threads) const;
+};
+
+#endif //
@@ -0,0 +1,253 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "path_engine.h"
+#include "rng.h"
+#include "metrics.h"
+#if MC_X86
+#include <immintrin.h>
+#endif
+
+static void gbmAdvanceScalar(double *log_s, const double *z, int n, double drift, double vol)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        log_s[i] += drift + vol * z[i];
+    }
+}
+
+#if MC_X86
+// No fma: every level rounds like the scalar loop, so the paths don't depend on the machine
+__attribute__((target("avx2"))) static void gbmAdvanceAvx2(double *log_s, const double *z, int n, double drift, double vol)
+{
+    __m256d d = _mm256_set1_pd(drift);
+    __m256d v = _mm256_set1_pd(vol);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(log_s + i);
+        __m256d step = _mm256_add_pd(_mm256_mul_pd(v, _mm256_loadu_pd(z + i)), d);
+        _mm256_storeu_pd(log_s + i, _mm256_add_pd(x, step));
+    }
+    gbmAdvanceScalar(log_s + i, z + i, n - i, drift, vol);
+}
+
+__attribute__((target("avx512f"))) static void gbmAdvanceAvx512(double *log_s, const double *z, int n, double drift, double vol)
+{
+    __m512d d = _mm512_set1_pd(drift);
+    __m512d v = _mm512_set1_pd(vol);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512d x = _mm512_loadu_pd(log_s + i);
+        __m512d step = _mm512_add_pd(_mm512_mul_pd(v, _mm512_loadu_pd(z + i)), d);
+        _mm512_storeu_pd(log_s + i, _mm512_add_pd(x, step));
+    }
+    gbmAdvanceScalar(log_s + i, z + i, n - i, drift, vol);
+}
+#endif
+
+void gbmAdvance(SimdLevel level, double *log_s, const double *z, int n, double drift, double vol)
+{
+#if MC_X86
+    if (level == SIMD_AVX512)
+    {
+        gbmAdvanceAvx512(log_s, z, n, drift, vol);
+        return;
+    }
+    if (level == SIMD_AVX2)
+    {
+        gbmAdvanceAvx2(log_s, z, n, drift, vol);
+        return;
+    }
+#endif
+    (void)level;
+    gbmAdvanceScalar(log_s, z, n, drift, vol);
+}
+
+GbmPathEngine::GbmPathEngine(double s0, double mu, double sigma, double dt, int steps, uint64_t seed) : log_s0(log(s0)), drift_dt((mu - 0.5 * sigma * sigma) * dt), vol_sqrt_dt(sigma * sqrt(dt)), drift_t((mu - 0.5 * sigma * sigma) * dt * steps), vol_sqrt_t(sigma * sqrt(dt * steps)), steps(steps), seed(seed), level(detectSimdLevel()), moment_matching(false) {}
+
+// Mean and 1 / standard deviation of the draws of every step over the MOMENT_GROUP paths
+// from first_path, index 2 b + half for the step drawn as half of Philox block b
+static void groupMoments(SimdLevel level, uint64_t seed, uint64_t first_path, int blocks, double *mean, double *scale)
+{
+    const int BATCH = GbmPathEngine::BATCH;
+    const int GROUP = GbmPathEngine::MOMENT_GROUP;
+    double z_even[BATCH];
+    double z_odd[BATCH];
+    std::fill(mean, mean + 2 * blocks, 0.0);
+    std::fill(scale, scale + 2 * blocks, 0.0); // sums of squares until the end
+    for (int done = 0; done < GROUP; done += BATCH)
+    {
+        for (int b = 0; b < blocks; ++b)
+        {
+            philoxNormalBlock(level, seed, first_path + done, (uint64_t)b, BATCH, z_even, z_odd);
+            for (int p = 0; p < BATCH; ++p)
+            {
+                mean[2 * b] += z_even[p];
+                scale[2 * b] += z_even[p] * z_even[p];
+                mean[2 * b + 1] += z_odd[p];
+                scale[2 * b + 1] += z_odd[p] * z_odd[p];
+            }
+        }
+    }
+    for (int k = 0; k < 2 * blocks; ++k)
+    {
+        mean[k] /= GROUP;
+        double var = scale[k] / GROUP - mean[k] * mean[k];
+        scale[k] = (var > 0.0) ? 1.0 / sqrt(var) : 1.0;
+    }
+}
+
+static void applyMoments(double *z, int n, double mean, double scale)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        z[i] = (z[i] - mean) * scale;
+    }
+}
+
+// Paths of the next batch from path, cut at the end of a moment matching group
+static int batchLength(bool moment_matching, uint64_t path, int left)
+{
+    int n = std::min(GbmPathEngine::BATCH, left);
+    if (moment_matching)
+    {
+        n = (int)std::min<uint64_t>((uint64_t)n, GbmPathEngine::MOMENT_GROUP - path % GbmPathEngine::MOMENT_GROUP);
+    }
+    return n;
+}
+
+void GbmPathEngine::simulateTerminal(uint64_t first_path, int count, double *terminal, double *antithetic) const
+{
+    // A single stored point per path, after the last step
+    simulatePaths(first_path, count, std::max(steps, 1), terminal, antithetic);
+}
+
+int GbmPathEngine::pathPoints(int stride) const
+{
+    // A path without steps still has its starting price
+    return std::max(1, (steps + stride - 1) / stride);
+}
+
+// out[(done + p) * points + j] = price of path p of the batch
+static void storePoint(const double *log_s, int n, double *out, int done, int points, int j)
+{
+    for (int p = 0; p < n; ++p)
+    {
+        out[(size_t)(done + p) * points + j] = exp(log_s[p]);
+    }
+}
+
+void GbmPathEngine::simulatePaths(uint64_t first_path, int count, int stride, double *out, double *antithetic) const
+{
+    MC_METRIC_SCOPE(STAGE_STEP); // less the draws, charged to STAGE_RNG
+    if (stride < 1)
+    {
+        throw std::invalid_argument("Path stride must be at least one step");
+    }
+    int points = pathPoints(stride);
+    double log_s[BATCH];
+    double log_a[BATCH];
+    double z_even[BATCH];
+    double z_odd[BATCH];
+    int blocks = (steps + 1) / 2;
+    std::vector<double> mean(moment_matching ? 2 * blocks : 0);
+    std::vector<double> scale(mean.size());
+    uint64_t group = UINT64_MAX;
+
+    for (int done = 0, n = 0; done < count; done += n)
+    {
+        n = batchLength(moment_matching, first_path + done, count - done);
+        uint64_t path = first_path + done;
+        if (moment_matching && path / MOMENT_GROUP != group)
+        {
+            group = path / MOMENT_GROUP;
+            groupMoments(level, seed, group * MOMENT_GROUP, blocks, mean.data(), scale.data());
+        }
+        std::fill(log_s, log_s + n, log_s0);
+        std::fill(log_a, log_a + n, log_s0);
+        int j = 0;
+        if (steps == 0)
+        {
+            storePoint(log_s, n, out, done, points, j);
+            if (antithetic != NULL)
+            {
+                storePoint(log_a, n, antithetic, done, points, j);
+            }
+        }
+
+        // One Philox block gives the normals of two consecutive steps
+        for (int t = 0; t < steps; t += 2)
+        {
+            philoxNormalBlock(level, seed, path, (uint64_t)(t / 2), n, z_even, z_odd);
+            if (moment_matching)
+            {
+                applyMoments(z_even, n, mean[t], scale[t]);
+                applyMoments(z_odd, n, mean[t + 1], scale[t + 1]);
+            }
+            for (int half = 0; half < 2 && t + half < steps; ++half)
+            {
+                const double *z = half == 0 ? z_even : z_odd;
+                gbmAdvance(level, log_s, z, n, drift_dt, vol_sqrt_dt);
+                if (antithetic != NULL)
+                {
+                    gbmAdvance(level, log_a, z, n, drift_dt, -vol_sqrt_dt);
+                }
+                int done_steps = t + half + 1;
+                if (done_steps % stride == 0 || done_steps == steps)
+                {
+                    storePoint(log_s, n, out, done, points, j);
+                    if (antithetic != NULL)
+                    {
+                        storePoint(log_a, n, antithetic, done, points, j);
+                    }
+                    ++j;
+                }
+            }
+        }
+    }
+}
+
+void GbmPathEngine::simulateTerminalExact(uint64_t first_path, int count, double *terminal, double *antithetic) const
+{
+    MC_METRIC_SCOPE(STAGE_STEP);
+    double log_s[BATCH];
+    double z[BATCH];
+    double unused[BATCH];
+    double mean[2];
+    double scale[2];
+    uint64_t group = UINT64_MAX;
+
+    for (int done = 0, n = 0; done < count; done += n)
+    {
+        n = batchLength(moment_matching, first_path + done, count - done);
+        uint64_t path = first_path + done;
+        philoxNormalBlock(level, seed, path, 0, n, z, unused);
+        if (moment_matching)
+        {
+            if (path / MOMENT_GROUP != group)
+            {
+                group = path / MOMENT_GROUP;
+                groupMoments(level, seed, group * MOMENT_GROUP, 1, mean, scale);
+            }
+            applyMoments(z, n, mean[0], scale[0]);
+        }
+        std::fill(log_s, log_s + n, log_s0);
+        gbmAdvance(level, log_s, z, n, drift_t, vol_sqrt_t);
+        for (int p = 0; p < n; ++p)
+        {
+            terminal[done + p] = exp(log_s[p]);
+        }
+        if (antithetic != NULL)
+        {
+            std::fill(log_s, log_s + n, log_s0);
+            gbmAdvance(level, log_s, z, n, drift_t, -vol_sqrt_t);
+            for (int p = 0; p < n; ++p)
+            {
+                antithetic[done + p] = exp(log_s[p]);
+            }
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#include <cstdint>
+#include <cstddef>
+#include "simd.h"
+#ifndef PATH_ENGINE_H
+#define PATH_ENGINE_H
+
+/*
+Batched geometric brownian motion.
+Paths are advanced BATCH at a time in log space, structure of arrays:
+log_s[p] += (mu - 0.5 sigma^2) dt + sigma sqrt(dt) z[p]
+with both terms computed once, and a single exp per path at the end.
+Path p draws its normals from substream p of the seed, in the same order as
+WeinerProcessSimulator, so both give the same paths for the same seed.
+*/
+
+// log_s[i] += drift + vol * z[i], dispatched to the widest available kernel
+void gbmAdvance(SimdLevel level, double *log_s, const double *z, int n, double drift, double vol);
+
+class GbmPathEngine
+{
+private:
+    double log_s0;
+    double drift_dt;    // (mu - 0.5 sigma^2) dt
+    double vol_sqrt_dt; // sigma sqrt(dt)
+    double drift_t;     // (mu - 0.5 sigma^2) T, T = steps * dt
+    double vol_sqrt_t;  // sigma sqrt(T)
+    int steps;
+    uint64_t seed;
+    SimdLevel level;
+    bool moment_matching;
+
+public:
+    static const int BATCH = 64;
+    // Paths [g MOMENT_GROUP, (g + 1) MOMENT_GROUP) are moment matched together
+    static const int MOMENT_GROUP = 16 * BATCH;
+
+    GbmPathEngine(double s0, double mu, double sigma, double dt, int steps, uint64_t seed);
+
+    // Terminal prices of paths [first_path, first_path + count).
+    // If antithetic is given it gets the mirrored paths (every normal negated).
+    void simulateTerminal(uint64_t first_path, int count, double *terminal, double *antithetic = NULL) const;
+    // Whole paths, pathPoints(stride) prices each: after every stride steps, the last step always kept.
+    // out[p * pathPoints(stride) + j] is point j of path first_path + p. Same final prices as simulateTerminal.
+    void simulatePaths(uint64_t first_path, int count, int stride, double *out, double *antithetic = NULL) const;
+    int pathPoints(int stride) const;
+    // Same as simulateTerminal, but S_T drawn exactly from its lognormal law with one normal per path
+    void simulateTerminalExact(uint64_t first_path, int count, double *terminal, double *antithetic = NULL) const;
+
+    // Rescale the draws of every step to mean 0 / variance 1 across each MOMENT_GROUP paths,
+    // whatever range is asked for: a first pass over the group's draws gives the moments.
+    // That costs the draws twice. Paths of a group aren't independent any more, a sample
+    // is the mean of a group, and the estimate has a bias of order 1 / MOMENT_GROUP for
+    // nonlinear payoffs: over 10 seeds of 200k paths on a 10.99 at the money call, -0.0001
+    // +/- 0.0016, where groups of 64 paths were 0.029 too high.
+    void setMomentMatching(bool on) { moment_matching = on; }
+
+    SimdLevel simdLevel() const { return level; }
+};
+
+#endif //
@@ -0,0 +1,209 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "path_store.h"
+#include "thread_pool.h"
+
+static_assert(sizeof(PathStoreHeader) == 128, "path store header layout changed");
+static const char PATH_STORE_MAGIC[8] = "MCPATHS";
+static const size_t WRITE_BLOCK_DOUBLES = 1 << 20; // about 8 MB of prices simulated per write
+static const long long REDUCE_CHUNK = 65536;       // samples per pool task when pricing
+
+void writePathStore(const std::string &file, const MonteCarloSimulation &mcs, int stride, int n_threads)
+{
+    if (stride < 0)
+    {
+        throw std::invalid_argument("Path stride can't be negative");
+    }
+    bool antithetic = mcs.variance_reduction.antithetic;
+    bool exact = stride == 0 && mcs.mode != PRICING_STEPPED;
+    GbmPathEngine engine = mcs.pathEngine();
+    int points = stride == 0 ? 1 : engine.pathPoints(stride);
+    long long samples = mcs.sampleCount();
+    int per_sample = antithetic ? 2 : 1;
+
+    PathStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATH_STORE_MAGIC, sizeof(header.magic));
+    header.version = PATH_STORE_VERSION;
+    header.flags = (antithetic ? PATH_STORE_ANTITHETIC : 0) | (mcs.variance_reduction.moment_matching ? PATH_STORE_MOMENT_MATCHED : 0) | (exact ? PATH_STORE_EXACT_TERMINAL : 0);
+    header.paths = (uint64_t)samples * per_sample;
+    header.points = (uint32_t)points;
+    header.stride = (uint32_t)(stride == 0 ? std::max(mcs.duration, 1) : stride);
+    header.steps = (uint32_t)mcs.duration;
+    header.s0 = mcs.stock.price;
+    header.mu = mcs.stock.drift;
+    header.sigma = mcs.stock.volatility;
+    header.dt = mcs.increment;
+    header.seed = mcs.seed;
+
+    FILE *out = fopen(file.c_str(), "wb");
+    if (out == NULL)
+    {
+        throw std::runtime_error("Can't create path store " + file);
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    // Whole batches per block, so moment matching groups the paths as estimateOption does
+    long long block = std::max(1LL, (long long)(WRITE_BLOCK_DOUBLES / (points * per_sample)) / GbmPathEngine::BATCH) * GbmPathEngine::BATCH;
+    std::vector<double> prices((size_t)block * points);
+    std::vector<double> mirrored(antithetic ? prices.size() : 0);
+    std::vector<double> interleaved(antithetic ? 2 * prices.size() : 0);
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    for (long long first = 0; first < samples && ok; first += block)
+    {
+        long long n = std::min(block, samples - first);
+        pool->parallelFor(n, 16 * GbmPathEngine::BATCH, [&](int, long long begin, long long end) {
+            double *mirror = antithetic ? &mirrored[begin * points] : NULL;
+            if (exact)
+            {
+                engine.simulateTerminalExact(first + begin, (int)(end - begin), &prices[begin * points], mirror);
+            }
+            else
+            {
+                engine.simulatePaths(first + begin, (int)(end - begin), stride == 0 ? std::max(mcs.duration, 1) : stride, &prices[begin * points], mirror);
+            }
+        }, n_threads);
+
+        const double *source = prices.data();
+        if (antithetic)
+        {
+            for (long long p = 0; p < n; ++p)
+            {
+                std::copy(&prices[p * points], &prices[(p + 1) * points], &interleaved[2 * p * points]);
+                std::copy(&mirrored[p * points], &mirrored[(p + 1) * points], &interleaved[(2 * p + 1) * points]);
+            }
+            source = interleaved.data();
+        }
+        size_t count = (size_t)(n * per_sample * points);
+        ok = fwrite(source, sizeof(double), count, out) == count;
+    }
+    if (fclose(out) != 0 || !ok)
+    {
+        throw std::runtime_error("Can't write path store " + file);
+    }
+}
+
+PathStore::PathStore(const std::string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Can't open path store " + file);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(PathStoreHeader))
+    {
+        close(fd);
+        throw std::runtime_error("Not a path store: " + file);
+    }
+    mapped_size = (size_t)info.st_size;
+    void *address = mmap(NULL, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        throw std::runtime_error("Can't map path store " + file);
+    }
+    // Pricing reads it front to back
+    madvise(address, mapped_size, MADV_SEQUENTIAL);
+    mapping = (const unsigned char *)address;
+    head = (const PathStoreHeader *)mapping;
+    data = (const double *)(mapping + sizeof(PathStoreHeader));
+
+    const char *problem = NULL;
+    if (memcmp(head->magic, PATH_STORE_MAGIC, sizeof(head->magic)) != 0)
+    {
+        problem = "Not a path store: ";
+    }
+    else if (head->version != PATH_STORE_VERSION)
+    {
+        problem = "Unsupported path store version: ";
+    }
+    else if (head->points == 0 || (mapped_size - sizeof(PathStoreHeader)) / sizeof(double) / head->points < head->paths)
+    {
+        problem = "Truncated path store: ";
+    }
+    if (problem != NULL)
+    {
+        munmap(address, mapped_size);
+        throw std::runtime_error(problem + file);
+    }
+}
+
+PathStore::~PathStore()
+{
+    munmap((void *)mapping, mapped_size);
+}
+
+// Shared by both overloads, so the plain option one gets its payoff inlined
+template <class Payoff>
+static MonteCarloResult reduceStore(const PathStore &store, const Payoff &payoff, int n_threads)
+{
+    int points = store.points();
+    int per_sample = store.antithetic() ? 2 : 1;
+    bool moment_matched = (store.header().flags & PATH_STORE_MOMENT_MATCHED) != 0;
+    long long samples = (long long)(store.paths() / per_sample);
+
+    // One accumulator per chunk, merged in chunk order: same result at any thread count
+    long long chunk = REDUCE_CHUNK;
+    std::vector<RunningStats> per_chunk((size_t)((samples + chunk - 1) / chunk));
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    pool->parallelFor(samples, chunk, [&](int, long long begin, long long end) {
+        RunningStats &stats = per_chunk[begin / chunk];
+        double group = 0.0;
+        int in_group = 0;
+        for (long long i = begin; i < end; ++i)
+        {
+            const double *first = store.path((uint64_t)(i * per_sample));
+            double value = payoff(first, points);
+            if (per_sample == 2)
+            {
+                value = 0.5 * (value + payoff(first + points, points));
+            }
+            if (!moment_matched)
+            {
+                stats.add(value);
+                continue;
+            }
+            // Matched groups aren't independent samples, their means are
+            group += value;
+            ++in_group;
+            if ((i + 1) % GbmPathEngine::MOMENT_GROUP == 0 || i + 1 == end)
+            {
+                stats.add(group / in_group, in_group);
+                group = 0.0;
+                in_group = 0;
+            }
+        }
+    }, n_threads);
+
+    RunningStats stats;
+    for (const RunningStats &s : per_chunk)
+    {
+        stats.merge(s);
+    }
+    if (stats.count() == 0)
+    {
+        throw std::invalid_argument("Empty path store, can't estimate option");
+    }
+    MonteCarloResult result = makeResult(stats, store.mode());
+    result.paths = (long long)store.paths();
+    return result;
+}
+
+MonteCarloResult priceFromPathStore(const PathStore &store, const PathPayoff &payoff, int n_threads)
+{
+    return reduceStore(store, payoff, n_threads);
+}
+
+MonteCarloResult priceFromPathStore(const PathStore &store, const Option &option, int n_threads)
+{
+    return reduceStore(store, [&option](const double *prices, int points) {
+        return optionPayoff(option, prices[points - 1]);
+    }, n_threads);
+}
@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <functional>
+#include "functions.h"
+#ifndef PATH_STORE_H
+#define PATH_STORE_H
+
+/*
+Simulated paths kept on disk, so one scenario set can be priced against many payoffs.
+File layout: a 128 byte PathStoreHeader, then paths x points doubles, path after
+path, in host byte order. points is 1 when only S_T is kept, otherwise the price
+every `stride` steps (the last step always kept). With antithetics every path is
+followed by its mirror. Reading maps the file, nothing is copied.
+*/
+
+static const uint32_t PATH_STORE_VERSION = 1;
+
+enum PathStoreFlags
+{
+    PATH_STORE_ANTITHETIC = 1,      // paths 2i and 2i+1 are a pair
+    PATH_STORE_MOMENT_MATCHED = 2,  // groups of GbmPathEngine::BATCH samples are matched
+    PATH_STORE_EXACT_TERMINAL = 4   // S_T drawn directly, not stepped
+};
+
+struct PathStoreHeader
+{
+    char magic[8]; // "MCPATHS"
+    uint32_t version;
+    uint32_t flags;
+    uint64_t paths; // mirrors included
+    uint32_t points;
+    uint32_t stride;
+    uint32_t steps;
+    uint32_t reserved;
+    double s0;
+    double mu;
+    double sigma;
+    double dt;
+    uint64_t seed;
+    uint64_t padding[6];
+};
+
+// Simulates the paths of mcs (its seed and variance reduction) into file.
+// stride 0 keeps S_T only, drawn exactly unless mcs.mode asks for stepped paths.
+// Otherwise the stepped paths are kept, one price every stride steps.
+void writePathStore(const std::string &file, const MonteCarloSimulation &mcs, int stride, int n_threads);
+
+class PathStore
+{
+private:
+    const unsigned char *mapping;
+    size_t mapped_size;
+    const PathStoreHeader *head;
+    const double *data;
+
+public:
+    explicit PathStore(const std::string &file);
+    ~PathStore();
+    PathStore(const PathStore &) = delete;
+    PathStore &operator=(const PathStore &) = delete;
+
+    const PathStoreHeader &header() const { return *head; }
+    uint64_t paths() const { return head->paths; }
+    int points() const { return (int)head->points; }
+    bool antithetic() const { return (head->flags & PATH_STORE_ANTITHETIC) != 0; }
+    PricingMode mode() const { return (head->flags & PATH_STORE_EXACT_TERMINAL) ? PRICING_EXACT_TERMINAL : PRICING_STEPPED; }
+
+    const double *path(uint64_t i) const { return data + i * head->points; }
+    double terminal(uint64_t i) const { return path(i)[head->points - 1]; }
+};
+
+// payoff(prices, points) of one stored path
+typedef std::function<double(const double *prices, int points)> PathPayoff;
+
+// Undiscounted mean payoff over the stored paths, like estimateOption.
+// Pairs and moment matched groups count as one sample, as when simulating.
+MonteCarloResult priceFromPathStore(const PathStore &store, const PathPayoff &payoff, int n_threads);
+// Plain calls and puts, on S_T
+MonteCarloResult priceFromPathStore(const PathStore &store, const Option &option, int n_threads);
+
+#endif //
@@ -0,0 +1,211 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include "pricing_cache.h"
+
+// Below this many entries a shard would evict by the luck of the hash rather than by age
+static const size_t MIN_SHARD_ENTRIES = 256;
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t canonicalBits(double x)
+{
+    if (x == 0.0)
+    {
+        x = 0.0; // -0 and 0 give the same price
+    }
+    else if (std::isnan(x))
+    {
+        x = std::numeric_limits<double>::quiet_NaN();
+    }
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+// Fills the key from words, unused words are 0
+static PricingKey makeKey(const uint64_t *words, int n)
+{
+    PricingKey key;
+    memset(key.words, 0, sizeof(key.words));
+    memcpy(key.words, words, n * sizeof(uint64_t));
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < PricingKey::WORDS; ++i)
+    {
+        h = mix64(h + key.words[i]);
+    }
+    key.hash = h;
+    return key;
+}
+
+bool PricingKey::operator==(const PricingKey &other) const
+{
+    return hash == other.hash && memcmp(words, other.words, sizeof(words)) == 0;
+}
+
+PricingKey blackScholesKey(bool call, double s, double k, double r, double t, double sigma)
+{
+    uint64_t words[] = {(uint64_t)CACHE_BLACK_SCHOLES | (uint64_t)call << 8, canonicalBits(s), canonicalBits(k), canonicalBits(r), canonicalBits(t), canonicalBits(sigma)};
+    return makeKey(words, 6);
+}
+
+PricingKey latticeKey(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type, LatticeVariant variant)
+{
+    uint64_t kind = (uint64_t)CACHE_LATTICE | (uint64_t)call << 8 | (uint64_t)american << 9 | (uint64_t)type << 16 | (uint64_t)variant << 24;
+    uint64_t words[] = {kind, canonicalBits(s), canonicalBits(k), canonicalBits(r), canonicalBits(t), canonicalBits(sigma), (uint64_t)(uint32_t)n};
+    return makeKey(words, 7);
+}
+
+PricingKey monteCarloKey(const MonteCarloSimulation &mcs, const Option &option)
+{
+    const VarianceReduction &vr = mcs.variance_reduction;
+    uint64_t kind = (uint64_t)CACHE_MONTE_CARLO | (uint64_t)option.call << 8 | (uint64_t)vr.antithetic << 9 | (uint64_t)vr.moment_matching << 10 | (uint64_t)mcs.resolveMode(option) << 16 | (uint64_t)vr.control << 24;
+    uint64_t words[] = {kind, canonicalBits(option.strike), canonicalBits(mcs.stock.price), canonicalBits(mcs.stock.drift), canonicalBits(mcs.stock.volatility), canonicalBits(mcs.increment), (uint64_t)(uint32_t)mcs.iterations << 32 | (uint32_t)mcs.duration, mcs.seed};
+    return makeKey(words, 8);
+}
+
+template <class Value>
+ShardedLruCache<Value>::ShardedLruCache(size_t capacity, int n_shards)
+{
+    size_t count = 1;
+    while (count < (size_t)std::max(n_shards, 1))
+    {
+        count *= 2;
+    }
+    // Small caches are one exact LRU list: --cache 3 remembers the last 3 keys
+    capacity = std::max(capacity, (size_t)1);
+    while (count > 1 && capacity / count < MIN_SHARD_ENTRIES)
+    {
+        count /= 2;
+    }
+    // The capacities add up to capacity exactly
+    for (size_t i = 0; i < count; ++i)
+    {
+        shards.push_back(std::unique_ptr<Shard>(new Shard()));
+        shards.back()->capacity = capacity / count + (i < capacity % count ? 1 : 0);
+    }
+}
+
+template <class Value>
+typename ShardedLruCache<Value>::Shard &ShardedLruCache<Value>::shardOf(const PricingKey &key) const
+{
+    // High bits pick the shard, the low ones are used by the hash table inside it
+    return *shards[(key.hash >> 40) & (shards.size() - 1)];
+}
+
+template <class Value>
+bool ShardedLruCache<Value>::find(const PricingKey &key, Value &value)
+{
+    Shard &shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    typename std::unordered_map<PricingKey, typename Entries::iterator, KeyHash>::iterator it = shard.index.find(key);
+    if (it == shard.index.end())
+    {
+        ++shard.stats.misses;
+        return false;
+    }
+    ++shard.stats.hits;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    value = it->second->second;
+    return true;
+}
+
+template <class Value>
+void ShardedLruCache<Value>::insert(const PricingKey &key, const Value &value)
+{
+    Shard &shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    typename std::unordered_map<PricingKey, typename Entries::iterator, KeyHash>::iterator it = shard.index.find(key);
+    if (it != shard.index.end())
+    {
+        it->second->second = value;
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return;
+    }
+    if (shard.entries.size() >= shard.capacity)
+    {
+        shard.index.erase(shard.entries.back().first);
+        shard.entries.pop_back();
+        ++shard.stats.evictions;
+    }
+    shard.entries.push_front(std::make_pair(key, value));
+    shard.index[key] = shard.entries.begin();
+    ++shard.stats.insertions;
+}
+
+template <class Value>
+CacheStats ShardedLruCache<Value>::stats() const
+{
+    CacheStats total = {0, 0, 0, 0, 0};
+    for (const std::unique_ptr<Shard> &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        total.hits += shard->stats.hits;
+        total.misses += shard->stats.misses;
+        total.insertions += shard->stats.insertions;
+        total.evictions += shard->stats.evictions;
+        total.entries += (long long)shard->entries.size();
+    }
+    return total;
+}
+
+template <class Value>
+void ShardedLruCache<Value>::clear()
+{
+    for (const std::unique_ptr<Shard> &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->entries.clear();
+        shard->index.clear();
+    }
+}
+
+template class ShardedLruCache<double>;
+template class ShardedLruCache<MonteCarloResult>;
+
+PricingCache::PricingCache(size_t deterministic_capacity, size_t monte_carlo_capacity, int shards) : deterministic(deterministic_capacity, shards), monte_carlo(monte_carlo_capacity, shards) {}
+
+double PricingCache::bsPrice(bool call, double s, double k, double r, double t, double sigma)
+{
+    return deterministic.getOrCompute(blackScholesKey(call, s, k, r, t, sigma), [&]() {
+        return bsOptionPrice(call, s, k, r, t, sigma);
+    });
+}
+
+double PricingCache::latticePrice(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type, LatticeVariant variant)
+{
+    return deterministic.getOrCompute(latticeKey(call, american, s, k, r, t, sigma, n, type, variant), [&]() {
+        switch (variant)
+        {
+        case LATTICE_SMOOTHED:
+            return latticeOptionPriceSmoothed(call, american, s, k, r, t, sigma, n, type);
+        case LATTICE_RICHARDSON:
+            return latticeOptionPriceRichardson(call, american, s, k, r, t, sigma, n, type);
+        default:
+            return latticeOptionPrice(call, american, s, k, r, t, sigma, n, type);
+        }
+    });
+}
+
+MonteCarloResult PricingCache::monteCarlo(const MonteCarloSimulation &mcs, const Option &option, int n_threads)
+{
+    return monte_carlo.getOrCompute(monteCarloKey(mcs, option), [&]() {
+        MonteCarloSimulation copy = mcs;
+        return (n_threads <= 1) ? copy.estimateOptionResult(option) : copy.estimateOptionParallel(option, n_threads);
+    });
+}
+
+void PricingCache::clear()
+{
+    deterministic.clear();
+    monte_carlo.clear();
+}
@@ -0,0 +1,135 @@
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include "functions.h"
+#include "lattice.h"
+#ifndef PRICING_CACHE_H
+#define PRICING_CACHE_H
+
+/*
+Memoized prices keyed on the inputs that determine them.
+A key is a fixed list of 64 bit words: the engine, then every input that changes
+the result, doubles canonicalized (-0 is 0, every NaN is the same NaN), so equal
+requests give equal keys whatever the caller passed around them.
+The cache is split in shards by key hash, each an LRU list under its own mutex,
+so concurrent lookups rarely meet; a small cache is one list, exactly LRU. Deterministic engines and seeded Monte Carlo
+results live in two caches with their own capacity: a few expensive simulations
+aren't pushed out by a stream of cheap closed forms.
+Values are computed outside the lock, two threads missing the same key at once
+both compute it and the second insert wins.
+*/
+
+enum CachedEngine
+{
+    CACHE_BLACK_SCHOLES,
+    CACHE_LATTICE,
+    CACHE_MONTE_CARLO
+};
+
+enum LatticeVariant
+{
+    LATTICE_PLAIN,      // latticeOptionPrice
+    LATTICE_SMOOTHED,   // latticeOptionPriceSmoothed
+    LATTICE_RICHARDSON  // latticeOptionPriceRichardson
+};
+
+struct PricingKey
+{
+    static const int WORDS = 10;
+    uint64_t words[WORDS];
+    uint64_t hash;
+
+    bool operator==(const PricingKey &other) const;
+};
+
+PricingKey blackScholesKey(bool call, double s, double k, double r, double t, double sigma);
+PricingKey latticeKey(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type, LatticeVariant variant);
+// Only what the undiscounted estimate depends on: the discount rate and option.t aren't part of it
+PricingKey monteCarloKey(const MonteCarloSimulation &mcs, const Option &option);
+
+struct CacheStats
+{
+    long long hits;
+    long long misses;
+    long long insertions;
+    long long evictions;
+    long long entries;
+
+    double hitRate() const { return (hits + misses) > 0 ? (double)hits / (hits + misses) : 0.0; }
+};
+
+// Least recently used eviction per shard, capacity / shards entries each: across
+// shards the order is only approximate, so small caches have a single shard.
+// Instantiated for double and MonteCarloResult.
+template <class Value>
+class ShardedLruCache
+{
+private:
+    struct KeyHash
+    {
+        size_t operator()(const PricingKey &key) const { return (size_t)key.hash; }
+    };
+    typedef std::list<std::pair<PricingKey, Value>> Entries;
+    struct Shard
+    {
+        std::mutex mutex;
+        size_t capacity;
+        Entries entries; // most recently used first
+        std::unordered_map<PricingKey, typename Entries::iterator, KeyHash> index;
+        CacheStats stats;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    Shard &shardOf(const PricingKey &key) const;
+
+public:
+    // shards is rounded up to a power of two, then halved until each holds at least
+    // 256 entries: below 512 entries the cache is a single exact LRU list
+    explicit ShardedLruCache(size_t capacity, int shards = 16);
+
+    // Counts a hit or a miss
+    bool find(const PricingKey &key, Value &value);
+    void insert(const PricingKey &key, const Value &value);
+
+    template <class Fn>
+    Value getOrCompute(const PricingKey &key, Fn compute)
+    {
+        Value value;
+        if (!find(key, value))
+        {
+            value = compute();
+            insert(key, value);
+        }
+        return value;
+    }
+
+    CacheStats stats() const;
+    void clear();
+};
+
+class PricingCache
+{
+private:
+    ShardedLruCache<double> deterministic;
+    ShardedLruCache<MonteCarloResult> monte_carlo;
+
+public:
+    PricingCache(size_t deterministic_capacity = 1 << 16, size_t monte_carlo_capacity = 1 << 12, int shards = 16);
+
+    double bsPrice(bool call, double s, double k, double r, double t, double sigma);
+    double latticePrice(bool call, bool american, double s, double k, double r, double t, double sigma, int n, LatticeType type, LatticeVariant variant = LATTICE_PLAIN);
+    // estimateOptionParallel on a miss, or estimateOptionResult on the calling thread for n_threads 1.
+    // The seed is part of the key, the thread count isn't: a hit returns the result of the first run.
+    MonteCarloResult monteCarlo(const MonteCarloSimulation &mcs, const Option &option, int n_threads);
+
+    CacheStats deterministicStats() const { return deterministic.stats(); }
+    CacheStats monteCarloStats() const { return monte_carlo.stats(); }
+    void clear();
+};
+
+#endif //
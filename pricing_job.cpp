@@ -0,0 +1,348 @@
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include "pricing_job.h"
+#include "metrics.h"
+
+// Samples between two looks at the cancel flag, whole batches for moment matching
+static const long long CANCEL_BLOCK = 16 * GbmPathEngine::BATCH;
+
+struct PricingJobState
+{
+    // Fixed at submit
+    PricingExecutor::SampleTask task;
+    EstimatorAccumulator prototype;
+    PricingMode mode;
+    JobPriority priority;
+    unsigned long long sequence;
+    long long samples;
+    long long slice_size;
+    long long slices;
+    int paths_per_sample;
+    int max_workers;
+
+    // Scheduling, under the executor mutex
+    long long next_slice;
+    int active;
+    bool queued;
+
+    // Read by progress() without locking
+    std::atomic<int> status;
+    std::atomic<long long> paths_done;
+    std::atomic<unsigned> version; // odd while estimate and std_error are being written
+    std::atomic<double> estimate;
+    std::atomic<double> std_error;
+    std::atomic<bool> cancelled;
+
+    // Under mutex
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<EstimatorAccumulator> per_slice;
+    EstimatorAccumulator live;
+    std::exception_ptr error;
+    MonteCarloResult result;
+    bool done;
+
+    PricingJobState() : status(JOB_QUEUED), paths_done(0), version(0), estimate(0.0), std_error(0.0), cancelled(false), done(false) {}
+};
+
+const char *jobStatusName(JobStatus status)
+{
+    switch (status)
+    {
+    case JOB_QUEUED:
+        return "queued";
+    case JOB_RUNNING:
+        return "running";
+    case JOB_DONE:
+        return "done";
+    case JOB_CANCELLED:
+        return "cancelled";
+    case JOB_FAILED:
+        return "failed";
+    }
+    return "unknown";
+}
+
+// Seqlock write, writers are serialized by job.mutex
+static void publish(PricingJobState &job, double estimate, double std_error)
+{
+    unsigned v = job.version.load(std::memory_order_relaxed);
+    job.version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    job.estimate.store(estimate, std::memory_order_relaxed);
+    job.std_error.store(std_error, std::memory_order_relaxed);
+    job.version.store(v + 2, std::memory_order_release);
+}
+
+static void runSlice(PricingJobState &job, long long slice)
+{
+    long long begin = slice * job.slice_size;
+    long long end = std::min(job.samples, begin + job.slice_size);
+    EstimatorAccumulator acc = job.prototype;
+    try
+    {
+        for (long long first = begin; first < end; first += CANCEL_BLOCK)
+        {
+            if (job.cancelled.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            long long count = std::min(CANCEL_BLOCK, end - first);
+            job.task(first, count, acc);
+            job.paths_done.fetch_add(count * job.paths_per_sample, std::memory_order_relaxed);
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        if (!job.error)
+        {
+            job.error = std::current_exception();
+        }
+        job.cancelled = true;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(job.mutex);
+    MC_METRIC_SCOPE(STAGE_REDUCE);
+    job.per_slice[slice] = acc;
+    job.live.merge(acc);
+    publish(job, job.live.estimate(), job.live.stdError());
+}
+
+// Once no slice is queued or running. The final merge goes in slice order.
+static void finishJob(PricingJobState &job)
+{
+    std::lock_guard<std::mutex> lock(job.mutex);
+    JobStatus status = job.error ? JOB_FAILED : (job.cancelled ? JOB_CANCELLED : JOB_DONE);
+    if (status == JOB_DONE)
+    {
+        MC_METRIC_SCOPE(STAGE_REDUCE);
+        EstimatorAccumulator acc = job.prototype;
+        for (const EstimatorAccumulator &slice : job.per_slice)
+        {
+            acc.merge(slice);
+        }
+        job.result = makeResult(acc, job.mode);
+        publish(job, job.result.price, job.result.std_error);
+    }
+    std::vector<EstimatorAccumulator>().swap(job.per_slice);
+    job.status.store(status, std::memory_order_release);
+    job.done = true;
+    job.finished.notify_all();
+}
+
+JobProgress PricingJob::progress() const
+{
+    JobProgress p;
+    p.status = (JobStatus)state->status.load(std::memory_order_acquire);
+    p.paths_done = state->paths_done.load(std::memory_order_relaxed);
+    p.paths_total = state->samples * state->paths_per_sample;
+    unsigned before;
+    unsigned after;
+    do
+    {
+        before = state->version.load(std::memory_order_acquire);
+        p.estimate = state->estimate.load(std::memory_order_relaxed);
+        p.std_error = state->std_error.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = state->version.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+    return p;
+}
+
+void PricingJob::cancel()
+{
+    state->cancelled = true;
+}
+
+bool PricingJob::ready() const
+{
+    return state->status.load(std::memory_order_acquire) >= JOB_DONE;
+}
+
+void PricingJob::wait() const
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [this]() { return state->done; });
+}
+
+bool PricingJob::waitFor(double seconds) const
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+    return state->finished.wait_for(lock, std::chrono::duration<double>(seconds), [this]() { return state->done; });
+}
+
+MonteCarloResult PricingJob::result() const
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [this]() { return state->done; });
+    if (state->error)
+    {
+        std::rethrow_exception(state->error);
+    }
+    if (state->status.load() == JOB_CANCELLED)
+    {
+        throw std::runtime_error("Pricing job was cancelled");
+    }
+    return state->result;
+}
+
+PricingExecutor::PricingExecutor(int n_threads) : pool(sharedThreadPool()), runners(0), next_sequence(0), stopping(false)
+{
+    max_runners = pool->workerCount(std::max(n_threads, 1));
+}
+
+PricingExecutor::~PricingExecutor()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    // No runner may come back for the queued jobs, end them here
+    for (const std::shared_ptr<PricingJobState> &job : queue)
+    {
+        job->cancelled = true;
+        job->queued = false;
+        if (job->active == 0)
+        {
+            finishJob(*job);
+        }
+    }
+    queue.clear();
+    idle.wait(lock, [this]() { return runners == 0; });
+}
+
+PricingJob PricingExecutor::submit(const MonteCarloSimulation &mcs, const Option &option, JobPriority priority, int max_workers)
+{
+    PricingMode used = mcs.resolveMode(option);
+    SampleTask task = [mcs, option, used](long long first_sample, long long count, EstimatorAccumulator &acc) {
+        mcs.accumulatePaths(option, used, (uint64_t)first_sample, count, acc);
+    };
+    return submit(mcs.sampleCount(), mcs.variance_reduction.antithetic ? 2 : 1, mcs.makeAccumulator(option), used, task, priority, max_workers);
+}
+
+PricingJob PricingExecutor::submit(long long samples, int paths_per_sample, const EstimatorAccumulator &prototype, PricingMode mode, const SampleTask &task, JobPriority priority, int max_workers)
+{
+    if (samples < 1 || paths_per_sample < 1 || !task)
+    {
+        throw std::invalid_argument("Pricing job needs a task and at least one sample");
+    }
+    std::shared_ptr<PricingJobState> job = std::make_shared<PricingJobState>();
+    job->task = task;
+    job->prototype = prototype;
+    job->live = prototype;
+    job->mode = mode;
+    job->priority = priority;
+    job->samples = samples;
+    job->paths_per_sample = paths_per_sample;
+    job->max_workers = std::max(max_workers, 0);
+    // Same slicing as estimateOptionParallel, so the same bits
+    job->slice_size = SAMPLE_SLICE;
+    job->slices = (samples + job->slice_size - 1) / job->slice_size;
+    job->per_slice.assign((size_t)job->slices, prototype);
+    job->next_slice = 0;
+    job->active = 0;
+    job->queued = true;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->sequence = next_sequence++;
+        std::vector<std::shared_ptr<PricingJobState>>::iterator position = queue.begin();
+        while (position != queue.end() && (*position)->priority >= priority)
+        {
+            ++position;
+        }
+        queue.insert(position, job);
+        startRunners();
+    }
+
+    PricingJob handle;
+    handle.state = job;
+    return handle;
+}
+
+// Under mutex: next slice of the first job that can take another worker.
+// Cancelled jobs are dropped from the queue on the way.
+std::shared_ptr<PricingJobState> PricingExecutor::claim(long long &slice)
+{
+    for (size_t i = 0; i < queue.size();)
+    {
+        std::shared_ptr<PricingJobState> job = queue[i];
+        if (job->cancelled)
+        {
+            queue.erase(queue.begin() + i);
+            job->queued = false;
+            if (job->active == 0)
+            {
+                finishJob(*job);
+            }
+            continue;
+        }
+        if (job->max_workers > 0 && job->active >= job->max_workers)
+        {
+            ++i;
+            continue;
+        }
+        slice = job->next_slice++;
+        ++job->active;
+        if (job->next_slice == job->slices)
+        {
+            queue.erase(queue.begin() + i);
+            job->queued = false;
+        }
+        int queued_status = JOB_QUEUED;
+        job->status.compare_exchange_strong(queued_status, JOB_RUNNING);
+        return job;
+    }
+    return std::shared_ptr<PricingJobState>();
+}
+
+// Under mutex: fill the free places while jobs are queued. A runner that finds
+// nothing it may claim (capped jobs) returns at once.
+void PricingExecutor::startRunners()
+{
+    while (runners < max_runners && !queue.empty() && !stopping)
+    {
+        ++runners;
+        pool->submit([this](int) { runnerLoop(); });
+    }
+}
+
+void PricingExecutor::finishSlice(const std::shared_ptr<PricingJobState> &job)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    --job->active;
+    if (!job->queued && job->active == 0)
+    {
+        finishJob(*job);
+    }
+    if (job->max_workers > 0)
+    {
+        // A capped job may take a runner again
+        startRunners();
+    }
+}
+
+void PricingExecutor::runnerLoop()
+{
+    while (true)
+    {
+        std::shared_ptr<PricingJobState> job;
+        long long slice = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = claim(slice);
+            if (!job)
+            {
+                // Back to the pool; notified under the lock, so the destructor can't miss it
+                --runners;
+                idle.notify_all();
+                return;
+            }
+        }
+        runSlice(*job, slice);
+        finishSlice(job);
+    }
+}
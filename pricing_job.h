@@ -0,0 +1,114 @@
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include "functions.h"
+#include "thread_pool.h"
+#ifndef PRICING_JOB_H
+#define PRICING_JOB_H
+
+/*
+Asynchronous pricing jobs on a shared executor.
+A job is cut into slices of whole batches. Runner tasks on the shared thread pool
+take the next slice of the highest priority job (oldest first among equals), so
+any number of jobs run side by side and a high priority job overtakes the queue at
+the next slice. The executor has no threads of its own: a runner leaves the pool
+as soon as no slice is left to claim, and jobs share the cores with every other
+parallel engine instead of doubling the thread count.
+Each slice fills its own accumulator and is folded into the job once, under that
+job's mutex: there is no lock per path and no lock shared between jobs.
+Progress and the partial estimate are published for lock free reads, the final
+result merges the slices in order, so it doesn't depend on the scheduling.
+*/
+
+enum JobPriority
+{
+    JOB_PRIORITY_LOW,
+    JOB_PRIORITY_NORMAL,
+    JOB_PRIORITY_HIGH
+};
+
+enum JobStatus
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_CANCELLED,
+    JOB_FAILED
+};
+const char *jobStatusName(JobStatus status);
+
+struct JobProgress
+{
+    JobStatus status;
+    long long paths_done;
+    long long paths_total;
+    double estimate; // undiscounted, over the slices finished so far
+    double std_error;
+};
+
+struct PricingJobState;
+
+// Handle to a submitted job, cheap to copy. The job keeps its own copy of its inputs,
+// so a handle can outlive whatever it was submitted from.
+class PricingJob
+{
+public:
+    PricingJob() {}
+
+    bool valid() const { return state != NULL; }
+    // Lock free, safe to call every frame
+    JobProgress progress() const;
+    // Slices already running stop at their next block of paths, queued ones are dropped
+    void cancel();
+    bool ready() const;
+    void wait() const;
+    bool waitFor(double seconds) const;
+    // Blocks until the job ends. Rethrows the job's exception if it failed,
+    // throws std::runtime_error if it was cancelled.
+    MonteCarloResult result() const;
+
+private:
+    std::shared_ptr<PricingJobState> state;
+    friend class PricingExecutor;
+};
+
+class PricingExecutor
+{
+public:
+    // task(first_sample, count, acc) adds samples [first_sample, first_sample + count) to acc
+    typedef std::function<void(long long first_sample, long long count, EstimatorAccumulator &acc)> SampleTask;
+
+    // At most n_threads runners at once, and no more than the pool has threads.
+    // Don't wait on a job from inside a pool task: it may need that very thread.
+    explicit PricingExecutor(int n_threads);
+    // Cancels the jobs still queued and waits for the running slices
+    ~PricingExecutor();
+
+    int size() const { return max_runners; }
+
+    // European option of mcs, like estimateOptionParallel. max_workers caps the threads
+    // working on the job at once, 0 for no cap.
+    PricingJob submit(const MonteCarloSimulation &mcs, const Option &option, JobPriority priority = JOB_PRIORITY_NORMAL, int max_workers = 0);
+    // Any estimator split over samples: samples in [0, samples), each worth paths_per_sample paths,
+    // accumulated into copies of prototype. task must be safe to call from several threads.
+    PricingJob submit(long long samples, int paths_per_sample, const EstimatorAccumulator &prototype, PricingMode mode, const SampleTask &task, JobPriority priority = JOB_PRIORITY_NORMAL, int max_workers = 0);
+
+private:
+    std::shared_ptr<ThreadPool> pool;
+    int max_runners;
+    int runners; // submitted to the pool and not yet returned, under mutex
+    std::vector<std::shared_ptr<PricingJobState>> queue; // highest priority first, then oldest
+    unsigned long long next_sequence;
+    std::mutex mutex;
+    std::condition_variable idle; // runners dropped to 0
+    bool stopping;
+
+    std::shared_ptr<PricingJobState> claim(long long &slice);
+    void startRunners();
+    void finishSlice(const std::shared_ptr<PricingJobState> &job);
+    void runnerLoop();
+};
+
+#endif //
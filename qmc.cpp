@@ -0,0 +1,445 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "qmc.h"
+#include "rng.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+// Sobol directions from primitive polynomials of degree <= this
+static const int MAX_POLY_DEGREE = 15;
+
+struct PrimitivePolynomial
+{
+    int degree;
+    uint32_t a; // inner coefficients a_1 .. a_{s-1}, a_1 in the highest bit (Joe & Kuo's convention)
+};
+
+// Initial direction numbers m_1 .. m_s of dimensions 2 to 16 (Joe & Kuo, new-joe-kuo-6.21201).
+// Further dimensions use fixed pseudo random odd m_k < 2^k: still a valid Sobol
+// sequence, just without Joe & Kuo's search for good 2D projections.
+static const uint32_t JOE_KUO_M[15][6] = {
+    {1},
+    {1, 3},
+    {1, 3, 1},
+    {1, 1, 1},
+    {1, 1, 3, 3},
+    {1, 3, 5, 13},
+    {1, 1, 5, 5, 17},
+    {1, 1, 5, 5, 5},
+    {1, 1, 7, 11, 19},
+    {1, 1, 5, 1, 1},
+    {1, 1, 1, 3, 11},
+    {1, 3, 5, 5, 31},
+    {1, 3, 3, 9, 7, 49},
+    {1, 1, 1, 15, 21, 21},
+    {1, 3, 1, 13, 27, 49}};
+
+static uint64_t gf2MulMod(uint64_t a, uint64_t b, uint64_t poly, int degree)
+{
+    uint64_t result = 0;
+    while (b != 0)
+    {
+        if (b & 1)
+        {
+            result ^= a;
+        }
+        b >>= 1;
+        a <<= 1;
+        if (a & (1ULL << degree))
+        {
+            a ^= poly;
+        }
+    }
+    return result;
+}
+
+static uint64_t gf2PowX(uint64_t exponent, uint64_t poly, int degree)
+{
+    uint64_t result = 1;
+    uint64_t base = (degree == 1) ? 1 : 2; // x mod (x + 1) = 1
+    while (exponent != 0)
+    {
+        if (exponent & 1)
+        {
+            result = gf2MulMod(result, base, poly, degree);
+        }
+        base = gf2MulMod(base, base, poly, degree);
+        exponent >>= 1;
+    }
+    return result;
+}
+
+// x has order 2^s - 1 modulo poly exactly when poly is primitive
+static bool isPrimitive(uint64_t poly, int degree)
+{
+    uint64_t order = (1ULL << degree) - 1;
+    if (gf2PowX(order, poly, degree) != 1)
+    {
+        return false;
+    }
+    uint64_t rest = order;
+    for (uint64_t q = 2; q * q <= rest; ++q)
+    {
+        if (rest % q != 0)
+        {
+            continue;
+        }
+        if (gf2PowX(order / q, poly, degree) == 1)
+        {
+            return false;
+        }
+        while (rest % q == 0)
+        {
+            rest /= q;
+        }
+    }
+    if (rest > 1 && gf2PowX(order / rest, poly, degree) == 1)
+    {
+        return false;
+    }
+    return true;
+}
+
+static const std::vector<PrimitivePolynomial> &primitivePolynomials()
+{
+    static std::vector<PrimitivePolynomial> polys;
+    static bool ready = false;
+    static std::mutex polys_mutex;
+    std::lock_guard<std::mutex> lock(polys_mutex);
+    if (!ready)
+    {
+        for (int degree = 1; degree <= MAX_POLY_DEGREE; ++degree)
+        {
+            for (uint32_t a = 0; a < (1u << (degree - 1)); ++a)
+            {
+                uint64_t poly = (1ULL << degree) | ((uint64_t)a << 1) | 1;
+                if (isPrimitive(poly, degree))
+                {
+                    PrimitivePolynomial p = {degree, a};
+                    polys.push_back(p);
+                }
+            }
+        }
+        ready = true;
+    }
+    return polys;
+}
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+int SobolSequence::maxDimension()
+{
+    return (int)primitivePolynomials().size() + 1;
+}
+
+SobolSequence::SobolSequence(int dimensions) : dims(dimensions), directions(32 * dimensions)
+{
+    if (dimensions < 1 || dimensions > maxDimension())
+    {
+        throw std::invalid_argument("Sobol dimension out of range");
+    }
+    // First dimension: van der Corput
+    for (int k = 0; k < 32; ++k)
+    {
+        directions[k] = 1u << (31 - k);
+    }
+    const std::vector<PrimitivePolynomial> &polys = primitivePolynomials();
+    for (int d = 1; d < dims; ++d)
+    {
+        int s = polys[d - 1].degree;
+        uint32_t a = polys[d - 1].a;
+        uint64_t m[33];
+        for (int k = 1; k <= s; ++k)
+        {
+            if (d <= 15)
+            {
+                m[k] = JOE_KUO_M[d - 1][k - 1];
+            }
+            else
+            {
+                m[k] = ((splitmix64((uint64_t)d * 64 + k) % (1ULL << (k - 1))) << 1) | 1;
+            }
+        }
+        for (int k = s + 1; k <= 32; ++k)
+        {
+            m[k] = m[k - s] ^ (m[k - s] << s);
+            for (int i = 1; i < s; ++i)
+            {
+                if ((a >> (s - 1 - i)) & 1)
+                {
+                    m[k] ^= m[k - i] << i;
+                }
+            }
+        }
+        for (int k = 1; k <= 32; ++k)
+        {
+            directions[32 * d + k - 1] = (uint32_t)(m[k] << (32 - k));
+        }
+    }
+}
+
+void SobolSequence::point(uint64_t index, uint32_t *out) const
+{
+    uint64_t gray = index ^ (index >> 1);
+    for (int d = 0; d < dims; ++d)
+    {
+        uint32_t x = 0;
+        for (int k = 0; k < 32 && (gray >> k) != 0; ++k)
+        {
+            if ((gray >> k) & 1)
+            {
+                x ^= directions[32 * d + k];
+            }
+        }
+        out[d] = x;
+    }
+}
+
+void SobolSequence::next(uint64_t index, uint32_t *out) const
+{
+    // Gray code: points index and index + 1 differ by one direction number
+    int k = __builtin_ctzll(index + 1);
+    for (int d = 0; d < dims; ++d)
+    {
+        out[d] ^= directions[32 * d + k];
+    }
+}
+
+BrownianBridge::BrownianBridge(int steps, double dt) : n(steps), bridge_index(steps), left_index(steps), right_index(steps), left_weight(steps), right_weight(steps), stddev(steps)
+{
+    // Fill the largest gap first: the end point, then midpoints of what is left
+    std::vector<double> t(steps);
+    for (int i = 0; i < steps; ++i)
+    {
+        t[i] = (i + 1) * dt;
+    }
+    std::vector<int> map(steps, 0);
+    map[n - 1] = 1;
+    bridge_index[0] = n - 1;
+    stddev[0] = sqrt(t[n - 1]);
+    left_weight[0] = right_weight[0] = 0.0;
+    for (int j = 0, i = 1; i < n; ++i)
+    {
+        while (map[j])
+        {
+            ++j;
+        }
+        int k = j;
+        while (!map[k])
+        {
+            ++k;
+        }
+        int l = j + ((k - 1 - j) >> 1);
+        map[l] = i;
+        bridge_index[i] = l;
+        left_index[i] = j;
+        right_index[i] = k;
+        if (j != 0)
+        {
+            left_weight[i] = (t[k] - t[l]) / (t[k] - t[j - 1]);
+            right_weight[i] = (t[l] - t[j - 1]) / (t[k] - t[j - 1]);
+            stddev[i] = sqrt((t[l] - t[j - 1]) * (t[k] - t[l]) / (t[k] - t[j - 1]));
+        }
+        else
+        {
+            left_weight[i] = (t[k] - t[l]) / t[k];
+            right_weight[i] = t[l] / t[k];
+            stddev[i] = sqrt(t[l] * (t[k] - t[l]) / t[k]);
+        }
+        j = k + 1;
+        if (j >= n)
+        {
+            j = 0;
+        }
+    }
+}
+
+void BrownianBridge::build(const double *z, double *w) const
+{
+    w[n - 1] = stddev[0] * z[0];
+    for (int i = 1; i < n; ++i)
+    {
+        int j = left_index[i];
+        int k = right_index[i];
+        int l = bridge_index[i];
+        if (j != 0)
+        {
+            w[l] = left_weight[i] * w[j - 1] + right_weight[i] * w[k] + stddev[i] * z[i];
+        }
+        else
+        {
+            w[l] = right_weight[i] * w[k] + stddev[i] * z[i];
+        }
+    }
+}
+
+QmcSettings defaultQmcSettings()
+{
+    QmcSettings settings;
+    settings.scrambles = 16;
+    settings.scramble = SCRAMBLE_OWEN;
+    settings.brownian_bridge = true;
+    return settings;
+}
+
+static uint32_t reverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Every output bit only depends on the same and more significant input bits,
+// which is what makes it a nested uniform (Owen) scramble
+static uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+MonteCarloResult estimateOptionQmc(const MonteCarloSimulation &mcs, const Option &option, const QmcSettings &settings, int n_threads)
+{
+    PricingMode used = mcs.resolveMode(option);
+    // Stepping a payoff of S_T alone only spreads W_T over worse dimensions
+    int dims = (used == PRICING_EXACT_TERMINAL || dependsOnTerminalOnly(option)) ? 1 : mcs.duration;
+    if (dims < 1)
+    {
+        throw std::invalid_argument("Stepped quasi Monte Carlo needs at least one step");
+    }
+    int scrambles = (settings.scramble == SCRAMBLE_NONE) ? 1 : std::max(2, settings.scrambles);
+    long long points = std::max(1LL, (long long)mcs.iterations / scrambles);
+    // Unscrambled point 0 is the corner of the cube, a normal of -6.2 in every dimension
+    uint64_t first_point = (settings.scramble == SCRAMBLE_NONE) ? 1 : 0;
+
+    SobolSequence sobol(dims);
+    BrownianBridge bridge(std::max(1, mcs.duration), mcs.increment);
+
+    // One scrambling word per (scramble, dimension), from the simulation seed
+    std::vector<uint32_t> scramble_words((size_t)scrambles * dims);
+    for (int r = 0; r < scrambles; ++r)
+    {
+        for (int d = 0; d < dims; ++d)
+        {
+            uint32_t bits[4];
+            philox4x32(mcs.seed, 0x51A1000000000000ULL + r, (uint64_t)d, bits);
+            scramble_words[(size_t)r * dims + d] = bits[0];
+        }
+    }
+
+    double sigma = mcs.stock.volatility;
+    double horizon = mcs.duration * mcs.increment;
+    double log_s0 = log(mcs.stock.price);
+    double drift_t = (mcs.stock.drift - 0.5 * sigma * sigma) * horizon;
+
+    // Partial results of every (scramble, chunk), merged in a fixed order afterwards
+    const long long chunk = 4096;
+    long long chunks_per_scramble = (points + chunk - 1) / chunk;
+    std::vector<RunningStats> partial((size_t)(scrambles * chunks_per_scramble));
+
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    pool->parallelFor(scrambles * chunks_per_scramble, 1, [&](int, long long task, long long) {
+        int r = (int)(task / chunks_per_scramble);
+        long long begin = (task % chunks_per_scramble) * chunk;
+        long long end = std::min(points, begin + chunk);
+        const uint32_t *words = &scramble_words[(size_t)r * dims];
+        MC_METRIC_SCOPE(STAGE_STEP); // points, normals and payoffs
+        MC_METRIC_COUNT(COUNTER_PATHS, end - begin);
+        MC_METRIC_COUNT(COUNTER_NORMALS, (long long)dims * (end - begin));
+
+        std::vector<uint32_t> x(dims);
+        std::vector<double> z(dims);
+        std::vector<double> w(dims);
+        sobol.point(first_point + begin, x.data());
+        RunningStats &stats = partial[(size_t)task];
+        for (long long i = begin; i < end; ++i)
+        {
+            if (i > begin)
+            {
+                sobol.next(first_point + i - 1, x.data());
+            }
+            for (int d = 0; d < dims; ++d)
+            {
+                uint32_t bits = x[d];
+                if (settings.scramble == SCRAMBLE_OWEN)
+                {
+                    bits = owenScramble(bits, words[d]);
+                }
+                else if (settings.scramble == SCRAMBLE_DIGITAL_SHIFT)
+                {
+                    bits ^= words[d];
+                }
+                z[d] = inverseNormalCDF(((double)bits + 0.5) * (1.0 / 4294967296.0));
+            }
+
+            double w_t;
+            if (dims == 1)
+            {
+                w_t = sqrt(horizon) * z[0];
+            }
+            else if (settings.brownian_bridge)
+            {
+                bridge.build(z.data(), w.data());
+                w_t = w[dims - 1];
+            }
+            else
+            {
+                w_t = 0.0;
+                for (int d = 0; d < dims; ++d)
+                {
+                    w_t += sqrt(mcs.increment) * z[d];
+                }
+            }
+            stats.add(optionPayoff(option, exp(log_s0 + drift_t + sigma * w_t)));
+        }
+    }, n_threads);
+
+    // Each scramble gives one independent estimate
+    RunningStats crude;
+    RunningStats scramble_means;
+    for (int r = 0; r < scrambles; ++r)
+    {
+        RunningStats scramble_stats;
+        for (long long c = 0; c < chunks_per_scramble; ++c)
+        {
+            scramble_stats.merge(partial[(size_t)(r * chunks_per_scramble + c)]);
+        }
+        scramble_means.add(scramble_stats.mean());
+        crude.merge(scramble_stats);
+    }
+
+    MonteCarloResult result = makeResult(scramble_means, used);
+    result.paths = crude.count();
+    if (scrambles < 2)
+    {
+        // A single deterministic sequence has no error estimate, don't make one up
+        result.std_error = NAN;
+        result.ci_low = NAN;
+        result.ci_high = NAN;
+        result.variance_reduction_factor = NAN;
+        return result;
+    }
+    double crude_variance = crude.variance() / crude.count();
+    if (result.std_error > 0.0)
+    {
+        result.variance_reduction_factor = crude_variance / (result.std_error * result.std_error);
+    }
+    else
+    {
+        result.variance_reduction_factor = (crude_variance > 0.0) ? HUGE_VAL : NAN; // a constant payoff has nothing to reduce
+    }
+    return result;
+}
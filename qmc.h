@@ -0,0 +1,70 @@
+#include <vector>
+#include <cstdint>
+#include "functions.h"
+#ifndef QMC_H
+#define QMC_H
+
+/*
+Randomized quasi Monte Carlo: scrambled Sobol points, normals by inverse CDF and
+paths built with a Brownian bridge, so the first (best distributed) dimensions
+carry W_T and the coarse shape of the path.
+*/
+
+enum ScrambleType
+{
+    SCRAMBLE_NONE,          // plain Sobol from point 1, no error estimate: NaN std_error and factor
+    SCRAMBLE_DIGITAL_SHIFT, // xor of a random 32 bit word per dimension
+    SCRAMBLE_OWEN           // nested uniform scrambling (hash based, Laine-Karras / Burley)
+};
+
+class SobolSequence
+{
+private:
+    int dims;
+    std::vector<uint32_t> directions; // 32 direction numbers per dimension
+
+public:
+    explicit SobolSequence(int dimensions);
+
+    // Highest dimension we have primitive polynomials for
+    static int maxDimension();
+    int dimensions() const { return dims; }
+
+    // Point number index (Gray code order), 32 bit fixed point coordinates
+    void point(uint64_t index, uint32_t *out) const;
+    // Moves out from point index to point index + 1
+    void next(uint64_t index, uint32_t *out) const;
+};
+
+// Turns n standard normals (one per time step, dt apart) into the brownian
+// motion at every step. z[0] sets W_T, z[1] the midpoint, and so on.
+class BrownianBridge
+{
+private:
+    int n;
+    std::vector<int> bridge_index;
+    std::vector<int> left_index;
+    std::vector<int> right_index;
+    std::vector<double> left_weight;
+    std::vector<double> right_weight;
+    std::vector<double> stddev;
+
+public:
+    BrownianBridge(int steps, double dt);
+    void build(const double *z, double *w) const;
+};
+
+struct QmcSettings
+{
+    int scrambles; // independent randomizations, the spread of their means gives the error
+    ScrambleType scramble;
+    bool brownian_bridge; // otherwise dimension i drives step i
+};
+QmcSettings defaultQmcSettings();
+
+// mcs.iterations points in total, split over the scrambles.
+// Payoffs depending only on S_T use a single dimension, W_T, whatever the mode:
+// stepped mode with duration 0 is then a zero horizon like the other engines.
+MonteCarloResult estimateOptionQmc(const MonteCarloSimulation &mcs, const Option &option, const QmcSettings &settings, int n_threads);
+
+#endif //
@@ -0,0 +1,455 @@
+#include <random>
+#include <cmath>
+#include <cstring>
+#include "rng.h"
+#include "metrics.h"
+#if MC_X86
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC 12 reports bogus "may be used uninitialized" from inside the AVX-512 intrinsic headers
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <immintrin.h>
+#endif
+
+// Philox4x32 constants (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+static const uint32_t PHILOX_M0 = 0xD2511F53u;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57u;
+static const uint32_t PHILOX_W0 = 0x9E3779B9u;
+static const uint32_t PHILOX_W1 = 0xBB67AE85u;
+
+uint64_t randomSeed()
+{
+    std::random_device rd;
+    return ((uint64_t)rd() << 32) ^ (uint64_t)rd();
+}
+
+static inline void mulhilo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo)
+{
+    uint64_t product = (uint64_t)a * (uint64_t)b;
+    hi = (uint32_t)(product >> 32);
+    lo = (uint32_t)product;
+}
+
+void philox4x32(uint64_t seed, uint64_t stream, uint64_t block, uint32_t out[4])
+{
+    // counter = (block, stream), key = seed
+    uint32_t c0 = (uint32_t)block;
+    uint32_t c1 = (uint32_t)(block >> 32);
+    uint32_t c2 = (uint32_t)stream;
+    uint32_t c3 = (uint32_t)(stream >> 32);
+    uint32_t k0 = (uint32_t)seed;
+    uint32_t k1 = (uint32_t)(seed >> 32);
+
+    for (int round = 0; round < 10; ++round)
+    {
+        uint32_t hi0, lo0, hi1, lo1;
+        mulhilo(PHILOX_M0, c0, hi0, lo0);
+        mulhilo(PHILOX_M1, c2, hi1, lo1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+double uniformFromBits(uint32_t hi, uint32_t lo)
+{
+    uint64_t bits = (((uint64_t)hi << 32) | lo) >> 12; // 52 bits, exact in a double
+    return ((double)bits + 0.5) * (1.0 / 4503599627370496.0);
+}
+
+/*
+Box-Muller with our own log and sincos instead of libm.
+The vector kernels below do exactly the same operations in the same order
+(no fma, hence -ffp-contract=off in the Makefile), so every SIMD level gives
+bit for bit the same normals.
+*/
+static const double LN2_HI = 6.93147180369123816490e-01;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double BM_SQRT2 = 1.41421356237309514547;
+static const double HALF_PI = 1.57079632679489655800;
+static const double ROUND_MAGIC = 6755399441055744.0; // 2^52 + 2^51
+
+// 1/(2k+1), log(m) = 2 atanh(f) = 2 f sum f^(2k) / (2k+1)
+static const double LOG_COEFFS[11] = {1.0, 1.0 / 3.0, 1.0 / 5.0, 1.0 / 7.0, 1.0 / 9.0, 1.0 / 11.0, 1.0 / 13.0, 1.0 / 15.0, 1.0 / 17.0, 1.0 / 19.0, 1.0 / 21.0};
+// Taylor coefficients of sin(x)/x and cos(x) in x^2, enough for |x| <= pi/4
+static const double SIN_COEFFS[9] = {1.0, -1.0 / 6.0, 1.0 / 120.0, -1.0 / 5040.0, 1.0 / 362880.0, -1.0 / 39916800.0, 1.0 / 6227020800.0, -1.0 / 1307674368000.0, 1.0 / 355687428096000.0};
+static const double COS_COEFFS[10] = {1.0, -1.0 / 2.0, 1.0 / 24.0, -1.0 / 720.0, 1.0 / 40320.0, -1.0 / 3628800.0, 1.0 / 479001600.0, -1.0 / 87178291200.0, 1.0 / 20922789888000.0, -1.0 / 6402373705728000.0};
+
+// log(x) for a normal positive x
+static inline double bmLog(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    double e = (double)(bits >> 52) - 1023.0;
+    uint64_t mant_bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &mant_bits, sizeof(m));
+    if (m > BM_SQRT2)
+    {
+        m = m * 0.5;
+        e = e + 1.0;
+    }
+    double f = (m - 1.0) / (m + 1.0);
+    double s = f * f;
+    double p = LOG_COEFFS[10];
+    for (int i = 9; i >= 0; --i)
+    {
+        p = p * s + LOG_COEFFS[i];
+    }
+    double log_m = (2.0 * f) * p;
+    return e * LN2_HI + (e * LN2_LO + log_m);
+}
+
+// sin and cos of 2 pi u for u in [0, 1)
+static inline void bmSinCosTurns(double u, double &sin_out, double &cos_out)
+{
+    double t = 4.0 * u;
+    double shifted = t + ROUND_MAGIC;
+    double k = shifted - ROUND_MAGIC;
+    uint64_t quadrant;
+    memcpy(&quadrant, &shifted, sizeof(quadrant));
+    double x = (t - k) * HALF_PI;
+    double x2 = x * x;
+
+    double ps = SIN_COEFFS[8];
+    for (int i = 7; i >= 0; --i)
+    {
+        ps = ps * x2 + SIN_COEFFS[i];
+    }
+    double pc = COS_COEFFS[9];
+    for (int i = 8; i >= 0; --i)
+    {
+        pc = pc * x2 + COS_COEFFS[i];
+    }
+    double s = x * ps;
+
+    // 2 pi u = k pi/2 + x
+    bool swap = (quadrant & 1) != 0;
+    double a = swap ? pc : s;
+    double b = swap ? s : pc;
+    sin_out = (quadrant & 2) ? -a : a;
+    cos_out = ((quadrant + 1) & 2) ? -b : b;
+}
+
+void philoxNormalPair(uint64_t seed, uint64_t stream, uint64_t block, double &z0, double &z1)
+{
+    uint32_t r[4];
+    philox4x32(seed, stream, block, r);
+    double u1 = uniformFromBits(r[0], r[1]);
+    double u2 = uniformFromBits(r[2], r[3]);
+
+    // Box-Muller
+    double radius = sqrt(-2.0 * bmLog(u1));
+    double sin_a, cos_a;
+    bmSinCosTurns(u2, sin_a, cos_a);
+    z0 = radius * cos_a;
+    z1 = radius * sin_a;
+}
+
+static void philoxNormalBlockScalar(uint64_t seed, uint64_t first_stream, uint64_t block, int n, double *z0, double *z1)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        philoxNormalPair(seed, first_stream + i, block, z0[i], z1[i]);
+    }
+}
+
+#if MC_X86
+/*
+Vector Philox: one lane per stream, each 32 bit counter word zero extended in a
+64 bit lane so that mul_epu32 gives the full 32x32->64 product.
+*/
+__attribute__((target("avx2"))) static void philoxNormalBlockAvx2(uint64_t seed, uint64_t first_stream, uint64_t block, int n, double *z0, double *z1)
+{
+    const __m256i low32 = _mm256_set1_epi64x(0xFFFFFFFFLL);
+    const __m256i m0 = _mm256_set1_epi64x(PHILOX_M0);
+    const __m256i m1 = _mm256_set1_epi64x(PHILOX_M1);
+    const __m256i mant_mask = _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL);
+    const __m256i one_bits = _mm256_set1_epi64x(0x3FF0000000000000LL);
+    const __m256i two52_bits = _mm256_set1_epi64x(0x4330000000000000LL);
+    const __m256i one_i = _mm256_set1_epi64x(1);
+    const __m256i two_i = _mm256_set1_epi64x(2);
+    const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+    const __m256d inv_two52 = _mm256_set1_pd(1.0 / 4503599627370496.0);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        uint64_t s = first_stream + i;
+        __m256i c0 = _mm256_set1_epi64x((uint32_t)block);
+        __m256i c1 = _mm256_set1_epi64x((uint32_t)(block >> 32));
+        __m256i c2 = _mm256_set_epi64x((uint32_t)(s + 3), (uint32_t)(s + 2), (uint32_t)(s + 1), (uint32_t)s);
+        __m256i c3 = _mm256_set_epi64x((uint32_t)((s + 3) >> 32), (uint32_t)((s + 2) >> 32), (uint32_t)((s + 1) >> 32), (uint32_t)(s >> 32));
+        uint32_t k0 = (uint32_t)seed;
+        uint32_t k1 = (uint32_t)(seed >> 32);
+        for (int round = 0; round < 10; ++round)
+        {
+            __m256i p0 = _mm256_mul_epu32(m0, c0);
+            __m256i p1 = _mm256_mul_epu32(m1, c2);
+            __m256i hi0 = _mm256_srli_epi64(p0, 32);
+            __m256i hi1 = _mm256_srli_epi64(p1, 32);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi64x(k0));
+            c1 = _mm256_and_si256(p1, low32);
+            c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi64x(k1));
+            c3 = _mm256_and_si256(p0, low32);
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+
+        // 52 bit uniforms, converted exactly through the 2^52 exponent trick
+        __m256i b1 = _mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(c0, 32), c1), 12);
+        __m256i b2 = _mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(c2, 32), c3), 12);
+        __m256d half = _mm256_set1_pd(0.5);
+        __m256d u1 = _mm256_mul_pd(_mm256_add_pd(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(b1, two52_bits)), two52), half), inv_two52);
+        __m256d u2 = _mm256_mul_pd(_mm256_add_pd(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(b2, two52_bits)), two52), half), inv_two52);
+
+        // log(u1), same steps as bmLog
+        __m256i bits = _mm256_castpd_si256(u1);
+        __m256d e = _mm256_sub_pd(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), two52_bits)), two52), _mm256_set1_pd(1023.0));
+        __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mant_mask), one_bits));
+        __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(BM_SQRT2), _CMP_GT_OQ);
+        m = _mm256_blendv_pd(m, _mm256_mul_pd(m, half), big);
+        e = _mm256_blendv_pd(e, _mm256_add_pd(e, _mm256_set1_pd(1.0)), big);
+        __m256d one = _mm256_set1_pd(1.0);
+        __m256d f = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+        __m256d fs = _mm256_mul_pd(f, f);
+        __m256d p = _mm256_set1_pd(LOG_COEFFS[10]);
+        for (int k = 9; k >= 0; --k)
+        {
+            p = _mm256_add_pd(_mm256_mul_pd(p, fs), _mm256_set1_pd(LOG_COEFFS[k]));
+        }
+        __m256d log_m = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), f), p);
+        __m256d log_u1 = _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(LN2_HI)), _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(LN2_LO)), log_m));
+        __m256d radius = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_set1_pd(-2.0), log_u1));
+
+        // sincos(2 pi u2), same steps as bmSinCosTurns
+        __m256d t = _mm256_mul_pd(_mm256_set1_pd(4.0), u2);
+        __m256d shifted = _mm256_add_pd(t, _mm256_set1_pd(ROUND_MAGIC));
+        __m256d k = _mm256_sub_pd(shifted, _mm256_set1_pd(ROUND_MAGIC));
+        __m256i quadrant = _mm256_castpd_si256(shifted);
+        __m256d x = _mm256_mul_pd(_mm256_sub_pd(t, k), _mm256_set1_pd(HALF_PI));
+        __m256d x2 = _mm256_mul_pd(x, x);
+        __m256d ps = _mm256_set1_pd(SIN_COEFFS[8]);
+        for (int c = 7; c >= 0; --c)
+        {
+            ps = _mm256_add_pd(_mm256_mul_pd(ps, x2), _mm256_set1_pd(SIN_COEFFS[c]));
+        }
+        __m256d pc = _mm256_set1_pd(COS_COEFFS[9]);
+        for (int c = 8; c >= 0; --c)
+        {
+            pc = _mm256_add_pd(_mm256_mul_pd(pc, x2), _mm256_set1_pd(COS_COEFFS[c]));
+        }
+        __m256d s_x = _mm256_mul_pd(x, ps);
+        __m256d swap = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(quadrant, one_i), one_i));
+        __m256d a = _mm256_blendv_pd(s_x, pc, swap);
+        __m256d b = _mm256_blendv_pd(pc, s_x, swap);
+        __m256i sin_sign = _mm256_slli_epi64(_mm256_and_si256(quadrant, two_i), 62);
+        __m256i cos_sign = _mm256_slli_epi64(_mm256_and_si256(_mm256_add_epi64(quadrant, one_i), two_i), 62);
+        __m256d sin_a = _mm256_castsi256_pd(_mm256_xor_si256(_mm256_castpd_si256(a), sin_sign));
+        __m256d cos_a = _mm256_castsi256_pd(_mm256_xor_si256(_mm256_castpd_si256(b), cos_sign));
+
+        _mm256_storeu_pd(z0 + i, _mm256_mul_pd(radius, cos_a));
+        _mm256_storeu_pd(z1 + i, _mm256_mul_pd(radius, sin_a));
+    }
+    philoxNormalBlockScalar(seed, first_stream + i, block, n - i, z0 + i, z1 + i);
+}
+
+__attribute__((target("avx512f"))) static void philoxNormalBlockAvx512(uint64_t seed, uint64_t first_stream, uint64_t block, int n, double *z0, double *z1)
+{
+    const __m512i low32 = _mm512_set1_epi64(0xFFFFFFFFLL);
+    const __m512i m0 = _mm512_set1_epi64(PHILOX_M0);
+    const __m512i m1 = _mm512_set1_epi64(PHILOX_M1);
+    const __m512i mant_mask = _mm512_set1_epi64(0x000FFFFFFFFFFFFFLL);
+    const __m512i one_bits = _mm512_set1_epi64(0x3FF0000000000000LL);
+    const __m512i two52_bits = _mm512_set1_epi64(0x4330000000000000LL);
+    const __m512i one_i = _mm512_set1_epi64(1);
+    const __m512i two_i = _mm512_set1_epi64(2);
+    const __m512d two52 = _mm512_set1_pd(4503599627370496.0);
+    const __m512d inv_two52 = _mm512_set1_pd(1.0 / 4503599627370496.0);
+    const __m512i lane = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i streams = _mm512_add_epi64(_mm512_set1_epi64((long long)(first_stream + i)), lane);
+        __m512i c0 = _mm512_set1_epi64((uint32_t)block);
+        __m512i c1 = _mm512_set1_epi64((uint32_t)(block >> 32));
+        __m512i c2 = _mm512_and_si512(streams, low32);
+        __m512i c3 = _mm512_srli_epi64(streams, 32);
+        uint32_t k0 = (uint32_t)seed;
+        uint32_t k1 = (uint32_t)(seed >> 32);
+        for (int round = 0; round < 10; ++round)
+        {
+            __m512i p0 = _mm512_mul_epu32(m0, c0);
+            __m512i p1 = _mm512_mul_epu32(m1, c2);
+            __m512i hi0 = _mm512_srli_epi64(p0, 32);
+            __m512i hi1 = _mm512_srli_epi64(p1, 32);
+            c0 = _mm512_xor_si512(_mm512_xor_si512(hi1, c1), _mm512_set1_epi64(k0));
+            c1 = _mm512_and_si512(p1, low32);
+            c2 = _mm512_xor_si512(_mm512_xor_si512(hi0, c3), _mm512_set1_epi64(k1));
+            c3 = _mm512_and_si512(p0, low32);
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+
+        __m512i b1 = _mm512_srli_epi64(_mm512_or_si512(_mm512_slli_epi64(c0, 32), c1), 12);
+        __m512i b2 = _mm512_srli_epi64(_mm512_or_si512(_mm512_slli_epi64(c2, 32), c3), 12);
+        __m512d half = _mm512_set1_pd(0.5);
+        __m512d u1 = _mm512_mul_pd(_mm512_add_pd(_mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(b1, two52_bits)), two52), half), inv_two52);
+        __m512d u2 = _mm512_mul_pd(_mm512_add_pd(_mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(b2, two52_bits)), two52), half), inv_two52);
+
+        __m512i bits = _mm512_castpd_si512(u1);
+        __m512d e = _mm512_sub_pd(_mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(bits, 52), two52_bits)), two52), _mm512_set1_pd(1023.0));
+        __m512d m = _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(bits, mant_mask), one_bits));
+        __mmask8 big = _mm512_cmp_pd_mask(m, _mm512_set1_pd(BM_SQRT2), _CMP_GT_OQ);
+        m = _mm512_mask_blend_pd(big, m, _mm512_mul_pd(m, half));
+        e = _mm512_mask_blend_pd(big, e, _mm512_add_pd(e, _mm512_set1_pd(1.0)));
+        __m512d one = _mm512_set1_pd(1.0);
+        __m512d f = _mm512_div_pd(_mm512_sub_pd(m, one), _mm512_add_pd(m, one));
+        __m512d fs = _mm512_mul_pd(f, f);
+        __m512d p = _mm512_set1_pd(LOG_COEFFS[10]);
+        for (int k = 9; k >= 0; --k)
+        {
+            p = _mm512_add_pd(_mm512_mul_pd(p, fs), _mm512_set1_pd(LOG_COEFFS[k]));
+        }
+        __m512d log_m = _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(2.0), f), p);
+        __m512d log_u1 = _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(LN2_HI)), _mm512_add_pd(_mm512_mul_pd(e, _mm512_set1_pd(LN2_LO)), log_m));
+        __m512d radius = _mm512_sqrt_pd(_mm512_mul_pd(_mm512_set1_pd(-2.0), log_u1));
+
+        __m512d t = _mm512_mul_pd(_mm512_set1_pd(4.0), u2);
+        __m512d shifted = _mm512_add_pd(t, _mm512_set1_pd(ROUND_MAGIC));
+        __m512d k = _mm512_sub_pd(shifted, _mm512_set1_pd(ROUND_MAGIC));
+        __m512i quadrant = _mm512_castpd_si512(shifted);
+        __m512d x = _mm512_mul_pd(_mm512_sub_pd(t, k), _mm512_set1_pd(HALF_PI));
+        __m512d x2 = _mm512_mul_pd(x, x);
+        __m512d ps = _mm512_set1_pd(SIN_COEFFS[8]);
+        for (int c = 7; c >= 0; --c)
+        {
+            ps = _mm512_add_pd(_mm512_mul_pd(ps, x2), _mm512_set1_pd(SIN_COEFFS[c]));
+        }
+        __m512d pc = _mm512_set1_pd(COS_COEFFS[9]);
+        for (int c = 8; c >= 0; --c)
+        {
+            pc = _mm512_add_pd(_mm512_mul_pd(pc, x2), _mm512_set1_pd(COS_COEFFS[c]));
+        }
+        __m512d s_x = _mm512_mul_pd(x, ps);
+        __mmask8 swap = _mm512_cmpeq_epi64_mask(_mm512_and_si512(quadrant, one_i), one_i);
+        __m512d a = _mm512_mask_blend_pd(swap, s_x, pc);
+        __m512d b = _mm512_mask_blend_pd(swap, pc, s_x);
+        __m512i sin_sign = _mm512_slli_epi64(_mm512_and_si512(quadrant, two_i), 62);
+        __m512i cos_sign = _mm512_slli_epi64(_mm512_and_si512(_mm512_add_epi64(quadrant, one_i), two_i), 62);
+        __m512d sin_a = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), sin_sign));
+        __m512d cos_a = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(b), cos_sign));
+
+        _mm512_storeu_pd(z0 + i, _mm512_mul_pd(radius, cos_a));
+        _mm512_storeu_pd(z1 + i, _mm512_mul_pd(radius, sin_a));
+    }
+    philoxNormalBlockScalar(seed, first_stream + i, block, n - i, z0 + i, z1 + i);
+}
+#endif
+
+void philoxNormalBlock(SimdLevel level, uint64_t seed, uint64_t first_stream, uint64_t block, int n, double *z0, double *z1)
+{
+    MC_METRIC_SCOPE(STAGE_RNG);
+    MC_METRIC_COUNT(COUNTER_NORMALS, 2 * n);
+#if MC_X86
+    if (level == SIMD_AVX512)
+    {
+        philoxNormalBlockAvx512(seed, first_stream, block, n, z0, z1);
+        return;
+    }
+    if (level == SIMD_AVX2)
+    {
+        philoxNormalBlockAvx2(seed, first_stream, block, n, z0, z1);
+        return;
+    }
+#endif
+    (void)level;
+    philoxNormalBlockScalar(seed, first_stream, block, n, z0, z1);
+}
+
+RandomStream::RandomStream(uint64_t seed, uint64_t stream) : seed(seed), stream(stream), block(0), uniform_block(0), buffer_pos(0), buffer_len(0) {}
+
+void RandomStream::setStream(uint64_t stream_id)
+{
+    stream = stream_id;
+    block = 0;
+    uniform_block = 0;
+    buffer_pos = 0;
+    buffer_len = 0;
+}
+
+void RandomStream::skipAhead(uint64_t n)
+{
+    uint64_t buffered = (uint64_t)(buffer_len - buffer_pos);
+    if (n <= buffered)
+    {
+        buffer_pos += (int)n;
+        return;
+    }
+    n -= buffered;
+    block += n / 2;
+    buffer_pos = 0;
+    buffer_len = 0;
+    if (n % 2 != 0)
+    {
+        refill();
+        buffer_pos = 1;
+    }
+}
+
+void RandomStream::refill()
+{
+    MC_METRIC_SCOPE(STAGE_RNG);
+    MC_METRIC_COUNT(COUNTER_NORMALS, BUFFER_SIZE);
+    for (int i = 0; i < BUFFER_SIZE; i += 2)
+    {
+        philoxNormalPair(seed, stream, block++, buffer[i], buffer[i + 1]);
+    }
+    buffer_pos = 0;
+    buffer_len = BUFFER_SIZE;
+}
+
+double RandomStream::nextNormal()
+{
+    if (buffer_pos == buffer_len)
+    {
+        refill();
+    }
+    return buffer[buffer_pos++];
+}
+
+double RandomStream::nextUniform()
+{
+    // Uniforms come from their own half of the counter space so they don't
+    // disturb the normal sequence of the substream
+    uint32_t r[4];
+    philox4x32(seed, stream, (uniform_block++) | (1ULL << 63), r);
+    return uniformFromBits(r[0], r[1]);
+}
+
+void RandomStream::fillNormals(double *out, size_t n)
+{
+    size_t i = 0;
+    while (i < n && buffer_pos < buffer_len)
+    {
+        out[i++] = buffer[buffer_pos++];
+    }
+    // Large requests skip the buffer
+    while (i + 1 < n)
+    {
+        philoxNormalPair(seed, stream, block++, out[i], out[i + 1]);
+        i += 2;
+    }
+    if (i < n)
+    {
+        out[i] = nextNormal();
+    }
+}
@@ -0,0 +1,62 @@
+#include <cstdint>
+#include <cstddef>
+#include "simd.h"
+#ifndef RNG_H
+#define RNG_H
+
+/*
+Counter based random numbers (Philox4x32-10).
+A draw is a pure function of (seed, stream, counter), so every path gets its own
+substream and jumping anywhere inside it is O(1): no state has to be carried
+between threads or jobs, and a given seed always reproduces the same paths.
+*/
+
+// Seed taken from std::random_device, used when the user doesn't give one
+uint64_t randomSeed();
+
+// One Philox block: 4 x 32 random bits for (seed, stream, block)
+void philox4x32(uint64_t seed, uint64_t stream, uint64_t block, uint32_t out[4]);
+
+// Two independent N(0,1) draws (Box-Muller on one Philox block).
+// Normal number 2*block and 2*block+1 of the substream.
+void philoxNormalPair(uint64_t seed, uint64_t stream, uint64_t block, double &z0, double &z1);
+
+// philoxNormalPair for n consecutive substreams at once: z0[i], z1[i] come from
+// substream first_stream + i. Vectorized across substreams, same bits at every level.
+void philoxNormalBlock(SimdLevel level, uint64_t seed, uint64_t first_stream, uint64_t block, int n, double *z0, double *z1);
+
+// Uniform in (0,1) built from 52 random bits, never exactly 0 or 1
+double uniformFromBits(uint32_t hi, uint32_t lo);
+
+class RandomStream
+{
+private:
+    static const int BUFFER_SIZE = 64; // normals produced per refill
+
+    uint64_t seed;
+    uint64_t stream;
+    uint64_t block; // next Philox block to generate
+    uint64_t uniform_block;
+    double buffer[BUFFER_SIZE];
+    int buffer_pos;
+    int buffer_len;
+
+    void refill();
+
+public:
+    RandomStream(uint64_t seed, uint64_t stream = 0);
+
+    // Jump to the start of another substream (e.g. one per path)
+    void setStream(uint64_t stream_id);
+    // Skip the next n normals of the current substream in O(1)
+    void skipAhead(uint64_t n);
+
+    double nextNormal();
+    double nextUniform();
+    void fillNormals(double *out, size_t n);
+
+    uint64_t getSeed() const { return seed; }
+    uint64_t getStream() const { return stream; }
+};
+
+#endif //
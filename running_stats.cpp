@@ -0,0 +1,119 @@
+#include <cmath>
+#include "running_stats.h"
+
+RunningStats::RunningStats() : n(0), weight(0.0), mean_value(0.0), m2(0.0) {}
+
+RunningStats::RunningStats(const State &state) : n(state.n), weight(state.weight), mean_value(state.mean), m2(state.m2) {}
+
+RunningStats::State RunningStats::state() const
+{
+    State state = {n, weight, mean_value, m2};
+    return state;
+}
+
+void RunningStats::add(double x, double w)
+{
+    ++n;
+    weight += w;
+    double delta = x - mean_value;
+    mean_value += delta * w / weight;
+    m2 += w * delta * (x - mean_value);
+}
+
+void RunningStats::merge(const RunningStats &other)
+{
+    if (other.n == 0)
+    {
+        return;
+    }
+    if (n == 0)
+    {
+        *this = other;
+        return;
+    }
+    double total = weight + other.weight;
+    double delta = other.mean_value - mean_value;
+    mean_value += delta * other.weight / total;
+    m2 += other.m2 + delta * delta * weight * other.weight / total;
+    weight = total;
+    n += other.n;
+}
+
+double RunningStats::variance() const
+{
+    return (n > 1) ? m2 / (double)(n - 1) : 0.0;
+}
+
+double RunningStats::stdError() const
+{
+    return (n > 1) ? sqrt(variance() / weight) : 0.0;
+}
+
+void RunningStats::confidenceInterval(double z, double &low, double &high) const
+{
+    double half_width = z * stdError();
+    low = mean_value - half_width;
+    high = mean_value + half_width;
+}
+
+RunningCovariance::RunningCovariance() : n(0), weight(0.0), mean_x(0.0), mean_y(0.0), m2x(0.0), m2y(0.0), cxy(0.0) {}
+
+RunningCovariance::RunningCovariance(const State &state) : n(state.n), weight(state.weight), mean_x(state.mean_x), mean_y(state.mean_y), m2x(state.m2x), m2y(state.m2y), cxy(state.cxy) {}
+
+RunningCovariance::State RunningCovariance::state() const
+{
+    State state = {n, weight, mean_x, mean_y, m2x, m2y, cxy};
+    return state;
+}
+
+void RunningCovariance::add(double x, double y, double w)
+{
+    ++n;
+    weight += w;
+    double dx = x - mean_x;
+    double dy = y - mean_y;
+    mean_x += dx * w / weight;
+    mean_y += dy * w / weight;
+    m2x += w * dx * (x - mean_x);
+    m2y += w * dy * (y - mean_y);
+    cxy += w * dx * (y - mean_y);
+}
+
+void RunningCovariance::merge(const RunningCovariance &other)
+{
+    if (other.n == 0)
+    {
+        return;
+    }
+    if (n == 0)
+    {
+        *this = other;
+        return;
+    }
+    double total = weight + other.weight;
+    double dx = other.mean_x - mean_x;
+    double dy = other.mean_y - mean_y;
+    double cross = weight * other.weight / total;
+    mean_x += dx * other.weight / total;
+    mean_y += dy * other.weight / total;
+    m2x += other.m2x + dx * dx * cross;
+    m2y += other.m2y + dy * dy * cross;
+    cxy += other.cxy + dx * dy * cross;
+    weight = total;
+    n += other.n;
+}
+
+double RunningCovariance::varianceX() const
+{
+    return (n > 1) ? m2x / (double)(n - 1) : 0.0;
+}
+
+double RunningCovariance::varianceY() const
+{
+    return (n > 1) ? m2y / (double)(n - 1) : 0.0;
+}
+
+double RunningCovariance::covariance() const
+{
+    return (n > 1) ? cxy / (double)(n - 1) : 0.0;
+}
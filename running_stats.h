@@ -0,0 +1,86 @@
+#ifndef RUNNING_STATS_H
+#define RUNNING_STATS_H
+
+/*
+Streaming mean/variance (Welford), constant memory whatever the number of samples.
+Two accumulators filled on different threads can be merged (Chan et al.).
+Samples can carry a weight (West): a mean over n paths added with weight n counts
+n times as much as a single path. The variance is then that of a unit weight
+sample, sum w (x - mean)^2 / (count - 1), and the standard error divides it by the
+total weight. With unit weights it's plain Welford, to the bit.
+*/
+class RunningStats
+{
+private:
+    long long n;
+    double weight; // sum of the weights, n with unit weights
+    double mean_value;
+    double m2; // weighted sum of squared deviations from the mean
+
+public:
+    // Raw state, to ship an accumulator to another process and merge it there bit for bit
+    struct State
+    {
+        long long n;
+        double weight;
+        double mean;
+        double m2;
+    };
+
+    RunningStats();
+    explicit RunningStats(const State &state);
+
+    void add(double x, double w = 1.0);
+    void merge(const RunningStats &other);
+
+    long long count() const { return n; }
+    double totalWeight() const { return weight; }
+    double mean() const { return mean_value; }
+    double variance() const; // sample variance
+    double stdError() const;
+    // mean +/- z standard errors, z = 1.96 for 95%
+    void confidenceInterval(double z, double &low, double &high) const;
+    State state() const;
+};
+
+// Same idea for pairs (x, y): both means, variances and their covariance
+class RunningCovariance
+{
+private:
+    long long n;
+    double weight;
+    double mean_x;
+    double mean_y;
+    double m2x;
+    double m2y;
+    double cxy; // weighted sum of (x - mean_x)(y - mean_y)
+
+public:
+    struct State
+    {
+        long long n;
+        double weight;
+        double mean_x;
+        double mean_y;
+        double m2x;
+        double m2y;
+        double cxy;
+    };
+
+    RunningCovariance();
+    explicit RunningCovariance(const State &state);
+
+    void add(double x, double y, double w = 1.0);
+    void merge(const RunningCovariance &other);
+
+    long long count() const { return n; }
+    double totalWeight() const { return weight; }
+    double meanX() const { return mean_x; }
+    double meanY() const { return mean_y; }
+    double varianceX() const;
+    double varianceY() const;
+    double covariance() const;
+    State state() const;
+};
+
+#endif //
@@ -0,0 +1,64 @@
+#include <cstdlib>
+#include <cstring>
+#include "simd.h"
+
+static SimdLevel probeSimdLevel()
+{
+    SimdLevel level = SIMD_SCALAR;
+#if MC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        level = SIMD_AVX2;
+    }
+    if (level == SIMD_AVX2 && __builtin_cpu_supports("avx512f"))
+    {
+        level = SIMD_AVX512;
+    }
+#endif
+    const char *cap = getenv("MC_SIMD");
+    if (cap != NULL)
+    {
+        if (strcmp(cap, "scalar") == 0)
+        {
+            level = SIMD_SCALAR;
+        }
+        else if (strcmp(cap, "avx2") == 0 && level > SIMD_AVX2)
+        {
+            level = SIMD_AVX2;
+        }
+    }
+    return level;
+}
+
+SimdLevel detectSimdLevel()
+{
+    static const SimdLevel level = probeSimdLevel();
+    return level;
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_AVX512:
+        return "avx512";
+    case SIMD_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+int simdLevelWidth(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_AVX512:
+        return 8;
+    case SIMD_AVX2:
+        return 4;
+    default:
+        return 1;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MC_X86 1
+#else
+#define MC_X86 0
+#endif
+
+// Widest vector instruction set usable on this CPU, checked once at runtime.
+// Setting the MC_SIMD environment variable to "scalar" or "avx2" caps it.
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+SimdLevel detectSimdLevel();
+const char *simdLevelName(SimdLevel level);
+int simdLevelWidth(SimdLevel level); // doubles per vector
+
+#endif //
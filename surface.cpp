@@ -0,0 +1,268 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "surface.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+// Paths per chunk, whole batches. Fixed so the chunks, and the order they are
+// merged in, don't depend on the threads; larger than SAMPLE_SLICE because each
+// chunk keeps two accumulators per cell.
+static const long long SURFACE_CHUNK = 16384;
+
+static std::vector<double> sortedUnique(std::vector<double> values, const char *what)
+{
+    if (values.empty())
+    {
+        throw std::invalid_argument(std::string("Surface needs at least one ") + what);
+    }
+    for (double v : values)
+    {
+        if (!(v > 0.0) || !std::isfinite(v))
+        {
+            throw std::invalid_argument(std::string("Surface ") + what + " must be positive");
+        }
+    }
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    return values;
+}
+
+static int greatestCommonDivisor(int a, int b)
+{
+    while (b != 0)
+    {
+        int r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+namespace
+{
+// Everything a pool task needs, read only
+struct SurfaceJob
+{
+    const MonteCarloSimulation *mcs;
+    const std::vector<double> *strikes;
+    const std::vector<double> *expiries;
+    bool exact;
+    bool antithetic;
+    SimdLevel level;
+    // Exact mode: moves of log S from one expiry to the next
+    std::vector<double> drift;
+    std::vector<double> vol;
+    // Stepped mode: step of every expiry, and the engine walking up to the last one,
+    // keeping one price every stride steps (gcd of the expiry steps)
+    std::vector<int> expiry_step;
+    int stride;
+    GbmPathEngine *engine;
+};
+
+// Adds the payoffs of every (expiry, strike) cell to sums and their batch means to stats:
+// calls first, then puts
+void priceBatches(const SurfaceJob &job, long long first, long long count, double *sums, RunningStats *stats)
+{
+    const int BATCH = GbmPathEngine::BATCH;
+    size_t n_strikes = job.strikes->size();
+    size_t n_expiries = job.expiries->size();
+    size_t cells = n_strikes * n_expiries;
+    double log_s[BATCH];
+    double log_a[BATCH];
+    double z[2][BATCH];
+    double sample[2 * BATCH];
+    double below[2 * BATCH + 1]; // below[j]: sum of the j smallest prices
+    std::vector<double> stepped;
+    std::vector<double> stepped_mirror;
+    int points = job.exact ? 0 : job.engine->pathPoints(job.stride);
+    if (!job.exact)
+    {
+        stepped.resize((size_t)BATCH * points);
+        stepped_mirror.resize(job.antithetic ? stepped.size() : 0);
+    }
+    MC_METRIC_SCOPE(STAGE_PAYOFF); // stepped paths are charged by the engine
+    MC_METRIC_COUNT(COUNTER_PATHS, job.antithetic ? 2 * count : count);
+
+    for (long long done = 0; done < count; done += BATCH)
+    {
+        int n = (int)std::min((long long)BATCH, count - done);
+        uint64_t path = (uint64_t)(first + done);
+        if (job.exact)
+        {
+            std::fill(log_s, log_s + n, log(job.mcs->stock.price));
+            std::fill(log_a, log_a + n, log(job.mcs->stock.price));
+        }
+        else
+        {
+            job.engine->simulatePaths(path, n, job.stride, stepped.data(), job.antithetic ? stepped_mirror.data() : NULL);
+        }
+
+        for (size_t e = 0; e < n_expiries; ++e)
+        {
+            // Prices of the batch at this expiry, mirrors included
+            int m = 0;
+            if (job.exact)
+            {
+                // Normal number e of every path: two per Philox block
+                if (e % 2 == 0)
+                {
+                    philoxNormalBlock(job.level, job.mcs->seed, path, e / 2, n, z[0], z[1]);
+                }
+                const double *draw = z[e % 2];
+                gbmAdvance(job.level, log_s, draw, n, job.drift[e], job.vol[e]);
+                for (int p = 0; p < n; ++p)
+                {
+                    sample[m++] = exp(log_s[p]);
+                }
+                if (job.antithetic)
+                {
+                    gbmAdvance(job.level, log_a, draw, n, job.drift[e], -job.vol[e]);
+                    for (int p = 0; p < n; ++p)
+                    {
+                        sample[m++] = exp(log_a[p]);
+                    }
+                }
+            }
+            else
+            {
+                int point = job.expiry_step[e] / job.stride - 1;
+                for (int p = 0; p < n; ++p)
+                {
+                    sample[m++] = stepped[(size_t)p * points + point];
+                }
+                if (job.antithetic)
+                {
+                    for (int p = 0; p < n; ++p)
+                    {
+                        sample[m++] = stepped_mirror[(size_t)p * points + point];
+                    }
+                }
+            }
+
+            std::sort(sample, sample + m);
+            below[0] = 0.0;
+            for (int j = 0; j < m; ++j)
+            {
+                below[j + 1] = below[j] + sample[j];
+            }
+            // Strikes ascending: the count of prices below the strike only moves forward
+            int j = 0;
+            for (size_t k = 0; k < n_strikes; ++k)
+            {
+                double strike = (*job.strikes)[k];
+                while (j < m && sample[j] <= strike)
+                {
+                    ++j;
+                }
+                double call = (below[m] - below[j]) - strike * (m - j);
+                double put = strike * j - below[j];
+                sums[e * n_strikes + k] += call;
+                sums[cells + e * n_strikes + k] += put;
+                stats[e * n_strikes + k].add(call / m);
+                stats[cells + e * n_strikes + k].add(put / m);
+            }
+        }
+    }
+}
+}
+
+OptionSurface estimateSurface(const MonteCarloSimulation &mcs, const std::vector<double> &strikes, const std::vector<double> &expiries, int n_threads)
+{
+    OptionSurface surface;
+    surface.strikes = sortedUnique(strikes, "strike");
+    surface.expiries = sortedUnique(expiries, "expiry");
+    surface.mode = (mcs.mode == PRICING_STEPPED) ? PRICING_STEPPED : PRICING_EXACT_TERMINAL;
+    double sigma = mcs.stock.volatility;
+
+    SurfaceJob job;
+    job.mcs = &mcs;
+    job.strikes = &surface.strikes;
+    job.expiries = &surface.expiries;
+    job.exact = surface.mode == PRICING_EXACT_TERMINAL;
+    job.antithetic = mcs.variance_reduction.antithetic;
+    job.level = detectSimdLevel();
+    job.stride = 1;
+    job.engine = NULL;
+    GbmPathEngine engine(mcs.stock.price, mcs.stock.drift, sigma, mcs.increment, 1, mcs.seed);
+    if (job.exact)
+    {
+        double previous = 0.0;
+        for (double t : surface.expiries)
+        {
+            job.drift.push_back((mcs.stock.drift - 0.5 * sigma * sigma) * (t - previous));
+            job.vol.push_back(sigma * sqrt(t - previous));
+            previous = t;
+        }
+    }
+    else
+    {
+        if (!(mcs.increment > 0.0))
+        {
+            throw std::invalid_argument("Stepped surface needs a positive increment");
+        }
+        // Expiries land on whole steps, two landing on the same one are merged
+        std::vector<double> on_steps;
+        for (double t : surface.expiries)
+        {
+            int step = std::max(1, (int)llround(t / mcs.increment));
+            if (job.expiry_step.empty() || step != job.expiry_step.back())
+            {
+                job.expiry_step.push_back(step);
+                on_steps.push_back(step * mcs.increment);
+            }
+        }
+        // Only the prices at the expiries are kept, not every step
+        job.stride = job.expiry_step[0];
+        for (int step : job.expiry_step)
+        {
+            job.stride = greatestCommonDivisor(job.stride, step);
+        }
+        surface.expiries = on_steps;
+        engine = GbmPathEngine(mcs.stock.price, mcs.stock.drift, sigma, mcs.increment, job.expiry_step.back(), mcs.seed);
+        job.engine = &engine;
+    }
+
+    size_t cells = surface.strikes.size() * surface.expiries.size();
+    long long samples = mcs.sampleCount();
+    std::shared_ptr<ThreadPool> pool = sharedThreadPool();
+    // One set of accumulators per chunk merged in order: same surface at any thread count
+    const long long chunk = SURFACE_CHUNK;
+    long long n_chunks = (samples + chunk - 1) / chunk;
+    std::vector<double> chunk_sums((size_t)n_chunks * 2 * cells, 0.0);
+    std::vector<RunningStats> chunk_stats((size_t)n_chunks * 2 * cells);
+    pool->parallelFor(samples, chunk, [&](int, long long begin, long long end) {
+        size_t offset = (size_t)(begin / chunk) * 2 * cells;
+        priceBatches(job, begin, end - begin, &chunk_sums[offset], &chunk_stats[offset]);
+    }, n_threads);
+
+    // The prices are plain means over the paths, the batch means only give the errors
+    // (a short last batch would otherwise weigh as much as a full one)
+    std::vector<double> sums(2 * cells, 0.0);
+    std::vector<RunningStats> stats(2 * cells);
+    for (long long c = 0; c < n_chunks; ++c)
+    {
+        for (size_t i = 0; i < 2 * cells; ++i)
+        {
+            sums[i] += chunk_sums[(size_t)c * 2 * cells + i];
+            stats[i].merge(chunk_stats[(size_t)c * 2 * cells + i]);
+        }
+    }
+    if (samples == 0)
+    {
+        throw std::invalid_argument("No paths simulated, can't estimate surface");
+    }
+    surface.paths = samples * (job.antithetic ? 2 : 1);
+    surface.call.resize(cells);
+    surface.put.resize(cells);
+    surface.call_std_error.resize(cells);
+    surface.put_std_error.resize(cells);
+    for (size_t i = 0; i < cells; ++i)
+    {
+        surface.call[i] = sums[i] / surface.paths;
+        surface.call_std_error[i] = stats[i].stdError();
+        surface.put[i] = sums[cells + i] / surface.paths;
+        surface.put_std_error[i] = stats[cells + i].stdError();
+    }
+    return surface;
+}
@@ -0,0 +1,34 @@
+#include <vector>
+#include "functions.h"
+#ifndef SURFACE_H
+#define SURFACE_H
+
+/*
+Calls and puts for a whole grid of strikes and expiries from one set of paths.
+Every path is sampled at each expiry and its batch is sorted once, after which
+the payoffs of all the strikes come out of prefix sums. All prices share the
+same noise, so the surface stays smooth across strikes and expiries.
+*/
+struct OptionSurface
+{
+    std::vector<double> strikes;  // ascending
+    std::vector<double> expiries; // ascending, years; stepped paths round them to whole steps
+    // Undiscounted mean payoffs like estimateOption, [e * strikes.size() + k]
+    std::vector<double> call;
+    std::vector<double> put;
+    std::vector<double> call_std_error;
+    std::vector<double> put_std_error;
+    PricingMode mode; // never PRICING_AUTO
+    long long paths;
+
+    double callPrice(size_t e, size_t k) const { return call[e * strikes.size() + k]; }
+    double putPrice(size_t e, size_t k) const { return put[e * strikes.size() + k]; }
+};
+
+// Paths of mcs.stock with mcs.iterations, seed and increment (mcs.duration is not used:
+// paths run to the last expiry). Exact lognormal increments between expiries unless
+// mcs.mode is PRICING_STEPPED. Antithetics are honored, moment matching and control
+// variates aren't used. Errors come from the spread of the means of batches of paths.
+OptionSurface estimateSurface(const MonteCarloSimulation &mcs, const std::vector<double> &strikes, const std::vector<double> &expiries, int n_threads);
+
+#endif //
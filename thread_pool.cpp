@@ -0,0 +1,219 @@
+#include <algorithm>
+#include "thread_pool.h"
+#include "metrics.h"
+
+static thread_local int current_worker = -1;
+static thread_local const ThreadPool *current_pool = NULL;
+
+ThreadPool::ThreadPool(int n_threads) : queued(0), next_queue(0), stopping(false)
+{
+    n_threads = std::max(1, n_threads);
+    for (int i = 0; i < n_threads; ++i)
+    {
+        queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+    }
+    for (int i = 0; i < n_threads; ++i)
+    {
+        threads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+int ThreadPool::currentWorker()
+{
+    return current_worker;
+}
+
+void ThreadPool::push(int queue, const Task &task)
+{
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.push_back(task);
+    }
+    {
+        // Taken so a worker can't miss the wakeup between its check and its wait
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued.fetch_add(1);
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::submit(const Task &task)
+{
+    int queue = (current_pool == this) ? current_worker : (int)(next_queue.fetch_add(1) % queues.size());
+    push(queue, task);
+}
+
+bool ThreadPool::tryPop(int worker, Task &task)
+{
+    // Own work first, newest first (still warm in cache)
+    {
+        WorkerQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued.fetch_sub(1);
+            return true;
+        }
+    }
+    // Then steal the oldest task of another worker
+    int n = (int)queues.size();
+    for (int i = 1; i < n; ++i)
+    {
+        WorkerQueue &victim = *queues[(worker + i) % n];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(int id)
+{
+    current_worker = id;
+    current_pool = this;
+    while (true)
+    {
+        Task task;
+        if (tryPop(id, task))
+        {
+            MC_METRIC_TASK();
+            task(id);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        {
+            MC_METRIC_SCOPE(STAGE_WAIT);
+            wake.wait(lock, [this]() { return stopping || queued.load() > 0; });
+        }
+        if (stopping && queued.load() == 0)
+        {
+            return;
+        }
+    }
+}
+
+int ThreadPool::workerCount(int max_workers) const
+{
+    return max_workers > 0 ? std::min(max_workers, size()) : size();
+}
+
+void ThreadPool::parallelFor(long long total, long long chunk, const RangeTask &fn, int max_workers)
+{
+    if (total <= 0)
+    {
+        return;
+    }
+    chunk = std::max(1LL, chunk);
+    long long n_chunks = (total + chunk - 1) / chunk;
+    int runners = (int)std::min<long long>(n_chunks, workerCount(max_workers));
+
+    struct Latch
+    {
+        std::atomic<long long> next_chunk;
+        std::atomic<int> remaining; // runners still going
+        std::atomic<bool> failed;
+        std::exception_ptr error;   // the first one, under mutex
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    std::shared_ptr<Latch> latch(new Latch());
+    latch->next_chunk = 0;
+    latch->remaining = runners;
+    latch->failed = false;
+
+    int n = (int)queues.size();
+    int first_queue = (current_pool == this) ? current_worker : (int)(next_queue.fetch_add(1) % n);
+    const RangeTask *body = &fn; // fn outlives the tasks: we wait for all of them below
+    for (int r = 0; r < runners; ++r)
+    {
+        push((first_queue + r) % n, [latch, body, total, chunk, n_chunks](int worker) {
+            while (!latch->failed.load())
+            {
+                long long c = latch->next_chunk.fetch_add(1);
+                if (c >= n_chunks)
+                {
+                    break;
+                }
+                long long begin = c * chunk;
+                try
+                {
+                    (*body)(worker, begin, std::min(total, begin + chunk));
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(latch->mutex);
+                    if (!latch->error)
+                    {
+                        latch->error = std::current_exception();
+                    }
+                    latch->failed = true;
+                }
+            }
+            // Released even after a throw, or the caller would wait forever
+            if (latch->remaining.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(latch->mutex);
+                latch->done.notify_all();
+            }
+        });
+    }
+
+    if (current_pool == this)
+    {
+        // Nested call from one of our workers: run tasks until our chunks are done
+        while (latch->remaining.load() > 0)
+        {
+            Task task;
+            if (tryPop(current_worker, task))
+            {
+                task(current_worker);
+            }
+            else
+            {
+                MC_METRIC_SCOPE(STAGE_WAIT);
+                std::this_thread::yield();
+            }
+        }
+    }
+    else
+    {
+        MC_METRIC_SCOPE(STAGE_WAIT);
+        std::unique_lock<std::mutex> lock(latch->mutex);
+        latch->done.wait(lock, [&latch]() { return latch->remaining.load() == 0; });
+    }
+    // Every runner is done, nobody writes error any more
+    if (latch->error)
+    {
+        std::rethrow_exception(latch->error);
+    }
+}
+
+std::shared_ptr<ThreadPool> sharedThreadPool()
+{
+    // Thread safe initialization, and the pool lives until exit
+    static std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>(std::max(1, (int)std::thread::hardware_concurrency()));
+    return pool;
+}
@@ -0,0 +1,72 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <exception>
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/*
+Long lived work stealing pool.
+Every worker has its own deque: it pops its own tasks from the back and, when
+empty, steals from the front of the other workers' deques. parallelFor cuts a
+range into chunks handed out one at a time to a few runner tasks spread over the
+deques, so slow chunks get rebalanced. Capping the runners caps the threads a
+call uses, so callers asking for fewer threads share the one pool instead of
+building their own.
+*/
+class ThreadPool
+{
+public:
+    typedef std::function<void(int worker)> Task;
+    // fn(worker, begin, end), worker in [0, size()) identifies the calling worker
+    typedef std::function<void(int worker, long long begin, long long end)> RangeTask;
+
+    explicit ThreadPool(int n_threads);
+    ~ThreadPool();
+
+    int size() const { return (int)threads.size(); }
+
+    // The task must not throw: on a worker that ends the program
+    void submit(const Task &task);
+    // Runs fn over [0, total) in chunks of at most chunk items and blocks until done,
+    // on at most max_workers threads at once (0: all of them).
+    // Can be called from inside a task: the calling worker then helps instead of blocking.
+    // If fn throws, no new chunk is started and the first exception is rethrown here
+    // once the chunks already running are done.
+    void parallelFor(long long total, long long chunk, const RangeTask &fn, int max_workers = 0);
+    // Threads a parallelFor capped at max_workers runs on
+    int workerCount(int max_workers) const;
+
+    // Index of the calling thread in its pool, -1 outside any pool
+    static int currentWorker();
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<long long> queued;
+    std::atomic<unsigned> next_queue;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void push(int queue, const Task &task);
+    bool tryPop(int worker, Task &task);
+    void workerLoop(int id);
+};
+
+// Pool shared by every pricing call, one thread per core, built on first use and never
+// rebuilt: callers cap their own calls with parallelFor's max_workers.
+std::shared_ptr<ThreadPool> sharedThreadPool();
+
+#endif //
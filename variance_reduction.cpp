@@ -0,0 +1,88 @@
+#include <cmath>
+#include <algorithm>
+#include "variance_reduction.h"
+
+const char *controlVariateName(ControlVariate control)
+{
+    switch (control)
+    {
+    case CV_TERMINAL_STOCK:
+        return "terminal stock";
+    case CV_BLACK_SCHOLES:
+        return "black-scholes";
+    default:
+        return "none";
+    }
+}
+
+VarianceReduction noVarianceReduction()
+{
+    VarianceReduction vr;
+    vr.antithetic = false;
+    vr.control = CV_NONE;
+    vr.moment_matching = false;
+    return vr;
+}
+
+EstimatorAccumulator::EstimatorAccumulator(bool use_control, double control_mean) : use_control(use_control), control_mean(control_mean) {}
+
+EstimatorAccumulator::State EstimatorAccumulator::state() const
+{
+    State state = {crude.state(), samples.state()};
+    return state;
+}
+
+void EstimatorAccumulator::restore(const State &state)
+{
+    crude = RunningStats(state.crude);
+    samples = RunningCovariance(state.samples);
+}
+
+void EstimatorAccumulator::merge(const EstimatorAccumulator &other)
+{
+    crude.merge(other.crude);
+    samples.merge(other.samples);
+}
+
+static double controlBeta(const RunningCovariance &samples)
+{
+    double var_x = samples.varianceX();
+    return (var_x > 0.0) ? samples.covariance() / var_x : 0.0;
+}
+
+double EstimatorAccumulator::estimate() const
+{
+    if (!use_control)
+    {
+        return samples.meanY();
+    }
+    return samples.meanY() - controlBeta(samples) * (samples.meanX() - control_mean);
+}
+
+double EstimatorAccumulator::stdError() const
+{
+    long long n = samples.count();
+    if (n < 2)
+    {
+        return 0.0;
+    }
+    double variance = samples.varianceY();
+    if (use_control)
+    {
+        // Residual variance of y once regressed on the control
+        variance -= controlBeta(samples) * samples.covariance();
+        variance = std::max(variance, 0.0);
+    }
+    return sqrt(variance / samples.totalWeight());
+}
+
+double EstimatorAccumulator::reductionFactor() const
+{
+    double se = stdError();
+    if (crude.count() < 2)
+    {
+        return 1.0;
+    }
+    double crude_se2 = crude.variance() / (double)crude.count();
+    return (se > 0.0) ? crude_se2 / (se * se) : HUGE_VAL;
+}
@@ -0,0 +1,66 @@
+#include "running_stats.h"
+#ifndef VARIANCE_REDUCTION_H
+#define VARIANCE_REDUCTION_H
+
+enum ControlVariate
+{
+    CV_NONE,
+    CV_TERMINAL_STOCK, // S_T, E[S_T] = S0 exp(mu T)
+    // Vanilla of the same type struck at the forward S0 exp(mu T), expectation from
+    // bsOptionPrice. An option struck within 5% of the forward gets a control 10% out
+    // of the money instead: the control must not be the payoff itself.
+    CV_BLACK_SCHOLES
+};
+const char *controlVariateName(ControlVariate control);
+
+struct VarianceReduction
+{
+    bool antithetic;      // simulate every path together with its mirror (-Z)
+    ControlVariate control;
+    bool moment_matching; // normals of each step rescaled to mean 0, variance 1 per group of paths
+};
+VarianceReduction noVarianceReduction();
+
+/*
+Accumulates one estimator with variance reduction.
+A sample is one path, the average of a path and its mirror with antithetics, or
+the average of a whole moment matching group (GbmPathEngine::MOMENT_GROUP), weighted
+by the number of samples in it.
+Every simulated path also goes into a crude accumulator, which gives the
+variance plain Monte Carlo would have had with the same number of paths.
+With a control variate the estimate is mean(Y) - beta (mean(X) - E[X]),
+beta = cov(X, Y) / var(X) estimated from the same samples.
+*/
+class EstimatorAccumulator
+{
+private:
+    RunningStats crude;
+    RunningCovariance samples; // x = control, y = sample
+    bool use_control;
+    double control_mean;
+
+public:
+    struct State
+    {
+        RunningStats::State crude;
+        RunningCovariance::State samples;
+    };
+
+    EstimatorAccumulator(bool use_control = false, double control_mean = 0.0);
+
+    void addPath(double payoff) { crude.add(payoff); }
+    void addSample(double y, double control, double weight = 1.0) { samples.add(control, y, weight); }
+    void merge(const EstimatorAccumulator &other);
+    // The accumulated samples only, the control settings stay those of this accumulator
+    State state() const;
+    void restore(const State &state);
+
+    long long paths() const { return crude.count(); }
+    double estimate() const;
+    double stdError() const;
+    // Crude Monte Carlo variance / variance of this estimator, same number of paths.
+    // Infinite when the control explains the payoff exactly.
+    double reductionFactor() const;
+};
+
+#endif //